@@ -0,0 +1,59 @@
+#include "allocs.h"
+#include <errno.h>
+#include <stddef.h>
+
+/* glibc's own entry points, which the wrappers below hand on to */
+void* __libc_malloc(size_t n);
+void* __libc_calloc(size_t nmemb, size_t n);
+void* __libc_realloc(void* p, size_t n);
+void* __libc_memalign(size_t align, size_t n);
+void  __libc_free(void* p);
+
+static _Thread_local uint64_t count __attribute__((tls_model("initial-exec")));
+
+uint64_t alloc_count()
+{
+	return count;
+}
+
+void* malloc(size_t n)
+{
+	count++;
+	return __libc_malloc(n);
+}
+
+void* calloc(size_t nmemb, size_t n)
+{
+	count++;
+	return __libc_calloc(nmemb,n);
+}
+
+void* realloc(void* p, size_t n)
+{
+	count++;
+	return __libc_realloc(p,n);
+}
+
+void* memalign(size_t align, size_t n)
+{
+	count++;
+	return __libc_memalign(align,n);
+}
+
+void* aligned_alloc(size_t align, size_t n)
+{
+	return memalign(align,n);
+}
+
+int posix_memalign(void** p, size_t align, size_t n)
+{
+	void* q = memalign(align,n);
+	if (!q) return ENOMEM;
+	*p = q;
+	return 0;
+}
+
+void free(void* p)
+{
+	__libc_free(p);
+}
@@ -0,0 +1,15 @@
+/* FOR TESTS AND BENCHMARKS ONLY: linking allocs.o into a program replaces
+ * malloc and friends with wrappers that count each thread's heap
+ * allocations, so a test can check that a code path doesn't allocate. */
+#pragma once
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/** Number of heap allocations (malloc, calloc, realloc, aligned
+ * allocations) this thread has made so far. */
+uint64_t alloc_count();
+#ifdef __cplusplus
+}
+#endif
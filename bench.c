@@ -0,0 +1,404 @@
+/* microbenchmarks for the crypto and handshake primitives.  Prints one
+ * tab separated line per benchmark (see header below), so runs can be
+ * diffed or fed to a script to spot regressions.  Linked with allocs.o,
+ * so it also reports heap allocations per op, and fails (exit status 1)
+ * if the message path makes any. */
+#include "allocs.h"
+#include "dh.h"
+#include "keys.h"
+#include "record.h"
+#include "ring.h"
+#include "rng.h"
+#include "session.h"
+#include "util.h"
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_MIN_MS 200 /* default time to spend on each measurement */
+#define BENCH_REPS   3   /* measurements per benchmark; the best is reported */
+
+static int64_t minNs = BENCH_MIN_MS * 1000000LL;
+static char** filters;   /* only run benchmarks whose name contains one */
+static int nfilters;
+
+static int64_t nowNs()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC,&t);
+	return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static int selected(const char* name)
+{
+	if (!nfilters) return 1;
+	for (int i = 0; i < nfilters; i++)
+		if (strstr(name,filters[i])) return 1;
+	return 0;
+}
+
+/* time fn(n) for n large enough to take minNs, then report the best of
+ * BENCH_REPS runs, and the allocations per op of the last (warmest) one.
+ * bytes is the amount of data per op (0 if that makes no sense), for the
+ * throughput column.  Returns those allocations per op (0 if skipped). */
+static double measure(const char* name, size_t bytes, void (*fn)(size_t n))
+{
+	if (!selected(name)) return 0;
+	size_t n = 1;
+	int64_t t;
+	uint64_t allocs;
+	for (;;) {
+		int64_t t0 = nowNs();
+		uint64_t a0 = alloc_count();
+		fn(n);
+		t = nowNs() - t0;
+		allocs = alloc_count() - a0;
+		if (t >= minNs) break;
+		/* aim a bit past minNs, but don't grow more than 100x at once */
+		double grow = (t > 0) ? 1.2 * minNs / t : 100;
+		n = (grow > 100) ? n * 100 : (size_t)(n * grow) + 1;
+	}
+	int64_t best = t;
+	/* anything slower than minNs per op has been measured enough already */
+	for (int r = 1; r < BENCH_REPS && n > 1; r++) {
+		int64_t t0 = nowNs();
+		uint64_t a0 = alloc_count();
+		fn(n);
+		t = nowNs() - t0;
+		allocs = alloc_count() - a0;
+		if (t < best) best = t;
+	}
+	double ns = (double)best / n;
+	printf("%s\t%zu\t%zu\t%.1f\t%.0f\t", name, bytes, n, ns, 1e9 / ns);
+	if (bytes)
+		printf("%.2f\t", bytes * 1e3 / ns);
+	else
+		printf("-\t");
+	printf("%.3g\n", (double)allocs / n);
+	fflush(stdout);
+	return (double)allocs / n;
+}
+
+/* ---- parameters ---- */
+
+static char paramsCopy[PATH_MAX];  /* private copy, so we own its cache */
+static char cacheName[PATH_MAX+8];
+
+static void clearParams()
+{
+	mpz_clear(q);
+	mpz_clear(p);
+	mpz_clear(g);
+}
+
+static void benchInitValidate(size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		unlink(cacheName);
+		clearParams();
+		if (init(paramsCopy) != 0) exit(1);
+	}
+}
+
+static void benchInitCached(size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		clearParams();
+		if (init(paramsCopy) != 0) exit(1);
+	}
+}
+
+static int copyFile(const char* from, const char* to)
+{
+	FILE* in = fopen(from,"rb");
+	FILE* out = in ? fopen(to,"wb") : NULL;
+	char buf[4096];
+	size_t len;
+	int rv = (in && out) ? 0 : -1;
+	while (rv == 0 && (len = fread(buf,1,sizeof(buf),in)) > 0)
+		if (fwrite(buf,1,len,out) != len) rv = -1;
+	if (in && ferror(in)) rv = -1;
+	if (out && fclose(out) != 0) rv = -1;
+	if (in) fclose(in);
+	return rv;
+}
+
+/* ---- key generation and agreement ---- */
+
+static mpz_t a, A, x, X, b, B, y, Y;       /* finite field */
+static mpz_t a2, A2, x2, X2, b2, B2, y2, Y2; /* X25519 */
+
+static void benchDhGen(size_t n)
+{
+	NEWZ(sk); NEWZ(pk);
+	for (size_t i = 0; i < n; i++)
+		dhGen(sk,pk);
+	mpz_clear(sk); mpz_clear(pk);
+}
+
+static void benchDhGenX25519(size_t n)
+{
+	NEWZ(sk); NEWZ(pk);
+	for (size_t i = 0; i < n; i++)
+		dhGenX25519(sk,pk);
+	mpz_clear(sk); mpz_clear(pk);
+}
+
+static void benchDh3Final(size_t n)
+{
+	unsigned char km[REC_KEYMAT];
+	for (size_t i = 0; i < n; i++)
+		dh3Final(a,A,x,X,B,Y,km,sizeof(km));
+}
+
+static void benchDh3FinalX25519(size_t n)
+{
+	unsigned char km[REC_KEYMAT];
+	for (size_t i = 0; i < n; i++)
+		dh3FinalX25519(a2,A2,x2,X2,B2,Y2,km,sizeof(km));
+}
+
+/* ---- records ---- */
+
+static recordState cli, srv;
+static size_t msgLen;
+static unsigned char msg[REC_MAXDATA];
+static unsigned char rec[REC_MAXLEN];
+static ssize_t recLen;
+static uint64_t recSeq;           /* sequence number rec was sent with */
+
+static void benchProtect(size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		record_protect(&cli,msg,msgLen,rec,sizeof(rec));
+}
+
+/* NOTE: the CTR stream runs on across records, so only the first replay
+ * decrypts correctly; the work done is the same either way. */
+static void benchUnprotect(size_t n)
+{
+	unsigned char pt[REC_MAXDATA];
+	for (size_t i = 0; i < n; i++) {
+		srv.in.seq = recSeq; /* replay the same record */
+		record_unprotect(&srv,rec,recLen,pt,sizeof(pt));
+	}
+}
+
+/* ---- the whole message path: what chat does per message, through the
+ * session API and the inbox ring, with the socket being a socketpair ---- */
+
+static chatSession sndSess, rcvSess;
+static spscRing inbox;
+
+static void benchMessage(size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		if (session_send(&sndSess,msg,msgLen) != 0) {
+			fprintf(stderr, "message path: send failed\n");
+			exit(1);
+		}
+		void* in = ring_reserve_wait(&inbox,REC_MAXDATA);
+		ssize_t len = session_recv(&rcvSess,in,REC_MAXDATA);
+		if (len != (ssize_t)msgLen) {
+			fprintf(stderr, "message path: record lost\n");
+			exit(1);
+		}
+		ring_commit(&inbox,len);
+		size_t cursor = ring_cursor(&inbox), got;
+		while (ring_next(&inbox,&cursor,&got))
+			;
+		ring_release(&inbox,cursor);
+	}
+}
+
+/* ---- serialization and fingerprints ---- */
+
+static int nullfd, mpzfd;
+static dhKey ffKey, xKey;
+
+static void benchSerialize(size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		serialize_mpz(nullfd,p);
+}
+
+static void benchDeserialize(size_t n)
+{
+	NEWZ(t);
+	for (size_t i = 0; i < n; i++) {
+		lseek(mpzfd,0,SEEK_SET);
+		deserialize_mpz(t,mpzfd);
+	}
+	mpz_clear(t);
+}
+
+static void benchHashPK(size_t n)
+{
+	char hash[65];
+	for (size_t i = 0; i < n; i++)
+		hashPK(&ffKey,hash);
+}
+
+static void benchHashPKX25519(size_t n)
+{
+	char hash[65];
+	for (size_t i = 0; i < n; i++)
+		hashPK(&xKey,hash);
+}
+
+static void benchHashPKbin(size_t n)
+{
+	unsigned char hash[32];
+	for (size_t i = 0; i < n; i++)
+		hashPKbin(&ffKey,hash);
+}
+
+static const char* usage =
+"Usage: %s [OPTIONS] [NAME...]\n"
+"Time the crypto primitives; only those whose name contains one of the\n"
+"NAMEs, if any are given.\n\n"
+"   -p, --params FILE   DH parameters (defaults to params).\n"
+"   -t, --time   MS     Spend at least MS per measurement (default %d).\n"
+"   -h, --help          show this message and exit.\n\n"
+"Output: benchmark, bytes/op, iterations, ns/op, ops/s, MB/s, heap\n"
+"allocations/op.  Exits with status 1 if any message/ benchmark allocates.\n";
+
+int main(int argc, char* argv[])
+{
+	static struct option long_opts[] = {
+		{"params", required_argument, 0, 'p'},
+		{"time",   required_argument, 0, 't'},
+		{"help",   no_argument,       0, 'h'},
+		{0,0,0,0}
+	};
+	const char* params = "params";
+	int c;
+	while ((c = getopt_long(argc, argv, "p:t:h", long_opts, NULL)) != -1) {
+		switch (c) {
+			case 'p':
+				params = optarg;
+				break;
+			case 't':
+				minNs = atoll(optarg) * 1000000LL;
+				break;
+			case 'h':
+				printf(usage,argv[0],BENCH_MIN_MS);
+				return 0;
+			default:
+				fprintf(stderr,usage,argv[0],BENCH_MIN_MS);
+				return 1;
+		}
+	}
+	filters = argv + optind;
+	nfilters = argc - optind;
+
+	char dir[] = "/tmp/bench.XXXXXX";
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	snprintf(paramsCopy,sizeof(paramsCopy),"%s/params",dir);
+	snprintf(cacheName,sizeof(cacheName),"%s.cache",paramsCopy);
+	if (copyFile(params,paramsCopy) != 0 || init(paramsCopy) != 0) {
+		fprintf(stderr, "could not read DH params from %s\n", params);
+		return 1;
+	}
+
+	printf("# benchmark\tbytes\titers\tns/op\tops/s\tMB/s\tallocs/op\n");
+	measure("init/validate",0,benchInitValidate);
+	measure("init/cached",0,benchInitCached);
+	unlink(cacheName);
+	unlink(paramsCopy);
+	rmdir(dir);
+
+	mpz_inits(a,A,x,X,b,B,y,Y,a2,A2,x2,X2,b2,B2,y2,Y2,NULL);
+	dhGen(a,A); dhGen(x,X); dhGen(b,B); dhGen(y,Y);
+	dhGenX25519(a2,A2); dhGenX25519(x2,X2); dhGenX25519(b2,B2); dhGenX25519(y2,Y2);
+	measure("dhGen/ff",0,benchDhGen);
+	measure("dhGen/x25519",0,benchDhGenX25519);
+	measure("dh3Final/ff",0,benchDh3Final);
+	measure("dh3Final/x25519",0,benchDh3FinalX25519);
+
+	unsigned char keymat[REC_KEYMAT], civ[REC_IVLEN], siv[REC_IVLEN];
+	if (rng_bytes(keymat,sizeof(keymat)) || rng_bytes(civ,sizeof(civ)) ||
+			rng_bytes(siv,sizeof(siv)) || rng_bytes(msg,sizeof(msg))) {
+		fprintf(stderr, "could not set up records\n");
+		return 1;
+	}
+	static const size_t sizes[] = {16, 64, 256, 1024, REC_MAXDATA};
+	for (size_t i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++) {
+		char name[64];
+		msgLen = sizes[i];
+		if (record_init(&cli,keymat,civ,siv,1) != 0) return 1;
+		snprintf(name,sizeof(name),"record_protect/%zu",msgLen);
+		measure(name,msgLen,benchProtect);
+		/* both sides fresh, so this one should come through intact */
+		record_cleanup(&cli);
+		if (record_init(&cli,keymat,civ,siv,1) != 0 ||
+				record_init(&srv,keymat,civ,siv,0) != 0) return 1;
+		recSeq = cli.out.seq;
+		recLen = record_protect(&cli,msg,msgLen,rec,sizeof(rec));
+		unsigned char pt[REC_MAXDATA];
+		if (record_unprotect(&srv,rec,recLen,pt,sizeof(pt)) != (ssize_t)msgLen ||
+				memcmp(pt,msg,msgLen) != 0) {
+			fprintf(stderr, "record round trip failed at %zu bytes\n", msgLen);
+			return 1;
+		}
+		snprintf(name,sizeof(name),"record_unprotect/%zu",msgLen);
+		measure(name,msgLen,benchUnprotect);
+		record_cleanup(&cli);
+		record_cleanup(&srv);
+	}
+	int msgfd[2];
+	if (socketpair(AF_UNIX,SOCK_STREAM,0,msgfd) != 0 ||
+			ring_init(&inbox,1 << 20) != 0) {
+		perror("message path");
+		return 1;
+	}
+	sndSess.fd = msgfd[0];
+	rcvSess.fd = msgfd[1];
+	/* the message path must not touch the heap: a leak or a missing
+	 * buffer class shows up here first */
+	int allocating = 0;
+	for (size_t i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++) {
+		char name[64];
+		msgLen = sizes[i];
+		if (record_init(&sndSess.rs,keymat,civ,siv,1) != 0 ||
+				record_init(&rcvSess.rs,keymat,civ,siv,0) != 0) return 1;
+		snprintf(name,sizeof(name),"message/%zu",msgLen);
+		if (measure(name,msgLen,benchMessage) > 0) {
+			fprintf(stderr, "%s: heap allocations on the message path\n", name);
+			allocating = 1;
+		}
+		record_cleanup(&sndSess.rs);
+		record_cleanup(&rcvSess.rs);
+	}
+	ring_free(&inbox);
+
+	nullfd = open("/dev/null",O_WRONLY);
+	FILE* f = tmpfile();
+	if (nullfd < 0 || !f) {
+		perror("bench");
+		return 1;
+	}
+	mpzfd = fileno(f);
+	size_t plen = serialize_mpz(mpzfd,p);
+	measure("serialize_mpz/p",plen,benchSerialize);
+	measure("deserialize_mpz/p",plen,benchDeserialize);
+
+	initKey(&ffKey);
+	initKey(&xKey);
+	mpz_set(ffKey.PK,A);
+	xKey.group = DH_GROUP_X25519;
+	mpz_set(xKey.PK,A2);
+	measure("hashPK/ff",0,benchHashPK);
+	measure("hashPK/x25519",0,benchHashPKX25519);
+	measure("hashPKbin/ff",0,benchHashPKbin);
+	return allocating;
+}
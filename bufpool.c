@@ -0,0 +1,130 @@
+#include "bufpool.h"
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdlib.h>
+
+/* every buffer is preceded by this; the pointer handed out is just past it */
+typedef union bpHeader {
+	struct {
+		size_t cls;             /* size class, or BP_CLASSES if malloc'd */
+		size_t size;
+		union bpHeader* next;   /* while in the depot */
+	};
+	max_align_t align;
+} bpHeader;
+
+/* shared free lists, one per class */
+static struct {
+	pthread_mutex_t lock;
+	bpHeader* free;
+} depot[BP_CLASSES] = {
+#define D {PTHREAD_MUTEX_INITIALIZER, NULL}
+	D, D, D, D, D, D
+#undef D
+};
+_Static_assert(BP_CLASSES == 6, "update depot's initializer");
+
+typedef struct {
+	bpHeader* b[BP_CLASSES][BP_CACHE];
+	int n[BP_CLASSES];
+} bpCache;
+
+static _Thread_local bpCache cache;
+static pthread_key_t flushKey;
+static pthread_once_t keyOnce = PTHREAD_ONCE_INIT;
+static _Thread_local int registered;
+
+static size_t classSize(size_t cls)
+{
+	return (size_t)BP_MINSIZE << cls;
+}
+
+/* move the n newest buffers of class cls from this thread's cache to the
+ * depot */
+static void spill(size_t cls, int n)
+{
+	bpCache* c = &cache;
+	pthread_mutex_lock(&depot[cls].lock);
+	while (n-- > 0) {
+		bpHeader* h = c->b[cls][--c->n[cls]];
+		h->next = depot[cls].free;
+		depot[cls].free = h;
+	}
+	pthread_mutex_unlock(&depot[cls].lock);
+}
+
+/* thread exit: don't strand its cached buffers */
+static void flush(void*)
+{
+	for (size_t cls = 0; cls < BP_CLASSES; cls++)
+		spill(cls,cache.n[cls]);
+}
+
+static void makeKey()
+{
+	pthread_key_create(&flushKey,flush);
+}
+
+/* make sure flush runs when this thread exits */
+static void enroll()
+{
+	pthread_once(&keyOnce,makeKey);
+	pthread_setspecific(flushKey,&cache); /* (it must not be NULL) */
+	registered = 1;
+}
+
+/* refill half of this thread's cache of class cls from the depot */
+static void refill(size_t cls)
+{
+	bpCache* c = &cache;
+	if (!registered) enroll();
+	pthread_mutex_lock(&depot[cls].lock);
+	while (c->n[cls] < BP_CACHE/2 && depot[cls].free) {
+		bpHeader* h = depot[cls].free;
+		depot[cls].free = h->next;
+		c->b[cls][c->n[cls]++] = h;
+	}
+	pthread_mutex_unlock(&depot[cls].lock);
+}
+
+static bpHeader* newBuffer(size_t cls, size_t size)
+{
+	bpHeader* h = malloc(sizeof(bpHeader) + size);
+	if (!h) return NULL;
+	h->cls = cls;
+	h->size = size;
+	return h;
+}
+
+void* bp_get(size_t len)
+{
+	size_t cls = 0;
+	while (cls < BP_CLASSES && classSize(cls) < len) cls++;
+	bpHeader* h;
+	if (cls == BP_CLASSES) {
+		h = newBuffer(cls,len);
+	} else {
+		if (!cache.n[cls]) refill(cls);
+		h = cache.n[cls] ? cache.b[cls][--cache.n[cls]] : newBuffer(cls,classSize(cls));
+	}
+	return h ? h + 1 : NULL;
+}
+
+void bp_put(void* buf)
+{
+	if (!buf) return;
+	bpHeader* h = (bpHeader*)buf - 1;
+	size_t cls = h->cls;
+	if (cls == BP_CLASSES) {
+		free(h);
+		return;
+	}
+	if (!registered) enroll();
+	if (cache.n[cls] == BP_CACHE) spill(cls,BP_CACHE/2);
+	cache.b[cls][cache.n[cls]++] = h;
+}
+
+size_t bp_size(const void* buf)
+{
+	return ((const bpHeader*)buf - 1)->size;
+}
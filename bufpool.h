@@ -0,0 +1,26 @@
+/* Pooled message buffers in a few size classes.  Each thread keeps a small
+ * cache of free buffers per class, so getting and returning one is a few
+ * instructions with no locking; only when a thread's cache runs empty or
+ * overflows does it trade a batch with a shared depot (under a lock).  A
+ * buffer may be returned by a different thread than the one that got it.
+ * Once warm, a message path built on these doesn't touch the heap. */
+#pragma once
+#include <stddef.h>
+
+#define BP_MINSIZE 128 /* smallest class; each next one is twice as big */
+#define BP_CLASSES 6   /* so the largest is 4K, enough for any record */
+#define BP_CACHE   32  /* buffers per class a thread keeps to itself */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/** Get a buffer of at least len bytes.  Requests bigger than the largest
+ * class fall back to malloc.  @return the buffer, or NULL if out of memory. */
+void* bp_get(size_t len);
+/** Give buf (from bp_get; may be NULL) back to the pool. */
+void bp_put(void* buf);
+/** @return how many bytes buf can actually hold. */
+size_t bp_size(const void* buf);
+#ifdef __cplusplus
+}
+#endif
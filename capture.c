@@ -0,0 +1,123 @@
+#include "capture.h"
+#include "log.h"
+#include "util.h"
+#include <endian.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define CAP_HDRLEN   (8 + 2 + RNG_SEEDLEN)
+#define CAP_CHUNKHDR (8 + 1 + 4)
+
+static int putChunk(capture* c, int dir, const unsigned char* buf, size_t len)
+{
+	unsigned char hdr[CAP_CHUNKHDR];
+	uint64_t t_le = htole64(monotonic_ns() - c->t0);
+	uint32_t len_le = htole32(len);
+	memcpy(hdr,&t_le,8);
+	hdr[8] = dir;
+	memcpy(hdr+9,&len_le,4);
+	return (fwrite(hdr,1,CAP_CHUNKHDR,c->f) == CAP_CHUNKHDR &&
+			fwrite(buf,1,len,c->f) == len) ? 0 : -1;
+}
+
+/* copy both ways until both sides have closed, logging as we go.  A side
+ * that closes (or fails) gets its direction shut down on the other. */
+static void* relayLoop(void* arg)
+{
+	capture* c = arg;
+	unsigned char* buf = malloc(CAP_MAXCHUNK);
+	struct pollfd pfd[2] = {{c->net, POLLIN, 0}, {c->app, POLLIN, 0}};
+	int open[2] = {1, 1}; /* net -> app (in), app -> net (out) */
+	while (buf && (open[0] || open[1])) {
+		if (poll(pfd,2,-1) < 0) {
+			if (errno == EINTR) continue;
+			break;
+		}
+		for (int i = 0; i < 2; i++) {
+			if (!open[i] || !pfd[i].revents) continue;
+			int from = pfd[i].fd, to = pfd[1-i].fd;
+			ssize_t n = read(from,buf,CAP_MAXCHUNK);
+			if (n < 0 && errno == EINTR) continue;
+			if (n > 0 && putChunk(c,i ? CAP_OUT : CAP_IN,buf,n) != 0)
+				LOGW("capture: could not write the capture file");
+			if (n <= 0 || xwrite_deadline(to,buf,n,0,-1) != 0) {
+				shutdown(to,SHUT_WR);
+				open[i] = 0;
+				pfd[i].fd = -1; /* poll skips it */
+			}
+		}
+	}
+	free(buf);
+	return NULL;
+}
+
+int cap_start(capture* c, int sockfd, const char* fname, int isclient, int groupPref)
+{
+	unsigned char hdr[CAP_HDRLEN];
+	int sv[2];
+	memcpy(hdr,CAP_MAGIC,8);
+	hdr[8] = isclient;
+	hdr[9] = (groupPref < 0) ? 0xff : groupPref;
+	if (rng_bytes(hdr+10,RNG_SEEDLEN) != 0 ||
+			!(c->f = fopen(fname,"wb")))
+		return -1;
+	if (fwrite(hdr,1,CAP_HDRLEN,c->f) != CAP_HDRLEN ||
+			socketpair(AF_UNIX,SOCK_STREAM,0,sv) != 0) {
+		fclose(c->f);
+		return -1;
+	}
+	c->net = sockfd;
+	c->app = sv[1]; /* the relay's end; the application gets sv[0] */
+	c->t0 = monotonic_ns();
+	if (pthread_create(&c->relay,NULL,relayLoop,c) != 0) {
+		close(sv[0]);
+		close(sv[1]);
+		fclose(c->f);
+		return -1;
+	}
+	rng_set_seed(hdr+10);
+	memset(hdr+10,0,RNG_SEEDLEN);
+	return sv[0];
+}
+
+void cap_finish(capture* c)
+{
+	pthread_join(c->relay,NULL);
+	close(c->app);
+	close(c->net);
+	fclose(c->f);
+}
+
+int cap_read_header(FILE* f, capHeader* h)
+{
+	unsigned char hdr[CAP_HDRLEN];
+	if (fread(hdr,1,CAP_HDRLEN,f) != CAP_HDRLEN || memcmp(hdr,CAP_MAGIC,8) != 0)
+		return -1;
+	h->isclient = hdr[8];
+	h->groupPref = (hdr[9] == 0xff) ? -1 : hdr[9];
+	memcpy(h->seed,hdr+10,RNG_SEEDLEN);
+	return 0;
+}
+
+int cap_read_chunk(FILE* f, capChunk* ch, unsigned char* buf)
+{
+	unsigned char hdr[CAP_CHUNKHDR];
+	size_t n = fread(hdr,1,CAP_CHUNKHDR,f);
+	if (n == 0 && feof(f)) return 0;
+	if (n != CAP_CHUNKHDR) return -1;
+	uint64_t t_le;
+	uint32_t len_le;
+	memcpy(&t_le,hdr,8);
+	memcpy(&len_le,hdr+9,4);
+	ch->t = le64toh(t_le);
+	ch->dir = hdr[8];
+	ch->len = le32toh(len_le);
+	if (ch->dir > CAP_OUT || ch->len > CAP_MAXCHUNK ||
+			fread(buf,1,ch->len,f) != ch->len)
+		return -1;
+	return 1;
+}
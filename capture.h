@@ -0,0 +1,60 @@
+/* Session capture and replay.  A capture sits between the application and
+ * its socket, relaying everything and logging each chunk with the time it
+ * went by.  It also fixes the seed of the capturing thread's random number
+ * generator for the handshake, so that (given the same long-term keys) the
+ * replay tool can run the real handshake and record layer against the
+ * peer's side of the capture.
+ *
+ * File format (integers little endian):
+ *   header: | "CHATCAP1" | isclient (1) | group preference (1) | seed (32) |
+ *   chunks: | time since start, ns (8) | direction (1) | length (4) | bytes |
+ * A group preference of 0xff means none. */
+#pragma once
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "rng.h"
+
+#define CAP_MAGIC    "CHATCAP1"
+#define CAP_MAXCHUNK (64 << 10)
+
+enum { CAP_IN, CAP_OUT }; /* from the peer, to the peer */
+
+typedef struct {
+	int isclient;
+	int groupPref;        /* -1 for none */
+	unsigned char seed[RNG_SEEDLEN];
+} capHeader;
+
+typedef struct {
+	int64_t t;            /* ns since the capture started */
+	int dir;
+	size_t len;
+} capChunk;
+
+typedef struct {
+	FILE* f;
+	int app, net;         /* the relay's ends: toward the application, the socket */
+	int64_t t0;
+	pthread_t relay;
+} capture;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/** Start capturing the session on sockfd to fname.  Seeds this thread's
+ * random number generator (see rng_set_seed; call rng_clear_seed once the
+ * handshake is done), so only use this with test keys.
+ * @return the fd the application should use from now on instead of
+ * sockfd, or -1 on error. */
+int cap_start(capture* c, int sockfd, const char* fname, int isclient, int groupPref);
+/** Wait for both directions to close, then finish the file. */
+void cap_finish(capture* c);
+/** Read a capture's header.  @return 0 on success, -1 if it isn't one. */
+int cap_read_header(FILE* f, capHeader* h);
+/** Read the next chunk into buf (CAP_MAXCHUNK bytes).
+ * @return 1 on success, 0 at the end, -1 if the file is damaged. */
+int cap_read_chunk(FILE* f, capChunk* ch, unsigned char* buf);
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,618 @@
+/* headless chat server: accepts any number of sessions, runs the usual
+ * handshake on each, and echoes every message back to its sender, on the
+ * stream it came on.  Bulk streams (see mux.h) are taken as uploads and
+ * not echoed.  Meant as the other end for load-gen, but any client can
+ * talk to it.
+ *
+ * By default each session gets a thread.  In sharded mode (-S) there is a
+ * fixed set of workers instead, each pinned to a CPU with a listener of its
+ * own (SO_REUSEPORT, so the kernel spreads connections over them) and an
+ * epoll loop over its sessions, handshakes included (see hs_step).  A
+ * session never leaves its worker, so its keys stay in that CPU's cache
+ * and nothing is shared or locked.  The expensive part of each handshake
+ * goes to a pool of crypto threads (-w), so that a storm of reconnects
+ * doesn't hold up the sessions already running. */
+#define _GNU_SOURCE
+#include "cryptopool.h"
+#include "dh.h"
+#include "keystore.h"
+#include "metrics.h"
+#include "session.h"
+#include "util.h"
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static hsConfig hscfg = {.isclient = 0, .groupPref = -1, .peers = NULL,
+	.timeout_ms = HS_TIMEOUT_MS, .cancelfd = -1};
+static keystore peerKeys;
+static hsCookies cookies;
+static atomic_int nsessions;
+
+static double sessionCount(void*)
+{
+	return atomic_load(&nsessions);
+}
+
+/* one thread per connection: handshake, then echo until the peer leaves */
+static void* session(void* arg)
+{
+	int fd = (int)(intptr_t)arg;
+	atomic_fetch_add(&nsessions,1);
+	chatSession s;
+	if (session_handshake(&s,fd,&hscfg,NULL) == 0) {
+		unsigned char msg[REC_MAXDATA];
+		unsigned char rec[REC_MAXLEN];
+		ssize_t len;
+		int stream, prio;
+		while ((len = session_recv_stream(&s,msg,sizeof(msg),&stream,&prio)) >= 0) {
+			if (prio >= REC_PRIO_BULK) continue;
+			if ((len = session_protect(&s,stream,prio,msg,len,rec,sizeof(rec))) < 0 ||
+					xwrite_deadline(s.fd,rec,len,0,-1) != 0)
+				break;
+		}
+		session_close(&s);
+	}
+	atomic_fetch_sub(&nsessions,1);
+	return NULL;
+}
+
+/* ---- sharded mode ---- */
+
+#define SHARD_BUF    (16 << 10) /* read from / written to a connection at once */
+#define SHARD_OUTMAX (4*SHARD_BUF) /* unsent echoes a connection may have */
+#define SHARD_EVENTS 64
+
+typedef struct shardConn {
+	chatSession s;
+	hsState hs;
+	int handshaking;
+	int crypto;                 /* hs_crypto is running for it: hands off */
+	cpJob job;
+	uint32_t events;            /* what epoll is watching for (0: nothing) */
+	struct shardConn *prev, *next; /* in the shard's list of handshakes */
+	size_t have;                /* bytes of in used */
+	unsigned char in[SHARD_BUF];
+	unsigned char* pend;        /* echoes the socket wouldn't take yet */
+	size_t pendlen, pendoff;    /* (SHARD_OUTMAX bytes, while there are any) */
+} shardConn;
+
+/* one per worker.  The counters are only written by the worker; the
+ * reporter reads them. */
+typedef struct {
+	alignas(64) atomic_uint_fast64_t handshakes, records;
+	atomic_int sessions, handshaking;
+	int id, cpu;
+	int listenfd, ep;
+	pthread_t t;
+	/* handshakes in progress, oldest first.  They all have the same
+	 * timeout, so that is also the order of their deadlines. */
+	shardConn *hsFirst, *hsLast;
+	cpQueue done;               /* from the crypto pool */
+	cpJob* batch;               /* for the crypto pool, once this round is over */
+} shard;
+
+static cryptoPool pool;
+
+static void shardCount(atomic_uint_fast64_t* x, uint64_t n)
+{
+	atomic_store_explicit(x,atomic_load_explicit(x,memory_order_relaxed) + n,
+			memory_order_relaxed);
+}
+
+static void watch(shard* sh, shardConn* c, uint32_t events)
+{
+	if (c->events == events) return;
+	struct epoll_event ev = {.events = events, .data.ptr = c};
+	int op = !events ? EPOLL_CTL_DEL : !c->events ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+	epoll_ctl(sh->ep,op,c->s.fd,&ev);
+	c->events = events;
+}
+
+static void unlinkHandshake(shard* sh, shardConn* c)
+{
+	*(c->prev ? &c->prev->next : &sh->hsFirst) = c->next;
+	*(c->next ? &c->next->prev : &sh->hsLast) = c->prev;
+	c->handshaking = 0;
+	atomic_fetch_sub_explicit(&sh->handshaking,1,memory_order_relaxed);
+}
+
+static void shardDrop(shard* sh, shardConn* c)
+{
+	epoll_ctl(sh->ep,EPOLL_CTL_DEL,c->s.fd,NULL);
+	if (c->handshaking) {
+		unlinkHandshake(sh,c);
+	} else {
+		atomic_fetch_sub_explicit(&sh->sessions,1,memory_order_relaxed);
+		atomic_fetch_sub(&nsessions,1);
+	}
+	session_close(&c->s);
+	free(c->pend);
+	free(c);
+}
+
+/* move a handshake on as far as it goes without blocking */
+static void shardHandshake(shard* sh, shardConn* c)
+{
+	int r = hs_step(&c->hs);
+	if (r < 0) {
+		shardDrop(sh,c);
+	} else if (r == 0) {
+		unlinkHandshake(sh,c);
+		shardCount(&sh->handshakes,1);
+		atomic_fetch_add_explicit(&sh->sessions,1,memory_order_relaxed);
+		atomic_fetch_add(&nsessions,1);
+		watch(sh,c,EPOLLIN);
+	} else if (r == HS_WANT_CRYPTO) {
+		/* not even hangups until it's back */
+		watch(sh,c,0);
+		c->crypto = 1;
+		c->job.next = sh->batch;
+		sh->batch = &c->job;
+	} else {
+		watch(sh,c,(r == HS_WANT_READ) ? EPOLLIN : EPOLLOUT);
+	}
+}
+
+static void shardCrypto(void* arg)
+{
+	shardConn* c = arg;
+	hs_crypto(&c->hs);
+}
+
+/* carry on with the handshakes the crypto pool is done with */
+static void shardCollect(shard* sh)
+{
+	cpJob* j = cp_collect(&sh->done);
+	while (j) {
+		shardConn* c = j->arg;
+		j = j->next;
+		c->crypto = 0;
+		shardHandshake(sh,c);
+	}
+}
+
+/* take every connection waiting on the listener and start its handshake */
+static void shardAccept(shard* sh)
+{
+	int fd;
+	while ((fd = accept4(sh->listenfd,NULL,NULL,SOCK_NONBLOCK|SOCK_CLOEXEC)) >= 0) {
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		shardConn* c = malloc(sizeof(*c));
+		if (!c) {
+			close(fd);
+			continue;
+		}
+		if (session_start(&c->s,&c->hs,fd,&hscfg) != 0) {
+			free(c);
+			continue;
+		}
+		c->have = 0;
+		c->pend = NULL;
+		c->pendlen = c->pendoff = 0;
+		c->crypto = 0;
+		c->job.fn = shardCrypto;
+		c->job.arg = c;
+		c->job.done = &sh->done;
+		c->events = EPOLLIN;
+		struct epoll_event ev = {.events = c->events, .data.ptr = c};
+		if (epoll_ctl(sh->ep,EPOLL_CTL_ADD,fd,&ev) != 0) {
+			hs_abort(&c->hs);
+			session_close(&c->s);
+			free(c);
+			continue;
+		}
+		c->handshaking = 1;
+		c->next = NULL;
+		c->prev = sh->hsLast;
+		*(sh->hsLast ? &sh->hsLast->next : &sh->hsFirst) = c;
+		sh->hsLast = c;
+		atomic_fetch_add_explicit(&sh->handshaking,1,memory_order_relaxed);
+		shardHandshake(sh,c);
+	}
+}
+
+/* send what the socket will take of c's pending echoes, then of buf, and
+ * keep the rest pending.  Never waits.  @return -1 if the connection
+ * failed or has more than SHARD_OUTMAX pending. */
+static int shardSend(shardConn* c, const unsigned char* buf, size_t len)
+{
+	while (c->pendoff < c->pendlen) {
+		ssize_t n = send(c->s.fd,c->pend+c->pendoff,c->pendlen-c->pendoff,
+				MSG_DONTWAIT|MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+		if (n < 0) return -1;
+		c->pendoff += n;
+	}
+	if (c->pendoff == c->pendlen) {
+		c->pendoff = c->pendlen = 0;
+		while (len) {
+			ssize_t n = send(c->s.fd,buf,len,MSG_DONTWAIT|MSG_NOSIGNAL);
+			if (n < 0 && errno == EINTR) continue;
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+			if (n < 0) return -1;
+			buf += n;
+			len -= n;
+		}
+	}
+	if (!len) {
+		if (!c->pendlen) {
+			free(c->pend);
+			c->pend = NULL;
+		}
+		return 0;
+	}
+	if (!c->pend && !(c->pend = malloc(SHARD_OUTMAX))) return -1;
+	memmove(c->pend,c->pend+c->pendoff,c->pendlen-c->pendoff);
+	c->pendlen -= c->pendoff;
+	c->pendoff = 0;
+	if (c->pendlen + len > SHARD_OUTMAX) return -1;
+	memcpy(c->pend+c->pendlen,buf,len);
+	c->pendlen += len;
+	return 0;
+}
+
+/* echo every whole record in c->in (but bulk ones), a buffer full at a
+ * time.  Once the socket stops taking them, the rest of c->in waits, and
+ * so does reading more: the peer gets backpressure, and nobody else on
+ * the shard waits.  @return -1 once the connection is done. */
+static int shardEcho(shard* sh, shardConn* c)
+{
+	unsigned char out[SHARD_BUF];
+	unsigned char pt[REC_MAXDATA];
+	size_t off = 0, nout = 0, nrec = 0;
+	ssize_t len = 0, n;
+	int stream, prio;
+	while (!c->pendlen && (len = record_framelen(c->in+off,c->have-off)) > 0 &&
+			(size_t)len <= c->have-off) {
+		if ((n = session_unprotect(&c->s,c->in+off,len,pt,sizeof(pt),&stream,&prio)) < 0)
+			return -1;
+		off += len;
+		nrec++;
+		if (prio >= REC_PRIO_BULK) continue;
+		if (nout + REC_MAXLEN > sizeof(out)) {
+			if (shardSend(c,out,nout) != 0) return -1;
+			nout = 0;
+		}
+		if ((n = session_protect(&c->s,stream,prio,pt,n,out+nout,sizeof(out)-nout)) < 0)
+			return -1;
+		nout += n;
+	}
+	if (len < 0) return -1;
+	memmove(c->in,c->in+off,c->have-off);
+	c->have -= off;
+	shardCount(&sh->records,nrec);
+	if (nout && shardSend(c,out,nout) != 0) return -1;
+	watch(sh,c,c->pendlen ? EPOLLOUT : EPOLLIN);
+	return 0;
+}
+
+/* the connection is readable, or (with echoes pending) writable.
+ * @return -1 once it is done. */
+static int shardIo(shard* sh, shardConn* c)
+{
+	if (c->pendlen) {
+		if (shardSend(c,NULL,0) != 0) return -1;
+		return shardEcho(sh,c);
+	}
+	ssize_t r = read(c->s.fd,c->in+c->have,sizeof(c->in)-c->have);
+	if (r < 0) return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+	if (r == 0) return -1;
+	c->have += r;
+	return shardEcho(sh,c);
+}
+
+static void* shardLoop(void* arg)
+{
+	shard* sh = arg;
+	struct epoll_event ev[SHARD_EVENTS];
+	for (;;) {
+		/* wake up in time for the oldest handshake's deadline (one the
+		 * crypto pool has is checked when it comes back) */
+		int timeout = -1;
+		shardConn* c = sh->hsFirst;
+		while (c && c->crypto) c = c->next;
+		if (c) {
+			int64_t left = c->hs.deadline - monotonic_ms();
+			timeout = (left > 0) ? left : 0;
+		}
+		int n = epoll_wait(sh->ep,ev,SHARD_EVENTS,timeout);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			perror("epoll_wait");
+			return NULL;
+		}
+		for (int i = 0; i < n; i++) {
+			c = ev[i].data.ptr;
+			if (!c)
+				shardAccept(sh);
+			else if ((void*)c == sh)
+				shardCollect(sh);
+			else if (c->handshaking)
+				shardHandshake(sh,c);
+			else if (shardIo(sh,c) != 0)
+				shardDrop(sh,c);
+		}
+		/* hs_step fails the ones past their deadline */
+		int64_t now = monotonic_ms();
+		for (c = sh->hsFirst; c && c->hs.deadline <= now; ) {
+			shardConn* next = c->next;
+			if (!c->crypto) shardHandshake(sh,c);
+			c = next;
+		}
+		/* everything this round turned up in one go, so the pool gets a
+		 * full queue rather than a trickle */
+		cp_submit(&pool,sh->batch);
+		sh->batch = NULL;
+	}
+}
+
+static int shardListen(int port)
+{
+	int one = 1;
+	struct sockaddr_in addr = {.sin_family = AF_INET,
+		.sin_addr.s_addr = INADDR_ANY, .sin_port = htons(port)};
+	int fd = socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	if (fd < 0) return -1;
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+			setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0 ||
+			bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+			listen(fd, SOMAXCONN) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* start nshards workers and nworkers crypto threads (0: one per CPU we
+ * may run on; nworkers < 0: none), then report their load every interval
+ * seconds */
+static int runSharded(int port, int nshards, int nworkers, int interval)
+{
+	cpu_set_t allowed;
+	int cpus[CPU_SETSIZE], ncpus = 0;
+	if (sched_getaffinity(0,sizeof(allowed),&allowed) != 0) {
+		perror("sched_getaffinity");
+		return 1;
+	}
+	for (int i = 0; i < CPU_SETSIZE; i++)
+		if (CPU_ISSET(i,&allowed)) cpus[ncpus++] = i;
+	if (nshards <= 0) nshards = ncpus;
+	if (nworkers == 0) nworkers = ncpus;
+	if (nworkers > 0) {
+		if (cp_start(&pool,nworkers) != 0) {
+			perror("crypto pool");
+			return 1;
+		}
+		hscfg.offload = 1;
+	}
+	shard* shards = aligned_alloc(alignof(shard),nshards*sizeof(shard));
+	if (!shards) {
+		perror("shards");
+		return 1;
+	}
+	for (int i = 0; i < nshards; i++) {
+		shard* sh = &shards[i];
+		memset(sh,0,sizeof(*sh));
+		sh->id = i;
+		sh->cpu = cpus[i % ncpus];
+		struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+		struct epoll_event done = {.events = EPOLLIN, .data.ptr = sh};
+		if ((sh->listenfd = shardListen(port)) < 0 ||
+				(sh->ep = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+				epoll_ctl(sh->ep,EPOLL_CTL_ADD,sh->listenfd,&ev) != 0 ||
+				cp_queue_init(&sh->done) != 0 ||
+				epoll_ctl(sh->ep,EPOLL_CTL_ADD,sh->done.efd,&done) != 0) {
+			perror("shard listener");
+			return 1;
+		}
+		pthread_attr_t attr;
+		cpu_set_t cpu;
+		CPU_ZERO(&cpu);
+		CPU_SET(sh->cpu,&cpu);
+		pthread_attr_init(&attr);
+		pthread_attr_setaffinity_np(&attr,sizeof(cpu),&cpu);
+		if (pthread_create(&sh->t,&attr,shardLoop,sh) != 0) {
+			fprintf(stderr, "could not start shard %d\n", i);
+			return 1;
+		}
+		pthread_attr_destroy(&attr);
+	}
+	fprintf(stderr, "listening on port %i with %d shards, %d crypto threads...\n",
+			port, nshards, (nworkers > 0) ? nworkers : 0);
+
+	uint64_t* last = calloc(2*nshards,sizeof(uint64_t));
+	int64_t t0 = monotonic_ms();
+	while (interval > 0 && last) {
+		sleep(interval);
+		int64_t t1 = monotonic_ms();
+		double secs = (t1 - t0) / 1e3;
+		for (int i = 0; i < nshards; i++) {
+			uint64_t hs = atomic_load_explicit(&shards[i].handshakes,memory_order_relaxed);
+			uint64_t rec = atomic_load_explicit(&shards[i].records,memory_order_relaxed);
+			fprintf(stderr, "shard %d (cpu %d): %d sessions, %d handshaking, "
+					"%.1f handshakes/s, %.1f records/s\n", i, shards[i].cpu,
+					atomic_load_explicit(&shards[i].sessions,memory_order_relaxed),
+					atomic_load_explicit(&shards[i].handshaking,memory_order_relaxed),
+					(hs - last[2*i]) / secs, (rec - last[2*i+1]) / secs);
+			last[2*i] = hs;
+			last[2*i+1] = rec;
+		}
+		if (nworkers > 0)
+			fprintf(stderr, "crypto pool: %zu jobs queued\n",
+					atomic_load_explicit(&pool.queued,memory_order_relaxed));
+		t0 = t1;
+	}
+	for (int i = 0; i < nshards; i++)
+		pthread_join(shards[i].t,NULL);
+	return 0;
+}
+
+static const char* usage =
+"Usage: %s [OPTIONS]...\n"
+"Accept chat sessions and echo every message back (see load-gen).\n\n"
+"   -p, --port    PORT  Listen on PORT (defaults to 1337).\n"
+"   -g, --group   GROUP Only use key exchange GROUP (ff or x25519).\n"
+"   -k, --keystore FILE Look clients' long-term keys up in FILE.\n"
+"   -T, --timeout MS    Give up on handshakes after MS (default %d).\n"
+"   -c, --cookies RATE  While more than RATE handshakes a second arrive,\n"
+"                       make clients echo a cookie before spending CPU on\n"
+"                       theirs (default 100; 0: always; -1: never).\n"
+"   -m, --metrics SOCKET Serve metrics (Prometheus text) on Unix socket SOCKET.\n"
+"   -S, --shards  N     Sharded mode: N workers (0 for one per CPU), each\n"
+"                       pinned to a CPU, with its own listener and sessions.\n"
+"   -w, --workers N     Sharded mode: generate and derive handshake keys on\n"
+"                       N threads of their own (default 0, one per CPU; -1\n"
+"                       to do it on the shards).\n"
+"   -i, --interval SEC  Sharded mode: report each shard's load every SEC\n"
+"                       seconds (default 10; 0 for never).\n"
+"   -h, --help          show this message and exit.\n";
+
+int main(int argc, char *argv[])
+{
+	if (init("params") != 0) {
+		fprintf(stderr, "could not read DH params from file 'params'\n");
+		return 1;
+	}
+	static struct option long_opts[] = {
+		{"port",     required_argument, 0, 'p'},
+		{"group",    required_argument, 0, 'g'},
+		{"keystore", required_argument, 0, 'k'},
+		{"timeout",  required_argument, 0, 'T'},
+		{"cookies",  required_argument, 0, 'c'},
+		{"metrics",  required_argument, 0, 'm'},
+		{"shards",   required_argument, 0, 'S'},
+		{"workers",  required_argument, 0, 'w'},
+		{"interval", required_argument, 0, 'i'},
+		{"help",     no_argument,       0, 'h'},
+		{0,0,0,0}
+	};
+	int c;
+	int port = 1337;
+	int nshards = -1; /* not sharded */
+	int nworkers = 0;
+	int interval = 10;
+	int cookieRate = 100;
+	while ((c = getopt_long(argc, argv, "p:g:k:T:c:m:S:w:i:h", long_opts, NULL)) != -1) {
+		switch (c) {
+			case 'p':
+				port = atoi(optarg);
+				break;
+			case 'g':
+				if (strcmp(optarg,"ff") == 0) {
+					hscfg.groupPref = DH_GROUP_FF;
+				} else if (strcmp(optarg,"x25519") == 0) {
+					hscfg.groupPref = DH_GROUP_X25519;
+				} else {
+					fprintf(stderr,usage,argv[0],HS_TIMEOUT_MS);
+					return 1;
+				}
+				break;
+			case 'k':
+				if (ks_open(&peerKeys,optarg) != 0) {
+					fprintf(stderr, "could not open keystore %s\n", optarg);
+					return 1;
+				}
+				hscfg.peers = &peerKeys;
+				break;
+			case 'T':
+				hscfg.timeout_ms = atoi(optarg);
+				break;
+			case 'c':
+				cookieRate = atoi(optarg);
+				break;
+			case 'm':
+				if (metrics_serve(optarg) != 0) {
+					fprintf(stderr, "could not serve metrics on %s\n", optarg);
+					return 1;
+				}
+				metrics_gauge("chat_sessions","Connections open.",sessionCount,NULL);
+				break;
+			case 'S':
+				nshards = atoi(optarg);
+				break;
+			case 'w':
+				nworkers = atoi(optarg);
+				break;
+			case 'i':
+				interval = atoi(optarg);
+				break;
+			case 'h':
+				printf(usage,argv[0],HS_TIMEOUT_MS);
+				return 0;
+			default:
+				fprintf(stderr,usage,argv[0],HS_TIMEOUT_MS);
+				return 1;
+		}
+	}
+
+	if (cookieRate >= 0) {
+		if (hs_cookies_init(&cookies,cookieRate) != 0) {
+			fprintf(stderr, "could not make a cookie secret\n");
+			return 1;
+		}
+		hscfg.cookies = &cookies;
+	}
+	/* once, here: handshakes never read key files */
+	if (hs_load_keys(&hscfg) != 0) {
+		fprintf(stderr, "no long-term keys to use (server_long_term_key*%s)\n",
+				hscfg.peers ? "" : ", client_long_term_key*.pub");
+		return 1;
+	}
+	signal(SIGPIPE,SIG_IGN);
+	if (nshards >= 0)
+		return runSharded(port,nshards,nworkers,interval);
+	int reuse = 1;
+	struct sockaddr_in addr;
+	int listensock = socket(AF_INET, SOCK_STREAM, 0);
+	if (listensock < 0) {
+		perror("socket");
+		return 1;
+	}
+	setsockopt(listensock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+	memset(&addr,0,sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = INADDR_ANY;
+	addr.sin_port = htons(port);
+	if (bind(listensock, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+			listen(listensock, SOMAXCONN) < 0) {
+		perror("bind");
+		return 1;
+	}
+	fprintf(stderr, "listening on port %i...\n",port);
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_attr_setstacksize(&attr, 256 << 10);
+	for (;;) {
+		int fd = accept(listensock, NULL, NULL);
+		if (fd < 0) {
+			perror("accept");
+			continue;
+		}
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		pthread_t t;
+		if (pthread_create(&t, &attr, session, (void*)(intptr_t)fd) != 0) {
+			fprintf(stderr, "could not start a session thread\n");
+			close(fd);
+		}
+	}
+	return 0;
+}
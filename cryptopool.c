@@ -0,0 +1,117 @@
+#include "cryptopool.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+/* hand a finished job back to its queue's owner */
+static void complete(cpJob* j)
+{
+	cpQueue* q = j->done;
+	cpJob* top = atomic_load_explicit(&q->top,memory_order_relaxed);
+	do {
+		j->next = top;
+	} while (!atomic_compare_exchange_weak_explicit(&q->top,&top,j,
+				memory_order_release,memory_order_relaxed));
+	if (!top) {
+		uint64_t one = 1;
+		while (write(q->efd,&one,sizeof(one)) < 0 && errno == EINTR)
+			;
+	}
+}
+
+static void* worker(void* arg)
+{
+	cryptoPool* p = arg;
+	pthread_mutex_lock(&p->lock);
+	for (;;) {
+		while (!p->first && !p->stop)
+			pthread_cond_wait(&p->ready,&p->lock);
+		cpJob* j = p->first;
+		if (!j) break;
+		if (!(p->first = j->next)) p->last = NULL;
+		atomic_fetch_sub_explicit(&p->queued,1,memory_order_relaxed);
+		pthread_mutex_unlock(&p->lock);
+		j->fn(j->arg);
+		complete(j);
+		pthread_mutex_lock(&p->lock);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+int cp_start(cryptoPool* p, int nthreads)
+{
+	p->first = p->last = NULL;
+	atomic_init(&p->queued,0);
+	p->stop = 0;
+	p->nthreads = 0;
+	if (nthreads <= 0 || !(p->threads = calloc(nthreads,sizeof(pthread_t))))
+		return -1;
+	pthread_mutex_init(&p->lock,NULL);
+	pthread_cond_init(&p->ready,NULL);
+	for (; p->nthreads < nthreads; p->nthreads++) {
+		if (pthread_create(&p->threads[p->nthreads],NULL,worker,p) != 0) {
+			cp_stop(p);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void cp_stop(cryptoPool* p)
+{
+	pthread_mutex_lock(&p->lock);
+	p->stop = 1;
+	pthread_cond_broadcast(&p->ready);
+	pthread_mutex_unlock(&p->lock);
+	for (int i = 0; i < p->nthreads; i++)
+		pthread_join(p->threads[i],NULL);
+	free(p->threads);
+	p->threads = NULL;
+	p->nthreads = 0;
+	pthread_cond_destroy(&p->ready);
+	pthread_mutex_destroy(&p->lock);
+}
+
+void cp_submit(cryptoPool* p, cpJob* jobs)
+{
+	if (!jobs) return;
+	cpJob* last = jobs;
+	size_t n = 1;
+	for (; last->next; last = last->next) n++;
+	pthread_mutex_lock(&p->lock);
+	*(p->last ? &p->last->next : &p->first) = jobs;
+	p->last = last;
+	atomic_fetch_add_explicit(&p->queued,n,memory_order_relaxed);
+	/* wake no more threads than there is work for */
+	if (n >= (size_t)p->nthreads)
+		pthread_cond_broadcast(&p->ready);
+	else
+		while (n--) pthread_cond_signal(&p->ready);
+	pthread_mutex_unlock(&p->lock);
+}
+
+int cp_queue_init(cpQueue* q)
+{
+	atomic_init(&q->top,NULL);
+	q->efd = eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC);
+	return (q->efd < 0) ? -1 : 0;
+}
+
+void cp_queue_free(cpQueue* q)
+{
+	close(q->efd);
+	q->efd = -1;
+}
+
+cpJob* cp_collect(cpQueue* q)
+{
+	/* reset the eventfd first: a job pushed after the exchange below
+	 * finds the stack empty and writes it again */
+	uint64_t n;
+	while (read(q->efd,&n,sizeof(n)) < 0 && errno == EINTR)
+		;
+	return atomic_exchange_explicit(&q->top,NULL,memory_order_acquire);
+}
@@ -0,0 +1,57 @@
+/* A pool of threads for expensive jobs (handshake key generation and
+ * derivation, see hs_crypto), so that the threads doing the network I/O
+ * only ever do cheap work.  An I/O thread hands jobs over in batches (one
+ * lock and one wakeup however many there are), and gets each back on a
+ * completion queue of its own, whose eventfd it can watch with the rest of
+ * its file descriptors. */
+#pragma once
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+typedef struct cpJob {
+	void (*fn)(void* arg);      /* runs on a pool thread */
+	void* arg;
+	struct cpQueue* done;       /* where the job goes once fn returns */
+	struct cpJob* next;
+} cpJob;
+
+/* Finished jobs for one thread.  Pool threads push them on a lock-free
+ * stack; the eventfd is only written when the stack was empty, so a burst
+ * of completions costs the owner one wakeup. */
+typedef struct cpQueue {
+	int efd;
+	_Atomic(cpJob*) top;
+} cpQueue;
+
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	cpJob *first, *last;        /* waiting to run, oldest first */
+	atomic_size_t queued;       /* how many (may be read without the lock) */
+	int stop;
+	int nthreads;
+	pthread_t* threads;
+} cryptoPool;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/** Start a pool of nthreads threads.  @return 0 on success, -1 on error. */
+int cp_start(cryptoPool* p, int nthreads);
+/** Let the threads finish what has been submitted, then stop them. */
+void cp_stop(cryptoPool* p);
+/** Queue a list of jobs (linked through next), each with fn, arg and done
+ * filled in.  Nothing may touch a job until it comes back from cp_collect. */
+void cp_submit(cryptoPool* p, cpJob* jobs);
+
+/** Set up a completion queue.  @return 0 on success, -1 on error. */
+int cp_queue_init(cpQueue* q);
+void cp_queue_free(cpQueue* q);
+/** Take every finished job off q (its owner's side; call it when q->efd is
+ * readable).  @return the jobs, linked through next, in no particular
+ * order; NULL if there are none. */
+cpJob* cp_collect(cpQueue* q);
+#ifdef __cplusplus
+}
+#endif
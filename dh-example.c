@@ -88,6 +88,29 @@ void test3DH()
 	printf("\n");
 }
 
+void test3DHX25519()
+{
+	/* same as above, but with keys from the X25519 group: */
+	dhKey a, x, b, y;
+	dhKey* keys[4] = {&a,&x,&b,&y};
+	for (size_t i = 0; i < 4; i++) {
+		initKey(keys[i]);
+		keys[i]->group = DH_GROUP_X25519;
+		dhGenk(keys[i]);
+	}
+	const size_t klen = 128;
+	unsigned char kA[klen];
+	dh3Finalk(&a,&x,&b,&y,kA,klen);
+	unsigned char kB[klen];
+	dh3Finalk(&b,&y,&a,&x,kB,klen);
+	if (memcmp(kA,kB,klen) == 0) {
+		printf("Alice and Bob have the same key :D\n");
+	} else {
+		printf("T.T\n");
+	}
+	for (size_t i = 0; i < 4; i++) shredKey(keys[i]);
+}
+
 int main()
 {
 	/* NOTE: if for some reason you wanted to make new DH parameters,
@@ -100,5 +123,7 @@ int main()
 	testDH();
 	printf("...testing 3DH key exchange...\n");
 	test3DH();
+	printf("...testing X25519 3DH key exchange...\n");
+	test3DHX25519();
 	return 0;
 }
@@ -10,7 +10,13 @@
 #include <string.h>
 #include <endian.h>
 #include <assert.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include "util.h"
+#include "rng.h"
+#include "log.h"
 
 mpz_t q; /* "small" prime; should be 256 bits or more */
 mpz_t p; /* "large" prime; should be 2048 bits or more, with q|(p-1) */
@@ -24,32 +30,167 @@ size_t pLen; /* length of p in bytes */
 /* NOTE: this constant is arbitrary and does not need to be secret. */
 const char* hmacsalt = "z3Dow}^Z]8Uu5>pr#;{QUs!133";
 
+/* Validated parameters are cached in binary next to the parameter file
+ * (fname + ".cache") so that later runs can skip the primality tests.
+ * Layout (integers little endian):
+ *  +-------+---------+-------+-----------------+------------+------------+
+ *  | magic | version | flags | SHA256(params)  | q | p | g  | SHA256(..) |
+ *  |  4    |    4    |   4   |       32        | 3 x (4+nB) |     32     |
+ *  +-------+---------+-------+-----------------+------------+------------+
+ * The integers use the same length-prefixed encoding as serialize_mpz, and
+ * the trailing hash covers everything before it.  The cache is only used if
+ * the hash of the text file it was made from still matches, so editing
+ * params invalidates it.  NOTE: the cache is trusted as much as params is;
+ * anyone who can write one can write the other. */
+#define PCACHE_MAGIC   0x43504844 /* "DHPC" */
+#define PCACHE_VERSION 1
+#define PCACHE_VALID   1          /* flag: q,p,g passed the checks in init */
+#define PARAMS_MAXLEN  (1 << 16)  /* the text file is ~2.5K for 4096 bit p */
+
+static void setLengths()
+{
+	qBitlen = mpz_sizeinbase(q,2);
+	pBitlen = mpz_sizeinbase(p,2);
+	qLen = qBitlen / 8 + (qBitlen % 8 != 0);
+	pLen = pBitlen / 8 + (pBitlen % 8 != 0);
+}
+
+/* read all of fname into a newly allocated, NUL terminated buffer */
+static char* slurp(const char* fname, size_t maxlen, size_t* len)
+{
+	FILE* f = fopen(fname,"rb");
+	if (!f) return NULL;
+	char* buf = malloc(maxlen+1);
+	*len = fread(buf,1,maxlen+1,f);
+	fclose(f);
+	if (*len > maxlen) { /* too big to be what we wrote */
+		free(buf);
+		return NULL;
+	}
+	buf[*len] = 0;
+	return buf;
+}
+
+/* read one length-prefixed integer from the cache buffer */
+static int cacheGetZ(mpz_t x, const unsigned char** pos, const unsigned char* end)
+{
+	uint32_t nB_le;
+	if (end - *pos < 4) return -1;
+	memcpy(&nB_le,*pos,4);
+	size_t nB = le32toh(nB_le);
+	*pos += 4;
+	if (nB == 0 || (size_t)(end - *pos) < nB) return -1;
+	BYTES2Z(x,*pos,nB);
+	*pos += nB;
+	return 0;
+}
+
+/* load q,p,g from the cache if it is intact, marked valid, and was made from
+ * a parameter file whose hash is srchash. */
+static int readParamsCache(const char* cname, const unsigned char* srchash)
+{
+	size_t len;
+	unsigned char* buf = (unsigned char*)slurp(cname,PARAMS_MAXLEN,&len);
+	if (!buf) return -1;
+	int rv = -1;
+	const size_t hdrlen = 12 + SHA256_DIGEST_LENGTH;
+	unsigned char H[SHA256_DIGEST_LENGTH];
+	if (len < hdrlen + SHA256_DIGEST_LENGTH) goto end;
+	const unsigned char* end = buf + len - SHA256_DIGEST_LENGTH;
+	SHA256(buf,end-buf,H);
+	if (memcmp(H,end,SHA256_DIGEST_LENGTH) != 0) goto end;
+	uint32_t hdr[3];
+	memcpy(hdr,buf,sizeof(hdr));
+	if (le32toh(hdr[0]) != PCACHE_MAGIC || le32toh(hdr[1]) != PCACHE_VERSION ||
+			!(le32toh(hdr[2]) & PCACHE_VALID))
+		goto end;
+	if (memcmp(buf+12,srchash,SHA256_DIGEST_LENGTH) != 0) goto end;
+	const unsigned char* pos = buf + hdrlen;
+	if (cacheGetZ(q,&pos,end) || cacheGetZ(p,&pos,end) ||
+			cacheGetZ(g,&pos,end) || pos != end)
+		goto end;
+	rv = 0;
+end:
+	free(buf);
+	return rv;
+}
+
+/* append a length-prefixed integer to the cache buffer */
+static unsigned char* cachePutZ(unsigned char* pos, mpz_t x)
+{
+	size_t nB;
+	Z2BYTES(pos+4,&nB,x);
+	LE(nB);
+	memcpy(pos,&nB_le,4);
+	return pos + 4 + nB;
+}
+
+/* best effort: failing to write the cache (say, read only directory) just
+ * means the next run validates again. */
+static void writeParamsCache(const char* cname, const unsigned char* srchash)
+{
+	size_t maxlen = 12 + 2*SHA256_DIGEST_LENGTH + 12 + qLen + 2*pLen;
+	unsigned char* buf = malloc(maxlen);
+	uint32_t hdr[3] = {htole32(PCACHE_MAGIC),htole32(PCACHE_VERSION),
+		htole32(PCACHE_VALID)};
+	memcpy(buf,hdr,sizeof(hdr));
+	memcpy(buf+12,srchash,SHA256_DIGEST_LENGTH);
+	unsigned char* pos = buf + 12 + SHA256_DIGEST_LENGTH;
+	pos = cachePutZ(pos,q);
+	pos = cachePutZ(pos,p);
+	pos = cachePutZ(pos,g);
+	SHA256(buf,pos-buf,pos);
+	pos += SHA256_DIGEST_LENGTH;
+	/* write to a temporary and rename, so readers never see half a file */
+	char tmpname[PATH_MAX+16];
+	snprintf(tmpname,sizeof(tmpname),"%s.%d",cname,(int)getpid());
+	FILE* f = fopen(tmpname,"wb");
+	if (f) {
+		size_t n = fwrite(buf,1,pos-buf,f);
+		if (fclose(f) == 0 && n == (size_t)(pos-buf))
+			rename(tmpname,cname);
+		else
+			unlink(tmpname);
+	}
+	free(buf);
+}
+
 int init(const char* fname)
 {
 	mpz_init(q);
 	mpz_init(p);
 	mpz_init(g);
-	FILE* f = fopen(fname,"rb");
-	if (!f) {
-		fprintf(stderr, "Could not open file 'params'\n");
+	size_t len;
+	char* text = slurp(fname,PARAMS_MAXLEN,&len);
+	if (!text) {
+		LOGE("Could not open file 'params'");
 		return -1;
 	}
+	unsigned char srchash[SHA256_DIGEST_LENGTH];
+	SHA256((unsigned char*)text,len,srchash);
+	char cname[PATH_MAX];
+	snprintf(cname,sizeof(cname),"%s.cache",fname);
+	if (readParamsCache(cname,srchash) == 0) {
+		free(text);
+		setLengths();
+		return 0;
+	}
 	/* p is a 4096 bit prime, and g generates a subgroup of order q,
 	 * which is a 512 bit prime. */
-	int nvalues = gmp_fscanf(f,"q = %Zd\np = %Zd\ng = %Zd",q,p,g);
-	fclose(f);
+	int nvalues = gmp_sscanf(text,"q = %Zd\np = %Zd\ng = %Zd",q,p,g);
+	free(text);
 	if (nvalues != 3) {
-		printf("couldn't parse parameter file\n");
+		LOGE("couldn't parse parameter file");
 		return -1;
 	}
 
 	/* now a sanity check on what we read: */
 	if (!ISPRIME(q)) {
-		printf("q not prime!\n");
+		LOGE("q not prime!");
 		return -1;
 	}
 	if (!ISPRIME(p)) {
-		printf("p not prime!\n");
+		LOGE("p not prime!");
 		return -1;
 	}
 	/* now make sure that q divides the order of the multiplicative group: */
@@ -58,105 +199,236 @@ int init(const char* fname)
 	NEWZ(r);
 	mpz_sub_ui(r,p,1); /* r = p-1 */
 	if (!mpz_divisible_p(r,q)) {
-		printf("q does not divide (p-1)!\n");
+		LOGE("q does not divide (p-1)!");
 		return -1;
 	}
 	mpz_divexact(t,r,q); /* t = (p-1)/q */
 	if (mpz_divisible_p(t,q)) {
-		printf("q^2 divides (p-1)!\n");
+		LOGE("q^2 divides (p-1)!");
 		return -1;
 	}
 	/* make sure g is a generator (which almost surely will be the case) */
 	mpz_powm(r,g,t,p); /* if r != 1, g is a generator since q is prime */
 	if (mpz_cmp_ui(r,1) == 0) {
-		printf("g does not generate subroup of order q!\n");
+		LOGE("g does not generate subroup of order q!");
 		return -1;
 	}
-	qBitlen = mpz_sizeinbase(q,2);
-	pBitlen = mpz_sizeinbase(p,2);
-	qLen = qBitlen / 8 + (qBitlen % 8 != 0);
-	pLen = pBitlen / 8 + (pBitlen % 8 != 0);
+	mpz_clears(t,r,NULL);
+	setLengths();
+	writeParamsCache(cname,srchash);
 	return 0;
 }
 
-int initFromScratch(size_t qbits, size_t pbits)
+/* Parameter generation.  Candidates for q (and then for p = q*r + 1) are
+ * walked in arithmetic progressions from random starting points.  Before
+ * paying for Miller-Rabin, each candidate is sieved against the odd primes
+ * below SIEVE_LIMIT: we keep the residues of the candidate and of the step
+ * modulo each small prime, so moving to the next candidate is one add per
+ * prime.  Several threads search at once; the first to find a prime
+ * publishes it and the rest notice between candidates and stop. */
+#define SIEVE_LIMIT 16384
+#define SIEVE_RUN   4096  /* candidates tried before picking a new start */
+
+static unsigned int smallPrimes[SIEVE_LIMIT/2];
+static size_t nSmallPrimes;
+static pthread_once_t smallPrimesOnce = PTHREAD_ONCE_INIT;
+
+static void initSmallPrimes()
+{
+	unsigned char composite[SIEVE_LIMIT];
+	memset(composite,0,sizeof(composite));
+	for (unsigned int i = 3; i < SIEVE_LIMIT; i += 2) {
+		if (composite[i]) continue;
+		smallPrimes[nSmallPrimes++] = i;
+		for (unsigned int j = i*i; j < SIEVE_LIMIT; j += 2*i)
+			composite[j] = 1;
+	}
+}
+
+typedef struct {
+	size_t bits;         /* bits of q, or of r = (p-1)/q when findP is set */
+	int findP;           /* 0: search for q; 1: search for p = q*r + 1 */
+	atomic_int found;    /* set once some worker has a result */
+	pthread_mutex_t lock;
+	mpz_t result;        /* q or p */
+	mpz_t r;             /* (p-1)/q, if findP */
+} primeSearch;
+
+static void* primeSearchWorker(void* arg)
+{
+	primeSearch* S = arg;
+	size_t len = S->bits / 8 + (S->bits % 8 != 0);
+	unsigned char* buf = malloc(len);
+	unsigned int* res  = malloc(nSmallPrimes * sizeof(unsigned int));
+	unsigned int* inc  = malloc(nSmallPrimes * sizeof(unsigned int));
+	NEWZ(c);    /* current candidate */
+	NEWZ(r);    /* current multiplier r (p search only) */
+	NEWZ(step); /* distance between candidates */
+	while (!atomic_load(&S->found)) {
+		/* random start with exactly S->bits bits */
+		if (rng_bytes(buf,len) != 0) break;
+		BYTES2Z(r,buf,len);
+		mpz_tdiv_r_2exp(r,r,S->bits);
+		mpz_setbit(r,S->bits-1);
+		if (S->findP) {
+			mpz_clrbit(r,0);       /* r even, so p = q*r + 1 is odd */
+			mpz_mul(c,q,r);
+			mpz_add_ui(c,c,1);
+			mpz_mul_2exp(step,q,1); /* r += 2  <=>  p += 2q */
+		} else {
+			mpz_setbit(r,0);
+			mpz_set(c,r);
+			mpz_set_ui(step,2);
+		}
+		for (size_t i = 0; i < nSmallPrimes; i++) {
+			res[i] = mpz_fdiv_ui(c,smallPrimes[i]);
+			inc[i] = mpz_fdiv_ui(step,smallPrimes[i]);
+		}
+		for (size_t k = 0; k < SIEVE_RUN && !atomic_load(&S->found); k++) {
+			int sieved = 0;
+			for (size_t i = 0; i < nSmallPrimes; i++) {
+				sieved |= (res[i] == 0);
+				res[i] += inc[i];
+				if (res[i] >= smallPrimes[i]) res[i] -= smallPrimes[i];
+			}
+			/* for p, also make sure q^2 doesn't divide p-1, i.e. q does
+			 * not divide r. */
+			if (!sieved && !(S->findP && mpz_divisible_p(r,q)) && ISPRIME(c)) {
+				pthread_mutex_lock(&S->lock);
+				if (!atomic_load(&S->found)) {
+					mpz_set(S->result,c);
+					mpz_set(S->r,r);
+					atomic_store(&S->found,1);
+				}
+				pthread_mutex_unlock(&S->lock);
+				break;
+			}
+			mpz_add(c,c,step);
+			if (S->findP) mpz_add_ui(r,r,2);
+		}
+	}
+	mpz_clears(c,r,step,NULL);
+	free(buf);
+	free(res);
+	free(inc);
+	return 0;
+}
+
+/* run nthreads workers until one of them finds a prime; result (and r,
+ * for p) are written into the given integers. */
+static int primeSearchRun(size_t bits, int findP, size_t nthreads,
+		mpz_t result, mpz_t r)
+{
+	primeSearch S;
+	S.bits = bits;
+	S.findP = findP;
+	atomic_init(&S.found,0);
+	pthread_mutex_init(&S.lock,NULL);
+	mpz_init(S.result);
+	mpz_init(S.r);
+	pthread_t* workers = malloc(nthreads * sizeof(pthread_t));
+	size_t started = 0;
+	for (; started < nthreads; started++) {
+		if (pthread_create(&workers[started],NULL,primeSearchWorker,&S))
+			break;
+	}
+	if (started == 0) /* no threads?  do it ourselves then. */
+		primeSearchWorker(&S);
+	for (size_t i = 0; i < started; i++)
+		pthread_join(workers[i],NULL);
+	free(workers);
+	int rv = atomic_load(&S.found) ? 0 : -1;
+	mpz_set(result,S.result);
+	mpz_set(r,S.r);
+	mpz_clears(S.result,S.r,NULL);
+	pthread_mutex_destroy(&S.lock);
+	return rv;
+}
+
+int initFromScratchN(size_t qbits, size_t pbits, size_t nthreads)
 {
 	/* select random prime q of the right number of bits, then multiply
 	 * by a random even integer, add 1, check if that is prime.  If so,
 	 * we've found q and p respectively. */
-	/* lengths in BYTES: */
-	qBitlen = qbits;
-	pBitlen = pbits;
-	qLen = qBitlen / 8 + (qBitlen % 8 != 0);
-	pLen = pBitlen / 8 + (pBitlen % 8 != 0);
-	size_t rLen = pLen - qLen;
-	unsigned char* qCand = malloc(qLen);
-	unsigned char* rCand = malloc(rLen);
+	assert(qbits > 16 && pbits > qbits + 16); /* must be above the sieve primes */
+	if (nthreads == 0) {
+		long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		nthreads = (ncpu > 0) ? ncpu : 1;
+	}
+	pthread_once(&smallPrimesOnce,initSmallPrimes);
 	mpz_init(q);
 	mpz_init(p);
 	mpz_init(g);
 	NEWZ(r); /* holds (p-1)/q */
 	NEWZ(t); /* scratch space */
-	FILE* f = fopen("/dev/urandom","rb");
-	do {
-		do {
-			fread(qCand,1,qLen,f);
-			BYTES2Z(q,qCand,qLen);
-		} while (!ISPRIME(q));
-		/* now try to get p */
-		fread(rCand,1,rLen,f);
-		rCand[0] &= 0xfe; /* set least significant bit to 0 (make r even) */
-		BYTES2Z(r,rCand,rLen);
-		mpz_mul(p,q,r);     /* p = q*r */
-		mpz_add_ui(p,p,1);  /* p = p+1 */
-		/* should make sure q^2 doesn't divide p-1.
-		 * suffices to check if q|r */
-		mpz_mod(t,r,q);     /* t = r%q */
-		/* now check if t is 0: */
-		if (mpz_cmp_ui(t,0) == 0) continue; /* really unlucky! */
-	} while (!ISPRIME(p));
-	gmp_printf("q = %Zd\np = %Zd\n",q,p);
+	if (primeSearchRun(qbits,0,nthreads,q,r) != 0 ||
+			primeSearchRun(pbits-qbits,1,nthreads,p,r) != 0) {
+		LOGE("parameter search failed");
+		return -1;
+	}
+	setLengths();
 	/* now find a generator of the subgroup of order q.
 	 * Turns out just about anything to the r power will work: */
 	size_t tLen = qLen; /* qLen somewhat arbitrary. */
 	unsigned char* tCand = malloc(tLen);
 	do {
-		fread(tCand,1,tLen,f);
+		if (rng_bytes(tCand,tLen) != 0) break;
 		BYTES2Z(t,tCand,tLen);
 		if (mpz_cmp_ui(t,0) == 0) continue; /* really unlucky! */
 		mpz_powm(g,t,r,p); /* efficiently do g = t**r % p */
 	} while (mpz_cmp_ui(g,1) == 0); /* since q prime, any such g /= 1
 									   will actually be a generator of
 									   the subgroup. */
-	fclose(f);
-	gmp_printf("g = %Zd\n",g);
+	free(tCand);
+	mpz_clears(r,t,NULL);
+	return (mpz_cmp_ui(g,1) > 0) ? 0 : -1;
+}
+
+int initFromScratch(size_t qbits, size_t pbits)
+{
+	if (initFromScratchN(qbits,pbits,0) != 0)
+		return -1;
+	gmp_printf("q = %Zd\np = %Zd\ng = %Zd\n",q,p,g);
 	return 0;
 }
 
+int writeParams(const char* fname)
+{
+	FILE* f = fopen(fname,"wb");
+	if (!f) return -1;
+	/* same format init() reads */
+	gmp_fprintf(f,"q = %Zd\np = %Zd\ng = %Zd\n",q,p,g);
+	return fclose(f) ? -1 : 0;
+}
+
 /* choose random exponent sk and compute g^(sk) mod p.
  * NOTE: init or initFromScratch must have been called first. */
 int dhGen(mpz_t sk, mpz_t pk)
 {
-	FILE* f = fopen("/dev/urandom","rb");
-	if (!f) {
-		fprintf(stderr, "Failed to open /dev/urandom\n");
-		return -1;
-	}
 	size_t buflen = qLen + 32; /* read extra to get closer to uniform distribution */
 	unsigned char* buf = malloc(buflen);
-	fread(buf,1,buflen,f);
-	fclose(f);
+	if (rng_bytes(buf,buflen) != 0) {
+		LOGE("Failed to get random bytes");
+		free(buf);
+		return -1;
+	}
 	NEWZ(a);
 	BYTES2Z(a,buf,buflen);
+	memset(buf,0,buflen);
+	free(buf);
 	mpz_mod(sk,a,q);
 	mpz_powm(pk,g,sk,p);
+	size_t nLimbs = mpz_size(a);
+	memset(mpz_limbs_write(a,nLimbs),0,nLimbs*sizeof(mp_limb_t));
+	mpz_clear(a);
 	return 0;
 }
 
 int dhGenk(dhKey* k)
 {
 	assert(k);
-	initKey(k);
+	if (k->group == DH_GROUP_X25519)
+		return dhGenX25519(k->SK,k->PK);
 	return dhGen(k->SK,k->PK);
 }
 
@@ -229,33 +501,12 @@ int dhFinal(mpz_t sk_mine, mpz_t pk_mine, mpz_t pk_yours, unsigned char* keybuf,
 	return 0;
 }
 
-int dh3Final(mpz_t a, mpz_t A, mpz_t x, mpz_t X, mpz_t B, mpz_t Y,
+/* key derivation shared by the 3DH variants.  KM holds the raw key material
+ * (kmlen bytes), X and Y are the ephemeral public keys and elen is the number
+ * of bytes used to encode a group element. */
+static int kdf3(unsigned char* KM, size_t kmlen, mpz_t X, mpz_t Y, size_t elen,
 		unsigned char* keybuf, size_t buflen)
 {
-	/* the 3 DH values will be stored in
-	 * AY == Y^a
-	 * XY == Y^x
-	 * XB == B^x
-	 * NOTE: so that both parties derive the same key, we'll swap(AY,XB)
-	 * if necessary, based on whether or not A < B. */
-	NEWZ(AY);
-	mpz_powm(AY,Y,a,p);
-	NEWZ(XY);
-	mpz_powm(XY,Y,x,p);
-	NEWZ(XB);
-	mpz_powm(XB,B,x,p);
-	if (mpz_cmp(A,B) > 0) {
-		mpz_swap(AY,XB);
-	}
-	/* now apply key derivation to get the desired number of bytes: */
-	size_t kmlen = 3*pLen; /* length of raw key material (AY || XY || XB) */
-	unsigned char* KM = malloc(kmlen);
-	memset(KM,0,kmlen);
-	/* NOTE: we discard number of bytes actually written by Z2BYTES and always
-	 * use kmlen, so it is important that we 0 the buffer first. */
-	Z2BYTES(KM,NULL,AY);
-	Z2BYTES(KM+pLen,NULL,XY);
-	Z2BYTES(KM+2*pLen,NULL,XB);
 	const size_t maclen = 64; /* output len of sha512 */
 	unsigned char PRK[maclen];
 	memset(PRK,0,maclen);
@@ -271,7 +522,7 @@ int dh3Final(mpz_t a, mpz_t A, mpz_t x, mpz_t X, mpz_t B, mpz_t Y,
 	 *  CTX == | K(i) | X | Y | i |
 	 *         +------------------+
 	 * */
-	const size_t ctxlen = maclen + 2*pLen + 8;
+	const size_t ctxlen = maclen + 2*elen + 8;
 	/* NOTE: the extra 8 bytes are to concatenate the key chunk index */
 	unsigned char* CTX = malloc(ctxlen);
 	uint64_t index = 0;       /* key index */
@@ -280,12 +531,12 @@ int dh3Final(mpz_t a, mpz_t A, mpz_t x, mpz_t X, mpz_t B, mpz_t Y,
 	/* NOTE: shouldn't swap X,Y since mpz_t params are effectively by-reference */
 	if (mpz_cmp(X,Y) < 0) {
 		Z2BYTES(CTX+maclen,NULL,X);
-		Z2BYTES(CTX+maclen+pLen,NULL,Y);
+		Z2BYTES(CTX+maclen+elen,NULL,Y);
 	} else {
 		Z2BYTES(CTX+maclen,NULL,Y);
-		Z2BYTES(CTX+maclen+pLen,NULL,X);
+		Z2BYTES(CTX+maclen+elen,NULL,X);
 	}
-	memcpy(CTX+maclen+2*pLen,&indexBE,sizeof(indexBE));
+	memcpy(CTX+maclen+2*elen,&indexBE,sizeof(indexBE));
 	unsigned char K[maclen];
 	memset(K,0,maclen);
 	/* compute initial key chunk: */
@@ -298,7 +549,7 @@ int dh3Final(mpz_t a, mpz_t A, mpz_t x, mpz_t X, mpz_t B, mpz_t Y,
 		/* compute next chunk and copy */
 		index++;
 		indexBE = htobe64(index);
-		memcpy(CTX+maclen+2*pLen,&indexBE,sizeof(indexBE));
+		memcpy(CTX+maclen+2*elen,&indexBE,sizeof(indexBE));
 		memcpy(CTX,K,maclen);
 		HMAC(EVP_sha512(),PRK,maclen,CTX,ctxlen,K,0);
 		copylen = (bytesLeft < maclen)?bytesLeft:maclen;
@@ -310,16 +561,134 @@ int dh3Final(mpz_t a, mpz_t A, mpz_t x, mpz_t X, mpz_t B, mpz_t Y,
 	/* erase sensitive data: */
 	memset(CTX,0,ctxlen);
 	memset(K,0,maclen);
-	memset(KM,0,pLen);
+	memset(KM,0,kmlen);
 	memset(PRK,0,maclen);
+	free(CTX);
+	return 0;
+}
+
+int dh3Final(mpz_t a, mpz_t A, mpz_t x, mpz_t X, mpz_t B, mpz_t Y,
+		unsigned char* keybuf, size_t buflen)
+{
+	/* the 3 DH values will be stored in
+	 * AY == Y^a
+	 * XY == Y^x
+	 * XB == B^x
+	 * NOTE: so that both parties derive the same key, we'll swap(AY,XB)
+	 * if necessary, based on whether or not A < B. */
+	NEWZ(AY);
+	mpz_powm(AY,Y,a,p);
+	NEWZ(XY);
+	mpz_powm(XY,Y,x,p);
+	NEWZ(XB);
+	mpz_powm(XB,B,x,p);
+	if (mpz_cmp(A,B) > 0) {
+		mpz_swap(AY,XB);
+	}
+	/* now apply key derivation to get the desired number of bytes: */
+	size_t kmlen = 3*pLen; /* length of raw key material (AY || XY || XB) */
+	unsigned char* KM = malloc(kmlen);
+	memset(KM,0,kmlen);
+	/* NOTE: we discard number of bytes actually written by Z2BYTES and always
+	 * use kmlen, so it is important that we 0 the buffer first. */
+	Z2BYTES(KM,NULL,AY);
+	Z2BYTES(KM+pLen,NULL,XY);
+	Z2BYTES(KM+2*pLen,NULL,XB);
+	kdf3(KM,kmlen,X,Y,pLen,keybuf,buflen);
+	free(KM);
+	mpz_clears(AY,XY,XB,NULL);
 	return 0;
 }
 
+/* X25519 keys are 32 byte strings; we keep them in mpz_t's (see keys.h) and
+ * convert at the boundary.  Z2BYTES drops high zero bytes, hence the memset.
+ * Returns -1 if x doesn't fit. */
+static int x25519bytes(unsigned char* buf, mpz_t x)
+{
+	if (mpz_sizeinbase(x,256) > X25519_KEYLEN) return -1;
+	memset(buf,0,X25519_KEYLEN);
+	Z2BYTES(buf,NULL,x);
+	return 0;
+}
+
+/* out = X25519(sk,pk).  Returns 0 on success. */
+static int x25519(unsigned char* out, mpz_t sk, mpz_t pk)
+{
+	unsigned char skb[X25519_KEYLEN];
+	unsigned char pkb[X25519_KEYLEN];
+	if (x25519bytes(skb,sk) != 0 || x25519bytes(pkb,pk) != 0) {
+		memset(skb,0,X25519_KEYLEN);
+		return -1;
+	}
+	int rv = -1;
+	EVP_PKEY* mine = EVP_PKEY_new_raw_private_key(EVP_PKEY_X25519,NULL,skb,X25519_KEYLEN);
+	EVP_PKEY* yours = EVP_PKEY_new_raw_public_key(EVP_PKEY_X25519,NULL,pkb,X25519_KEYLEN);
+	EVP_PKEY_CTX* ctx = mine ? EVP_PKEY_CTX_new(mine,NULL) : NULL;
+	size_t outlen = X25519_KEYLEN;
+	/* NOTE: derive fails for low order points (all zero output), which is
+	 * exactly the check RFC 7748 asks for. */
+	if (yours && ctx && EVP_PKEY_derive_init(ctx) == 1 &&
+			EVP_PKEY_derive_set_peer(ctx,yours) == 1 &&
+			EVP_PKEY_derive(ctx,out,&outlen) == 1 && outlen == X25519_KEYLEN)
+		rv = 0;
+	EVP_PKEY_CTX_free(ctx);
+	EVP_PKEY_free(yours);
+	EVP_PKEY_free(mine);
+	memset(skb,0,X25519_KEYLEN);
+	return rv;
+}
+
+int dhGenX25519(mpz_t sk, mpz_t pk)
+{
+	unsigned char skb[X25519_KEYLEN];
+	unsigned char pkb[X25519_KEYLEN];
+	if (rng_bytes(skb,X25519_KEYLEN) != 0) {
+		LOGE("Failed to get random bytes");
+		return -1;
+	}
+	EVP_PKEY* k = EVP_PKEY_new_raw_private_key(EVP_PKEY_X25519,NULL,skb,X25519_KEYLEN);
+	size_t pklen = X25519_KEYLEN;
+	int rv = (k && EVP_PKEY_get_raw_public_key(k,pkb,&pklen) == 1) ? 0 : -1;
+	EVP_PKEY_free(k);
+	if (rv == 0) {
+		BYTES2Z(sk,skb,X25519_KEYLEN);
+		BYTES2Z(pk,pkb,X25519_KEYLEN);
+	}
+	memset(skb,0,X25519_KEYLEN);
+	return rv;
+}
+
+int dh3FinalX25519(mpz_t a, mpz_t A, mpz_t x, mpz_t X, mpz_t B, mpz_t Y,
+		unsigned char* keybuf, size_t buflen)
+{
+	/* same layout as dh3Final: KM = AY || XY || XB, with AY and XB
+	 * swapped when A > B so both sides agree. */
+	unsigned char KM[3*X25519_KEYLEN];
+	unsigned char* AY = KM;
+	unsigned char* XY = KM + X25519_KEYLEN;
+	unsigned char* XB = KM + 2*X25519_KEYLEN;
+	if (mpz_cmp(A,B) > 0) {
+		AY = XB;
+		XB = KM;
+	}
+	if (x25519(AY,a,Y) || x25519(XY,x,Y) || x25519(XB,x,B)) {
+		memset(KM,0,sizeof(KM));
+		return -1;
+	}
+	return kdf3(KM,sizeof(KM),X,Y,X25519_KEYLEN,keybuf,buflen);
+}
+
 int dh3Finalk(dhKey* skA, dhKey* skX, dhKey* pkB, dhKey* pkY,
 		unsigned char* keybuf, size_t buflen)
 {
 	assert(skA && skX && pkB && pkY);
 	/* make sure secret key pieces are present: */
 	assert(mpz_cmp_ui(skA->SK,0) > 0 && mpz_cmp_ui(skX->SK,0) > 0);
+	/* all four keys have to come from the same group: */
+	if (skX->group != skA->group || pkB->group != skA->group ||
+			pkY->group != skA->group)
+		return -1;
+	if (skA->group == DH_GROUP_X25519)
+		return dh3FinalX25519(skA->SK,skA->PK,skX->SK,skX->PK,pkB->PK,pkY->PK,keybuf,buflen);
 	return dh3Final(skA->SK,skA->PK,skX->SK,skX->PK,pkB->PK,pkY->PK,keybuf,buflen);
 }
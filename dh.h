@@ -11,21 +11,35 @@ extern size_t pBitlen; /** length of p in bits */
 extern size_t qLen; /** length of q in bytes */
 extern size_t pLen; /** length of p in bytes */
 
+#define X25519_KEYLEN 32 /** length of X25519 public and secret keys in bytes */
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 /* NOTE: you must call init or initFromScratch before doing anything else. */
-/** Try to read q,p,g from a file: */
+/** Try to read q,p,g from a file.  The first successful call validates the
+ * parameters and caches them in binary form in fname.cache; later calls
+ * load the cache and skip validation as long as fname is unchanged. */
 int init(const char* fname);
 /** Generate fresh Diffie Hellman parameters.  This is a somewhat
  * expensive computation, so it's best to save and reuse params.
  * Prints generated parameters to stdout. */
 int initFromScratch(size_t qBitlen, size_t pBitlen);
+/** Like initFromScratch, but silent, and spreads the prime search over
+ * nthreads threads (0 means one per online cpu). */
+int initFromScratchN(size_t qBitlen, size_t pBitlen, size_t nthreads);
+/** Write the current q,p,g to fname in the format init expects. */
+int writeParams(const char* fname);
 /** set sk to a random exponent (this part is secret) and set
  * pk to g^(sk) mod p */
 int dhGen(mpz_t sk, mpz_t pk);
-/** same as dhGen, but accepts key struct */
+/** same as dhGen, but accepts key struct.  k must have been through
+ * initKey (it is not initialized again); generates a key in the group
+ * given by k->group (which initKey sets to DH_GROUP_FF). */
 int dhGenk(dhKey* k);
+/** X25519 version of dhGen: sk is a random 32 byte string, pk = X25519(sk,9).
+ * Does not need init. */
+int dhGenX25519(mpz_t sk, mpz_t pk);
 /** given a secret (sk_mine say from dhGen above) and your friend's
  * public key (pk_yours), compute the diffie hellman value, and
  * apply a KDF to obtain buflen bytes of key, stored in keybuf */
@@ -43,7 +57,13 @@ int dhFinal(mpz_t sk_mine, mpz_t pk_mine, mpz_t pk_yours, unsigned char* keybuf,
  * */
 int dh3Final(mpz_t a, mpz_t A, mpz_t x, mpz_t X, mpz_t B, mpz_t Y,
 		unsigned char* keybuf, size_t buflen);
-/** same as dh3Final, but accepts keys instead */
+/** 3DH over X25519; same parameters and key derivation as dh3Final.
+ * Returns -1 if any of the keys is longer than X25519_KEYLEN bytes, or
+ * any of the peer's points is of low order. */
+int dh3FinalX25519(mpz_t a, mpz_t A, mpz_t x, mpz_t X, mpz_t B, mpz_t Y,
+		unsigned char* keybuf, size_t buflen);
+/** same as dh3Final, but accepts keys instead.  Dispatches on the keys'
+ * group; returns -1 if they do not all belong to the same group. */
 int dh3Finalk(dhKey* skA, dhKey* skX, dhKey* pkB, dhKey* pkY,
 		unsigned char* keybuf, size_t buflen);
 #ifdef __cplusplus
@@ -0,0 +1,39 @@
+/* generate fresh Diffie Hellman parameters and write them in the format
+ * that init() reads. */
+#include "dh.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+int main(int argc, char* argv[])
+{
+	if (argc > 5 || (argc > 1 && argv[1][0] == '-')) {
+		fprintf(stderr, "Usage: %s [QBITS [PBITS [FILE [THREADS]]]]\n"
+				"Defaults: 512 bit q, 4096 bit p, written to params.new, "
+				"one thread per cpu.\n", argv[0]);
+		return 1;
+	}
+	size_t qbits = (argc > 1) ? strtoul(argv[1],NULL,10) : 512;
+	size_t pbits = (argc > 2) ? strtoul(argv[2],NULL,10) : 4096;
+	const char* fname = (argc > 3) ? argv[3] : "params.new";
+	size_t nthreads = (argc > 4) ? strtoul(argv[4],NULL,10) : 0;
+	if (qbits <= 16 || pbits <= qbits + 16) {
+		fprintf(stderr, "need 16 < QBITS < PBITS - 16\n");
+		return 1;
+	}
+
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC,&t0);
+	if (initFromScratchN(qbits,pbits,nthreads) != 0) {
+		fprintf(stderr, "parameter generation failed\n");
+		return 1;
+	}
+	clock_gettime(CLOCK_MONOTONIC,&t1);
+	if (writeParams(fname) != 0) {
+		perror(fname);
+		return 1;
+	}
+	printf("%zu bit q, %zu bit p written to %s in %.2fs\n", qBitlen, pBitlen,
+			fname, (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+	return 0;
+}
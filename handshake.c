@@ -0,0 +1,757 @@
+#include "handshake.h"
+#include "dh.h"
+#include "rng.h"
+#include "util.h"
+#include "log.h"
+#include "metrics.h"
+#include <openssl/sha.h>
+#include <openssl/hmac.h>
+#include <openssl/crypto.h>
+#include <stdio.h>
+#include <string.h>
+#include <endian.h>
+#include <limits.h>
+#include <errno.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+/* groups in order of preference.  Long-term key files are named
+ * <client|server>_long_term_key<suffix> for each group. */
+static const int groupOrder[HS_NGROUPS] = {DH_GROUP_X25519, DH_GROUP_FF};
+static const char* groupName[HS_NGROUPS] = {
+	[DH_GROUP_FF]     = "finite field DH",
+	[DH_GROUP_X25519] = "X25519",
+};
+static const char* groupSuffix[HS_NGROUPS] = {
+	[DH_GROUP_FF]     = "",
+	[DH_GROUP_X25519] = "_x25519",
+};
+
+const char* hs_group_name(int group)
+{
+	return (group >= 0 && group < HS_NGROUPS) ? groupName[group] : "none";
+}
+
+/* states of hsState: what the message just received (or sent) means */
+enum {
+	HSS_CLIENT_HELLO,    /* (nothing yet) send a ClientHello */
+	HSS_CLIENT_STATUS,   /* ServerHello status and group */
+	HSS_CLIENT_COOKIE,   /* the server's cookie */
+	HSS_CLIENT_NONCE,    /* server nonce and element length */
+	HSS_CLIENT_ELEM,     /* server element and finished MAC */
+	HSS_CLIENT_FINISHED, /* ClientFinished is out: done */
+	HSS_SERVER_HELLO,    /* ClientHello up to the element length */
+	HSS_SERVER_ELEM,     /* the client's element */
+	HSS_SERVER_FINISHED, /* ClientFinished */
+	HSS_SERVER_FAIL,     /* HS_FAIL is out: give up */
+	HSS_DONE
+};
+#define HS_CONTINUE 4 /* from advance: go on with the next message */
+
+#define COOKIE_SLOT_MS 10000 /* a cookie is good for one to two of these */
+
+static void progress(const hsConfig* cfg, const char* step)
+{
+	if (cfg->progress) cfg->progress(step,cfg->progress_arg);
+}
+
+static void countHandshake(int rv, int64_t t0)
+{
+	metrics_add(rv == 0 ? MC_HANDSHAKES : MC_HANDSHAKE_FAILURES,1);
+	metrics_observe_ns(MH_HANDSHAKE_SECONDS,monotonic_ns() - t0);
+}
+
+static const char* who(const hsState* hs)
+{
+	return hs->cfg->isclient ? "Client" : "Server";
+}
+
+/* the handshake is over: erase the keys and count it */
+static int finish(hsState* hs, int rv)
+{
+	shredKey(&hs->mine); shredKey(&hs->yours);
+	shredKey(&hs->eph); shredKey(&hs->peerEph);
+	OPENSSL_cleanse(hs->keymat,REC_KEYMAT);
+	countHandshake(rv,hs->t0);
+	hs->state = HSS_DONE;
+	hs->result = rv;
+	return rv;
+}
+
+static int ioFail(hsState* hs, int err)
+{
+	const char* why = (err == -ETIMEDOUT) ? "timed out" :
+		(err == -ECANCELED) ? "cancelled" :
+		(err == -EPIPE) ? "peer hung up" : strerror(-err);
+	LOGW("%s: handshake failed: %s", who(hs), why);
+	return finish(hs,-1);
+}
+
+/* queue buf for sending, then wait for exactly n bytes into in */
+static void sendThen(hsState* hs, const unsigned char* buf, size_t len,
+		unsigned char* in, size_t n)
+{
+	hs->out = buf;
+	hs->outlen = len;
+	hs->sent = 0;
+	hs->in = in;
+	hs->need = n;
+	hs->have = 0;
+}
+
+/* encoded size of a group element */
+static size_t elemLen(int group)
+{
+	return (group == DH_GROUP_X25519) ? X25519_KEYLEN : pLen;
+}
+
+/* whether k's public key fits its group's encoding; a long X25519 key
+ * would overrun the buffers in dh.c, a long finite field one ours */
+static int keyFits(const dhKey* k)
+{
+	return mpz_sizeinbase(k->PK,256) <= elemLen(k->group);
+}
+
+/* most preferred group in mask, or HS_NOGROUP */
+static int pickGroup(unsigned char mask)
+{
+	for (size_t i = 0; i < HS_NGROUPS; i++) {
+		if (mask & (1 << groupOrder[i]))
+			return groupOrder[i];
+	}
+	return HS_NOGROUP;
+}
+
+/* the handshake's own copy of a long-term key, which finish shreds */
+static void copyKey(dhKey* to, const dhKey* from)
+{
+	to->group = from->group;
+	memcpy(to->name,from->name,sizeof(to->name));
+	mpz_set(to->PK,from->PK);
+	mpz_set(to->SK,from->SK);
+}
+
+/* read our own long-term secret key for the given group */
+static int readOwnKey(const hsConfig* cfg, int group, dhKey* mine)
+{
+	char fname[PATH_MAX];
+	snprintf(fname, sizeof(fname), "%s_long_term_key%s",
+			cfg->isclient ? "client" : "server", groupSuffix[group]);
+	if (readDH(fname, mine) != 0 || mine->group != group || !keyFits(mine))
+		return -1;
+	return 0;
+}
+
+/* read the peer's long-term public key for the given group from its file */
+static int readPeerKey(const hsConfig* cfg, int group, dhKey* yours)
+{
+	char fname[PATH_MAX];
+	snprintf(fname, sizeof(fname), "%s_long_term_key%s.pub",
+			cfg->isclient ? "server" : "client", groupSuffix[group]);
+	if (readDH(fname, yours) != 0 || yours->group != group || !keyFits(yours))
+		return -1;
+	return 0;
+}
+
+/* copy the peer's long-term public key for the given group into yours.
+ * If fp is not NULL, the key must have that fingerprint (see hashPKbin). */
+static int peerKey(const hsConfig* cfg, int group, const unsigned char* fp,
+		dhKey* yours)
+{
+	if (cfg->peers && fp) {
+		if (ks_lookup(cfg->peers, fp, yours) != 0) {
+			initKey(yours);
+			return -1;
+		}
+		return (yours->group == group && keyFits(yours)) ? 0 : -1;
+	}
+	if (fp && memcmp(cfg->peerFp[group], fp, KS_FPLEN) != 0) return -1;
+	copyKey(yours, &cfg->peer[group]);
+	return 0;
+}
+
+int hs_load_keys(hsConfig* cfg)
+{
+	cfg->groups = 0;
+	for (int group = 0; group < HS_NGROUPS; group++) {
+		int rv = -1;
+		if (cfg->groupPref < 0 || group == cfg->groupPref)
+			rv = readOwnKey(cfg, group, &cfg->own[group]);
+		else
+			initKey(&cfg->own[group]);
+		if (rv == 0 && (cfg->isclient || !cfg->peers)) {
+			rv = readPeerKey(cfg, group, &cfg->peer[group]);
+			hashPKbin(&cfg->peer[group], cfg->peerFp[group]);
+		} else {
+			initKey(&cfg->peer[group]);
+		}
+		if (rv == 0)
+			cfg->groups |= 1 << group;
+	}
+	cfg->keysLoaded = 1;
+	return cfg->groups ? 0 : -1;
+}
+
+void hs_free_keys(hsConfig* cfg)
+{
+	if (!cfg->keysLoaded) return;
+	for (int group = 0; group < HS_NGROUPS; group++) {
+		shredKey(&cfg->own[group]);
+		shredKey(&cfg->peer[group]);
+	}
+	cfg->groups = 0;
+	cfg->keysLoaded = 0;
+}
+
+unsigned char hs_groups(const hsConfig* cfg)
+{
+	return cfg->groups;
+}
+
+/* append a group element: 4 byte length, then exactly elemLen bytes so
+ * the encoding doesn't depend on leading zeros. */
+static size_t putElem(unsigned char* buf, mpz_t x, int group)
+{
+	size_t len = elemLen(group);
+	LE(len);
+	memcpy(buf,&len_le,4);
+	memset(buf+4,0,len);
+	Z2BYTES(buf+4,NULL,x);
+	return 4 + len;
+}
+
+/* length of the encoded group element whose 4 byte length is at buf, or
+ * 0 if it is the wrong length */
+static size_t elemLenAt(const unsigned char* buf, int group)
+{
+	uint32_t len_le;
+	memcpy(&len_le,buf,4);
+	size_t len = le32toh(len_le);
+	return (len != elemLen(group) || len > HS_MAXELEM) ? 0 : len;
+}
+
+/* decode the element at buf (length already checked) into x.  For the
+ * finite field group, rejects values outside [2,p-2]. */
+static int getElem(const unsigned char* buf, mpz_t x, int group)
+{
+	BYTES2Z(x,buf+4,elemLen(group));
+	if (group == DH_GROUP_FF) {
+		NEWZ(pm1);
+		mpz_sub_ui(pm1,p,1);
+		int bad = mpz_cmp_ui(x,1) <= 0 || mpz_cmp(x,pm1) >= 0;
+		mpz_clear(pm1);
+		if (bad) return -1;
+	}
+	return 0;
+}
+
+/* finished MAC: HMAC-SHA256(k, label || SHA256(transcript)) */
+static void finishedMac(const unsigned char* k, const char* label,
+		const unsigned char* T, unsigned char* mac)
+{
+	unsigned char msg[8 + SHA256_DIGEST_LENGTH];
+	size_t llen = strlen(label);
+	memcpy(msg,label,llen);
+	memcpy(msg+llen,T,SHA256_DIGEST_LENGTH);
+	HMAC(EVP_sha256(),k,HS_MACLEN,msg,llen+SHA256_DIGEST_LENGTH,mac,NULL);
+}
+
+/* 3DH, then split the output into record keys and both finished MACs */
+static int deriveKeys(dhKey* skA, dhKey* skX, dhKey* pkB, dhKey* pkY,
+		const unsigned char* ch, size_t chlen,
+		const unsigned char* sh, size_t shlen,
+		unsigned char* keymat, unsigned char* cfin, unsigned char* sfin)
+{
+	unsigned char km[REC_KEYMAT + HS_MACLEN];
+	if (dh3Finalk(skA,skX,pkB,pkY,km,sizeof(km)) != 0) return -1;
+	memcpy(keymat,km,REC_KEYMAT);
+	unsigned char t[2*HS_MAXMSG];
+	unsigned char T[SHA256_DIGEST_LENGTH];
+	memcpy(t,ch,chlen);
+	memcpy(t+chlen,sh,shlen);
+	SHA256(t,chlen+shlen,T);
+	finishedMac(km+REC_KEYMAT,"client",T,cfin);
+	finishedMac(km+REC_KEYMAT,"server",T,sfin);
+	memset(km,0,sizeof(km));
+	return 0;
+}
+
+/* run work, then then: right here, or (cfg->offload) by way of
+ * HS_WANT_CRYPTO, hs_crypto and the next hs_step */
+static int crypto(hsState* hs, int (*work)(hsState*), int (*then)(hsState*))
+{
+	hs->work = work;
+	hs->then = then;
+	if (hs->cfg->offload) return HS_WANT_CRYPTO;
+	hs_crypto(hs);
+	return HS_CONTINUE;
+}
+
+void hs_crypto(hsState* hs)
+{
+	if (!hs->work) return;
+	hs->workResult = hs->work(hs);
+	hs->work = NULL;
+}
+
+/* ---- client ---- */
+
+/* work: our keys and an ephemeral key in hs->share */
+static int clientKeys(hsState* hs)
+{
+	const hsConfig* cfg = hs->cfg;
+	copyKey(&hs->mine,&cfg->own[hs->share]);
+	copyKey(&hs->yours,&cfg->peer[hs->share]);
+	hs->eph.group = hs->peerEph.group = hs->share;
+	return (dhGenk(&hs->eph) != 0 ||
+			rng_bytes(hs->ch+3+KS_FPLEN,HS_NONCELEN) != 0) ? -1 : 0;
+}
+
+/* ClientHello with a share in hs->share */
+static int clientHelloSend(hsState* hs)
+{
+	const hsConfig* cfg = hs->cfg;
+	unsigned char* ch = hs->ch;
+	if (hs->workResult) return finish(hs,-1);
+	ch[0] = HS_VERSION;
+	ch[1] = hs->groups;
+	ch[2] = hs->share;
+	hashPKbin(&hs->mine,ch+3);
+	hs->chlen = HS_HELLOHDR + putElem(ch+HS_HELLOHDR,hs->eph.PK,hs->share);
+	sendThen(hs,ch,hs->chlen,hs->sh,2);
+	progress(cfg,"waiting for the server");
+	hs->state = HSS_CLIENT_STATUS;
+	return HS_CONTINUE;
+}
+
+static int clientHello(hsState* hs)
+{
+	/* finish shreds all four again, so they must be live whatever fails */
+	shredKey(&hs->mine); shredKey(&hs->yours);
+	shredKey(&hs->eph); shredKey(&hs->peerEph);
+	initKey(&hs->mine); initKey(&hs->yours);
+	initKey(&hs->eph); initKey(&hs->peerEph);
+	progress(hs->cfg,"generating ephemeral key");
+	return crypto(hs,clientKeys,clientHelloSend);
+}
+
+static int clientStatus(hsState* hs)
+{
+	unsigned char* sh = hs->sh;
+	if (sh[0] == HS_COOKIE && !hs->cookie) {
+		hs->cookie = 1;
+		sendThen(hs,NULL,0,hs->ch+hs->chlen,HS_COOKIELEN);
+		hs->state = HSS_CLIENT_COOKIE;
+		return HS_CONTINUE;
+	}
+	if (sh[0] == HS_RETRY && hs->attempt == 0 && sh[1] < HS_NGROUPS &&
+			(hs->groups & (1 << sh[1])) && sh[1] != hs->share) {
+		LOGI("Client: server asked for %s instead", hs_group_name(sh[1]));
+		hs->share = sh[1];
+		hs->attempt++;
+		return clientHello(hs);
+	}
+	if (sh[0] != HS_OK || sh[1] != hs->share) {
+		LOGW("Client: server refused the handshake");
+		return finish(hs,-1);
+	}
+	sendThen(hs,NULL,0,sh+2,HS_NONCELEN+4);
+	hs->state = HSS_CLIENT_NONCE;
+	return HS_CONTINUE;
+}
+
+/* the same ClientHello again, with the cookie after it */
+static int clientCookie(hsState* hs)
+{
+	LOGI("Client: server is busy, echoing its cookie");
+	sendThen(hs,hs->ch,hs->chlen+HS_COOKIELEN,hs->sh,2);
+	hs->state = HSS_CLIENT_STATUS;
+	return HS_CONTINUE;
+}
+
+static int clientNonce(hsState* hs)
+{
+	size_t len = elemLenAt(hs->sh+2+HS_NONCELEN,hs->share);
+	if (!len) {
+		LOGW("Client: bad server public key");
+		return finish(hs,-1);
+	}
+	sendThen(hs,NULL,0,hs->sh+2+HS_NONCELEN+4,len+HS_MACLEN);
+	hs->state = HSS_CLIENT_ELEM;
+	return HS_CONTINUE;
+}
+
+/* work: record keys and both finished MACs */
+static int clientDerive(hsState* hs)
+{
+	return deriveKeys(&hs->mine,&hs->eph,&hs->yours,&hs->peerEph,hs->ch,hs->chlen,
+			hs->sh,hs->shlen,hs->keymat,hs->fin,hs->mac);
+}
+
+static int clientConfirm(hsState* hs)
+{
+	if (hs->workResult) {
+		LOGE("Client: key derivation failed");
+		return finish(hs,-1);
+	}
+	if (CRYPTO_memcmp(hs->sh+hs->shlen,hs->mac,HS_MACLEN) != 0) {
+		LOGW("Client: Authentication failed - derived different key than server");
+		return finish(hs,-1);
+	}
+	/* ClientFinished; the caller's first records follow right behind */
+	sendThen(hs,hs->fin,HS_MACLEN,NULL,0);
+	hs->state = HSS_CLIENT_FINISHED;
+	return HS_CONTINUE;
+}
+
+static int clientElem(hsState* hs)
+{
+	if (getElem(hs->sh+2+HS_NONCELEN,hs->peerEph.PK,hs->share) != 0) {
+		LOGW("Client: bad server public key");
+		return finish(hs,-1);
+	}
+	hs->shlen = 2 + HS_NONCELEN + 4 + elemLen(hs->share);
+	progress(hs->cfg,"deriving keys");
+	return crypto(hs,clientDerive,clientConfirm);
+}
+
+static int clientDone(hsState* hs)
+{
+	int rv = record_init(hs->rs,hs->keymat,hs->ch+3+KS_FPLEN,hs->sh+2,1);
+	if (rv == 0 && hs->peer) strncpy(hs->peer,hs->yours.name,MAX_NAME+1);
+	LOGI("Client: secure channel established (%s)", hs_group_name(hs->share));
+	return finish(hs,rv);
+}
+
+/* ---- server ---- */
+
+/* tell the client no, then give up */
+static int serverFail(hsState* hs)
+{
+	hs->status[0] = HS_FAIL;
+	hs->status[1] = HS_NOGROUP;
+	sendThen(hs,hs->status,2,NULL,0);
+	hs->state = HSS_SERVER_FAIL;
+	return HS_CONTINUE;
+}
+
+static int serverHello(hsState* hs)
+{
+	unsigned char* ch = hs->ch;
+	if (ch[0] != HS_VERSION) {
+		LOGW("Server: client speaks protocol version %d", ch[0]);
+		return serverFail(hs);
+	}
+	hs->group = pickGroup(ch[1] & hs->groups);
+	hs->share = ch[2];
+	if (hs->group == HS_NOGROUP || hs->share >= HS_NGROUPS) {
+		LOGW("Server: no key exchange group in common with client");
+		return serverFail(hs);
+	}
+	size_t len = elemLenAt(ch+HS_HELLOHDR,hs->share);
+	if (!len) {
+		LOGW("Server: bad client public key");
+		return serverFail(hs);
+	}
+	sendThen(hs,NULL,0,ch+HS_HELLOHDR+4,len + ((hs->cookie == 1) ? HS_COOKIELEN : 0));
+	hs->state = HSS_SERVER_ELEM;
+	return HS_CONTINUE;
+}
+
+/* count a ClientHello.  @return whether more than c->rate arrived this
+ * second or the one before. */
+static int busy(hsCookies* c)
+{
+	if (c->rate <= 0) return 1;
+	long long now = monotonic_ms() / 1000;
+	long long was = atomic_load_explicit(&c->second,memory_order_relaxed);
+	if (now != was && atomic_compare_exchange_strong(&c->second,&was,now)) {
+		int last = atomic_exchange(&c->seen,0);
+		atomic_store(&c->seenBefore,(now == was + 1) ? last : 0);
+	}
+	int n = atomic_fetch_add_explicit(&c->seen,1,memory_order_relaxed) + 1;
+	return n > c->rate ||
+		atomic_load_explicit(&c->seenBefore,memory_order_relaxed) > c->rate;
+}
+
+/* the cookie for the ClientHello in hs->ch, from this client, in slot */
+static void makeCookie(const hsState* hs, int64_t slot, unsigned char* cookie)
+{
+	unsigned char msg[8 + 16 + HS_MAXMSG];
+	uint64_t slot_le = htole64(slot);
+	size_t n = 8;
+	memcpy(msg,&slot_le,8);
+	struct sockaddr_storage sa;
+	socklen_t salen = sizeof(sa);
+	if (getpeername(hs->fd,(struct sockaddr*)&sa,&salen) == 0) {
+		if (sa.ss_family == AF_INET) {
+			memcpy(msg+n,&((struct sockaddr_in*)&sa)->sin_addr,4);
+			n += 4;
+		} else if (sa.ss_family == AF_INET6) {
+			memcpy(msg+n,&((struct sockaddr_in6*)&sa)->sin6_addr,16);
+			n += 16;
+		}
+	}
+	memcpy(msg+n,hs->ch,hs->chlen);
+	n += hs->chlen;
+	HMAC(EVP_sha256(),hs->cfg->cookies->secret,HS_MACLEN,msg,n,cookie,NULL);
+}
+
+static int cookieOk(const hsState* hs)
+{
+	unsigned char want[HS_COOKIELEN];
+	int64_t slot = monotonic_ms() / COOKIE_SLOT_MS;
+	for (int64_t s = slot; s >= slot - 1; s--) {
+		makeCookie(hs,s,want);
+		if (CRYPTO_memcmp(want,hs->ch+hs->chlen,HS_COOKIELEN) == 0) return 1;
+	}
+	return 0;
+}
+
+/* busy: have the client prove it's there before we spend CPU on it */
+static int askCookie(hsState* hs)
+{
+	unsigned char* sh = hs->sh;
+	sh[0] = HS_COOKIE;
+	sh[1] = hs->group;
+	makeCookie(hs,monotonic_ms() / COOKIE_SLOT_MS,sh+2);
+	hs->cookie = 1;
+	metrics_add(MC_COOKIES,1);
+	sendThen(hs,sh,2+HS_COOKIELEN,hs->ch,HS_HELLOHDR+4);
+	hs->state = HSS_SERVER_HELLO;
+	return HS_CONTINUE;
+}
+
+int hs_cookies_init(hsCookies* c, int rate)
+{
+	c->rate = rate;
+	atomic_init(&c->second,0);
+	atomic_init(&c->seen,0);
+	atomic_init(&c->seenBefore,0);
+	return rng_bytes(c->secret,sizeof(c->secret));
+}
+
+/* work: our keys, the ServerHello and what the client should answer.
+ * @return -1 if the client's key is unknown, -2 if the rest failed. */
+static int serverKeys(hsState* hs)
+{
+	const hsConfig* cfg = hs->cfg;
+	unsigned char* sh = hs->sh;
+	int group = hs->group;
+	copyKey(&hs->mine,&cfg->own[group]);
+	if (peerKey(cfg,group,hs->ch+3,&hs->yours) != 0)
+		return -1;
+	if (dhGenk(&hs->eph) != 0 || rng_bytes(sh+2,HS_NONCELEN) != 0)
+		return -2;
+	/* ServerHello; the finished MAC covers everything before it */
+	sh[0] = HS_OK;
+	sh[1] = group;
+	hs->shlen = 2 + HS_NONCELEN;
+	hs->shlen += putElem(sh+hs->shlen,hs->eph.PK,group);
+	if (deriveKeys(&hs->mine,&hs->eph,&hs->yours,&hs->peerEph,hs->ch,hs->chlen,
+				sh,hs->shlen,hs->keymat,hs->fin,sh+hs->shlen) != 0)
+		return -2;
+	return 0;
+}
+
+static int serverHelloSend(hsState* hs)
+{
+	if (hs->workResult == -1) {
+		LOGW("Server: Unknown client long term key");
+		return serverFail(hs);
+	}
+	if (hs->workResult) {
+		LOGE("Server: key derivation failed");
+		return serverFail(hs);
+	}
+	sendThen(hs,hs->sh,hs->shlen+HS_MACLEN,hs->mac,HS_MACLEN);
+	progress(hs->cfg,"waiting for key confirmation");
+	hs->state = HSS_SERVER_FINISHED;
+	return HS_CONTINUE;
+}
+
+static int serverElem(hsState* hs)
+{
+	unsigned char* ch = hs->ch;
+	int group = hs->group;
+	hs->chlen = HS_HELLOHDR + 4 + elemLen(hs->share);
+	if (hs->cookie == 1) {
+		if (!cookieOk(hs)) {
+			LOGW("Server: bad cookie");
+			return serverFail(hs);
+		}
+		hs->cookie = 2;
+	}
+	if (hs->share != group) {
+		/* NOTE: we insist on our own preference, even on the second
+		 * attempt, so a man in the middle can't talk us down. */
+		if (hs->attempt++) return serverFail(hs);
+		hs->status[0] = HS_RETRY;
+		hs->status[1] = group;
+		sendThen(hs,hs->status,2,ch,HS_HELLOHDR+4);
+		hs->state = HSS_SERVER_HELLO;
+		return HS_CONTINUE;
+	}
+	/* nothing so far has cost more than a hash: the client's key isn't
+	 * even decoded until it has shown it can answer */
+	if (!hs->cookie && hs->cfg->cookies && busy(hs->cfg->cookies))
+		return askCookie(hs);
+	shredKey(&hs->peerEph);
+	initKey(&hs->peerEph);
+	hs->peerEph.group = hs->share;
+	if (getElem(ch+HS_HELLOHDR,hs->peerEph.PK,hs->share) != 0) {
+		LOGW("Server: bad client public key");
+		return serverFail(hs);
+	}
+	shredKey(&hs->mine); shredKey(&hs->yours);
+	shredKey(&hs->eph);
+	initKey(&hs->mine); initKey(&hs->yours);
+	initKey(&hs->eph);
+	hs->eph.group = group;
+	progress(hs->cfg,"generating keys");
+	return crypto(hs,serverKeys,serverHelloSend);
+}
+
+static int serverDone(hsState* hs)
+{
+	if (CRYPTO_memcmp(hs->mac,hs->fin,HS_MACLEN) != 0) {
+		LOGW("Server: Authentication failed - client derived different key");
+		return finish(hs,-1);
+	}
+	int rv = record_init(hs->rs,hs->keymat,hs->ch+3+KS_FPLEN,hs->sh+2,0);
+	if (rv == 0 && hs->peer) strncpy(hs->peer,hs->yours.name,MAX_NAME+1);
+	LOGI("Server: secure channel established with %s (%s)",
+			hs->yours.name, hs_group_name(hs->group));
+	return finish(hs,rv);
+}
+
+/* ---- driving it ---- */
+
+/* everything queued has been sent and everything expected received: act
+ * on it.  @return HS_CONTINUE, or the handshake's result. */
+static int advance(hsState* hs)
+{
+	switch (hs->state) {
+		case HSS_CLIENT_HELLO:    return clientHello(hs);
+		case HSS_CLIENT_STATUS:   return clientStatus(hs);
+		case HSS_CLIENT_COOKIE:   return clientCookie(hs);
+		case HSS_CLIENT_NONCE:    return clientNonce(hs);
+		case HSS_CLIENT_ELEM:     return clientElem(hs);
+		case HSS_CLIENT_FINISHED: return clientDone(hs);
+		case HSS_SERVER_HELLO:    return serverHello(hs);
+		case HSS_SERVER_ELEM:     return serverElem(hs);
+		case HSS_SERVER_FINISHED: return serverDone(hs);
+		case HSS_SERVER_FAIL:     return finish(hs,-1);
+	}
+	return hs->result;
+}
+
+int hs_start(hsState* hs, int fd, const hsConfig* cfg, recordState* rs, char* peer)
+{
+	memset(hs,0,sizeof(*hs));
+	hs->cfg = cfg;
+	hs->fd = fd;
+	hs->rs = rs;
+	hs->peer = peer;
+	if (!cfg->keysLoaded) {
+		LOGE("%s: no keys loaded (see hs_load_keys)", who(hs));
+		hs->state = HSS_DONE;
+		hs->result = -1;
+		return -1;
+	}
+	hs->groups = cfg->groups;
+	if (cfg->isclient) {
+		hs->share = pickGroup(hs->groups);
+		if (hs->share == HS_NOGROUP) {
+			LOGW("Client: no long-term keys to offer");
+			hs->state = HSS_DONE;
+			hs->result = -1;
+			return -1;
+		}
+		hs->state = HSS_CLIENT_HELLO;
+	} else {
+		hs->state = HSS_SERVER_HELLO;
+		sendThen(hs,NULL,0,hs->ch,HS_HELLOHDR+4);
+	}
+	initKey(&hs->mine); initKey(&hs->yours);
+	initKey(&hs->eph); initKey(&hs->peerEph);
+	hs->t0 = monotonic_ns();
+	hs->deadline = monotonic_ms() +
+		(cfg->timeout_ms > 0 ? cfg->timeout_ms : HS_TIMEOUT_MS);
+	return 0;
+}
+
+int hs_step(hsState* hs)
+{
+	int rv = HS_CONTINUE;
+	while (rv == HS_CONTINUE) {
+		if (hs->state == HSS_DONE) return hs->result;
+		if (monotonic_ms() >= hs->deadline) return ioFail(hs,-ETIMEDOUT);
+		if (hs->work) return HS_WANT_CRYPTO;
+		if (hs->then) {
+			int (*then)(hsState*) = hs->then;
+			hs->then = NULL;
+			rv = then(hs);
+			continue;
+		}
+		while (hs->sent < hs->outlen) {
+			ssize_t n = send(hs->fd,hs->out+hs->sent,hs->outlen-hs->sent,
+					MSG_DONTWAIT|MSG_NOSIGNAL);
+			if (n < 0 && errno == EINTR) continue;
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return HS_WANT_WRITE;
+			if (n < 0) return ioFail(hs,-errno);
+			hs->sent += n;
+		}
+		/* exactly what we need: anything after the handshake is the
+		 * caller's */
+		while (hs->have < hs->need) {
+			ssize_t n = recv(hs->fd,hs->in+hs->have,hs->need-hs->have,MSG_DONTWAIT);
+			if (n < 0 && errno == EINTR) continue;
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return HS_WANT_READ;
+			if (n < 0) return ioFail(hs,-errno);
+			if (n == 0) return ioFail(hs,-EPIPE);
+			hs->have += n;
+		}
+		rv = advance(hs);
+	}
+	return rv;
+}
+
+void hs_abort(hsState* hs)
+{
+	if (hs->state != HSS_DONE) finish(hs,-1);
+}
+
+/* hs_step until done, waiting in poll (and watching cfg->cancelfd) */
+static int run(int fd, const hsConfig* cfg, recordState* rs, char* peer)
+{
+	hsState hs;
+	if (hs_start(&hs,fd,cfg,rs,peer) != 0) return -1;
+	int rv;
+	while ((rv = hs_step(&hs)) > 0) {
+		if (rv == HS_WANT_CRYPTO) {
+			hs_crypto(&hs);
+			continue;
+		}
+		struct pollfd pfd[2] = {
+			{fd, (rv == HS_WANT_READ) ? POLLIN : POLLOUT, 0},
+			{cfg->cancelfd, POLLIN, 0},
+		};
+		int64_t left = hs.deadline - monotonic_ms();
+		int r = poll(pfd,(cfg->cancelfd >= 0) ? 2 : 1,(left > 0) ? left : 0);
+		if (r < 0 && errno != EINTR) return ioFail(&hs,-errno);
+		if (r > 0 && pfd[1].revents) return ioFail(&hs,-ECANCELED);
+	}
+	return rv;
+}
+
+int hs_client(int fd, const hsConfig* cfg, recordState* rs, char* peer)
+{
+	return run(fd,cfg,rs,peer);
+}
+
+int hs_server(int fd, const hsConfig* cfg, recordState* rs, char* peer)
+{
+	return run(fd,cfg,rs,peer);
+}
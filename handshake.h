@@ -0,0 +1,181 @@
+/* 3DH handshake: group negotiation, key exchange and key confirmation in
+ * a single round trip. */
+#pragma once
+#include "keys.h"
+#include "keystore.h"
+#include "record.h"
+#include <stdatomic.h>
+
+#define HS_VERSION  4
+#define HS_NONCELEN REC_IVLEN
+#define HS_MACLEN   32
+#define HS_COOKIELEN 32
+#define HS_NGROUPS  2
+#define HS_NOGROUP  0xff
+#define HS_TIMEOUT_MS 10000 /* default time limit for the whole handshake */
+
+/* fixed part of the ClientHello (version, offer, share, fp, nonce) */
+#define HS_HELLOHDR (3 + KS_FPLEN + HS_NONCELEN)
+#define HS_MAXELEM  1024 /* largest encoded group element we accept */
+#define HS_MAXMSG   (HS_HELLOHDR + 4 + HS_MAXELEM + HS_MACLEN)
+
+/* Messages (integers little endian; "pk" is a 4 byte length + the bytes):
+ *
+ * client -> server, ClientHello:
+ *  | version | offer | share | client fp (32) | client nonce (16) | pk |
+ *    offer is a bitmask (1 << group) of the groups the client has keys
+ *    for; pk is an ephemeral key in group `share`, the client's first
+ *    choice; fp is the fingerprint of the client's long-term key.
+ *
+ * server -> client, ServerHello:
+ *  | status | group | server nonce (16) | pk | server finished (32) |
+ *    status HS_OK: everything after group is present.  HS_RETRY: the
+ *    server prefers `group`; the client sends a new ClientHello with a
+ *    share in that group (one extra round trip, only on a mismatch).
+ *    HS_FAIL: nothing in common or unknown client; the server hangs up.
+ *    HS_COOKIE: the server is busy; group is followed by | cookie (32) |
+ *    only, and the client sends its ClientHello again, unchanged but for
+ *    the cookie after pk.  The cookie is HMAC-SHA256 under a server secret
+ *    of the time, the client's address and the ClientHello, so the server
+ *    remembers nothing while it waits, and spends no CPU on a client that
+ *    doesn't answer.  It asks at most once per handshake.
+ *
+ * client -> server, ClientFinished:
+ *  | client finished (32) |
+ *    sent together with the client's first records, so application data
+ *    flows after one round trip.
+ *
+ * The 3DH output is expanded to REC_KEYMAT bytes of record keys plus a
+ * confirmation key k.  With T = SHA256(ClientHello || ServerHello up to
+ * the finished MAC), server finished = HMAC-SHA256(k, "server" || T) and
+ * client finished = HMAC-SHA256(k, "client" || T).  Both directions use
+ * their sender's nonce as the CTR IV. */
+#define HS_OK    0
+#define HS_RETRY 1
+#define HS_FAIL  2
+#define HS_COOKIE 3
+
+/* Server: when to ask for cookies (see hs_cookies_init).  One of these is
+ * shared by all of a server's handshakes, on any number of threads. */
+typedef struct {
+	unsigned char secret[HS_MACLEN];
+	int rate;                    /* ClientHellos/s above which to ask; 0: always */
+	atomic_llong second;         /* the current one (monotonic) */
+	atomic_int seen, seenBefore; /* ClientHellos in it, and in the one before */
+} hsCookies;
+
+typedef struct {
+	int isclient;
+	int groupPref;       /* only offer/accept this group if >= 0 */
+	keystore* peers;     /* if not NULL, the server finds client keys here;
+	                        otherwise <peer>_long_term_key*.pub is used */
+	int timeout_ms;      /* give up after this long; 0 for HS_TIMEOUT_MS */
+	int cancelfd;        /* give up as soon as this is readable; -1 if unused */
+	/* if not NULL, called (on the handshake's thread) as each step starts */
+	void (*progress)(const char* step, void* arg);
+	void* progress_arg;
+	/* server: if not NULL, clients must echo a cookie before we spend CPU
+	 * on their handshake whenever we are busy */
+	hsCookies* cookies;
+	/* if set, hs_step leaves the expensive steps (key generation and
+	 * derivation) to hs_crypto: see HS_WANT_CRYPTO */
+	int offload;
+	/* filled in by hs_load_keys: our long-term keys and (unless a server
+	 * uses peers) the peer's, by group, so no handshake reads a file */
+	dhKey own[HS_NGROUPS], peer[HS_NGROUPS];
+	unsigned char peerFp[HS_NGROUPS][KS_FPLEN];
+	unsigned char groups; /* those with every key needed */
+	int keysLoaded;
+} hsConfig;
+
+/* what hs_step is waiting for, when it isn't done */
+#define HS_WANT_READ   1
+#define HS_WANT_WRITE  2
+#define HS_WANT_CRYPTO 3 /* (cfg->offload only) */
+
+/* A handshake in progress (see hs_start).  Everything in here belongs to
+ * hs_step, except deadline, which an event loop needs to know. */
+typedef struct hsState {
+	const hsConfig* cfg;
+	int fd;
+	recordState* rs;
+	char* peer;
+	int64_t deadline;      /* monotonic_ms() time at which it fails */
+	int64_t t0;
+	int state, result;
+	int attempt;
+	int cookie;            /* client: got one (after ch); server: 1 asked, 2 checked */
+	unsigned char groups;  /* client: offered; server: supported */
+	int share, group;
+	unsigned char ch[HS_MAXMSG], sh[HS_MAXMSG]; /* the two hellos */
+	size_t chlen, shlen;
+	unsigned char status[2];
+	unsigned char fin[HS_MACLEN];  /* client: ours; server: the expected one */
+	unsigned char mac[HS_MACLEN];  /* client: the expected one; server: the client's */
+	unsigned char keymat[REC_KEYMAT];
+	dhKey mine, yours, eph, peerEph;
+	const unsigned char* out;      /* being sent */
+	size_t outlen, sent;
+	unsigned char* in;             /* being received */
+	size_t need, have;
+	int (*work)(struct hsState*);  /* expensive step waiting for hs_crypto */
+	int (*then)(struct hsState*);  /* what hs_step does after it */
+	int workResult;
+} hsState;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/** Read the long-term keys cfg's handshakes will use, for each group
+ * groupPref allows: <us>_long_term_key*, and <peer>_long_term_key*.pub
+ * unless this is a server with a keystore.  Call it once isclient,
+ * groupPref and peers are set (and after init, for the finite field
+ * group), before the first handshake.
+ * @return 0 if there is at least one group with all its keys, else -1. */
+int hs_load_keys(hsConfig* cfg);
+/** Erase the keys hs_load_keys read. */
+void hs_free_keys(hsConfig* cfg);
+/** Start a handshake over the socket fd without blocking: as client or
+ * server according to cfg (which must stay around until it is done, and
+ * have been through hs_load_keys).  Then
+ * call hs_step until it returns 0 or -1.  Any number of handshakes can be
+ * in progress at once, on however many threads, each with its own
+ * deadline.
+ * @return 0 on success, -1 if there are no keys to offer. */
+int hs_start(hsState* hs, int fd, const hsConfig* cfg, recordState* rs, char* peer);
+/** Do as much of the handshake as can be done without blocking.
+ * @return 0 once it has succeeded: *rs is ready and peer (if not NULL,
+ * MAX_NAME+1 bytes) holds the name on the peer's long-term key.
+ * HS_WANT_READ / HS_WANT_WRITE: call again once fd is readable / writable,
+ * or at hs->deadline at the latest (when it fails).  HS_WANT_CRYPTO: call
+ * hs_crypto, then this again.  -1 once it has failed.  After 0 or -1, the
+ * handshake's keys are erased. */
+int hs_step(hsState* hs);
+/** Do the expensive step that hs_step returned HS_WANT_CRYPTO for.  Meant
+ * for a worker thread, so that the thread doing the I/O stays responsive;
+ * nothing else may touch hs until it returns. */
+void hs_crypto(hsState* hs);
+/** Give up on a handshake that hasn't finished (erasing its keys).  Not while
+ * hs_crypto is running on it. */
+void hs_abort(hsState* hs);
+/** Run the handshake as client over the socket fd, waiting for it to
+ * finish (hs_start and hs_step in a poll loop).  On success, *rs is ready
+ * for record_protect/record_unprotect and peer (if not NULL, MAX_NAME+1
+ * bytes) holds the name on the peer's long-term key.  fd may be blocking or
+ * not; a peer that stalls can hold us for at most cfg->timeout_ms.
+ * @return 0 on success, -1 on failure (including timeout / cancellation). */
+int hs_client(int fd, const hsConfig* cfg, recordState* rs, char* peer);
+/** Server side of the above. */
+int hs_server(int fd, const hsConfig* cfg, recordState* rs, char* peer);
+/** Bitmask of groups for which cfg has both our and the peer's keys (see
+ * hs_load_keys). */
+unsigned char hs_groups(const hsConfig* cfg);
+/** Human readable name of a group. */
+const char* hs_group_name(int group);
+/** Set up cookie challenges for a server (hsConfig.cookies) that asks for
+ * them while more than rate ClientHellos a second arrive (0: always).
+ * @return 0 on success, -1 if there was no randomness for the secret. */
+int hs_cookies_init(hsCookies* c, int rate);
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,328 @@
+#include "history.h"
+#include <dirent.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Each segment is a file named after the number of its first message
+ * (16 hex digits + ".seg"), holding records
+ *   | length (4, little endian) | kind (1) | name length (1) | name | text |
+ * where length counts the whole record.  Only the newest segment is ever
+ * written.  Older ones are mapped and scanned the first time a message in
+ * them is asked for, so opening the history costs one directory listing
+ * and one scan of at most HIST_SEGSIZE bytes, however long it is. */
+#define HIST_HDRLEN 6
+#define HIST_MAXREC (HIST_SEGSIZE / 2)
+
+static void segPath(const history* h, uint64_t first, char* buf, size_t len)
+{
+	snprintf(buf,len,"%s/%016" PRIx64 ".seg",h->dir,first);
+}
+
+static histSegment* addSeg(history* h, uint64_t first)
+{
+	if (h->nsegs == h->segcap) {
+		size_t cap = h->segcap ? 2*h->segcap : 16;
+		histSegment* segs = realloc(h->segs,cap*sizeof(histSegment));
+		if (!segs) return NULL;
+		h->segs = segs;
+		h->segcap = cap;
+	}
+	histSegment* s = &h->segs[h->nsegs++];
+	memset(s,0,sizeof(*s));
+	s->first = first;
+	return s;
+}
+
+static int pushOff(histSegment* s, uint32_t off)
+{
+	if (s->count == s->offcap) {
+		size_t cap = s->offcap ? 2*s->offcap : 1024;
+		uint32_t* offs = realloc(s->offs,cap*sizeof(uint32_t));
+		if (!offs) return -1;
+		s->offs = offs;
+		s->offcap = cap;
+	}
+	s->offs[s->count++] = off;
+	return 0;
+}
+
+/* map the segment and find its records.  Whatever follows the last
+ * complete record (a torn append) is cut off if trunc is set. */
+static int scanSeg(histSegment* s, int fd, int trunc)
+{
+	struct stat st;
+	if (fstat(fd,&st) != 0) return -1;
+	size_t flen = (st.st_size < HIST_SEGSIZE) ? st.st_size : HIST_SEGSIZE;
+	s->map = mmap(NULL,HIST_SEGSIZE,PROT_READ,MAP_SHARED,fd,0);
+	if (s->map == MAP_FAILED) {
+		s->map = NULL;
+		return -1;
+	}
+	size_t off = 0;
+	while (off + HIST_HDRLEN <= flen) {
+		uint32_t len_le;
+		memcpy(&len_le,s->map + off,4);
+		size_t len = le32toh(len_le);
+		if (len < HIST_HDRLEN + (size_t)s->map[off+5] || len > flen - off)
+			break;
+		if (pushOff(s,off) != 0) return -1;
+		off += len;
+	}
+	s->len = off;
+	s->scanned = 1;
+	if (trunc && off != (size_t)st.st_size && ftruncate(fd,off) != 0)
+		return -1;
+	return 0;
+}
+
+static int syncDir(const history* h)
+{
+	int dfd = open(h->dir,O_RDONLY|O_DIRECTORY);
+	if (dfd < 0) return -1;
+	int rv = fsync(dfd);
+	close(dfd);
+	return rv;
+}
+
+static int cmpSeg(const void* a, const void* b)
+{
+	uint64_t x = ((const histSegment*)a)->first, y = ((const histSegment*)b)->first;
+	return (x > y) - (x < y);
+}
+
+/* the flusher: whenever there are unsynced appends, fdatasync them, then
+ * wait HIST_SYNC_MS so the next sync covers everything that came in
+ * meanwhile. */
+static void* flushLoop(void* arg)
+{
+	history* h = arg;
+	pthread_mutex_lock(&h->lock);
+	while (h->dirty || h->oldfd >= 0 || !h->stop) {
+		if (!h->dirty && h->oldfd < 0) {
+			pthread_cond_wait(&h->wake,&h->lock);
+			continue;
+		}
+		int fd = h->dirty ? dup(h->fd) : -1;
+		int old = h->oldfd;
+		h->dirty = 0;
+		h->oldfd = -1;
+		pthread_mutex_unlock(&h->lock);
+		if (old >= 0) {
+			fdatasync(old);
+			close(old);
+		}
+		if (fd >= 0) {
+			fdatasync(fd);
+			close(fd);
+		}
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME,&until);
+		until.tv_nsec += HIST_SYNC_MS * 1000000L;
+		until.tv_sec += until.tv_nsec / 1000000000L;
+		until.tv_nsec %= 1000000000L;
+		pthread_mutex_lock(&h->lock);
+		while (!h->stop && pthread_cond_timedwait(&h->wake,&h->lock,&until) == 0)
+			; /* appends wake us; keep waiting until the time is up */
+	}
+	pthread_mutex_unlock(&h->lock);
+	return NULL;
+}
+
+int hist_open(history* h, const char* dir)
+{
+	memset(h,0,sizeof(*h));
+	h->fd = h->oldfd = -1;
+	if (mkdir(dir,0700) != 0 && errno != EEXIST) return -1;
+	h->dir = strdup(dir);
+	DIR* d = opendir(dir);
+	if (!h->dir || !d) goto fail;
+	struct dirent* e;
+	while ((e = readdir(d))) {
+		uint64_t first;
+		int n = 0;
+		if (strlen(e->d_name) == 20 &&
+				sscanf(e->d_name,"%16" SCNx64 ".seg%n",&first,&n) == 1 && n == 20 &&
+				!addSeg(h,first)) {
+			closedir(d);
+			goto fail;
+		}
+	}
+	closedir(d);
+	if (h->nsegs == 0 && !addSeg(h,0)) goto fail;
+	qsort(h->segs,h->nsegs,sizeof(histSegment),cmpSeg);
+	char path[PATH_MAX];
+	histSegment* last = &h->segs[h->nsegs-1];
+	segPath(h,last->first,path,sizeof(path));
+	h->fd = open(path,O_RDWR|O_CREAT|O_APPEND,0600);
+	if (h->fd < 0 || scanSeg(last,h->fd,1) != 0) goto fail;
+	if (h->nsegs == 1 && last->len == 0)
+		syncDir(h);
+	pthread_mutex_init(&h->lock,NULL);
+	pthread_cond_init(&h->wake,NULL);
+	if (pthread_create(&h->flusher,NULL,flushLoop,h) != 0) {
+		pthread_mutex_destroy(&h->lock);
+		pthread_cond_destroy(&h->wake);
+		goto fail;
+	}
+	return 0;
+fail:
+	if (h->fd >= 0) close(h->fd);
+	for (size_t i = 0; i < h->nsegs; i++) {
+		if (h->segs[i].map) munmap(h->segs[i].map,HIST_SEGSIZE);
+		free(h->segs[i].offs);
+	}
+	free(h->segs);
+	free(h->dir);
+	memset(h,0,sizeof(*h));
+	return -1;
+}
+
+void hist_close(history* h)
+{
+	pthread_mutex_lock(&h->lock);
+	h->stop = 1;
+	pthread_cond_signal(&h->wake);
+	pthread_mutex_unlock(&h->lock);
+	pthread_join(h->flusher,NULL); /* after its last sync */
+	pthread_mutex_destroy(&h->lock);
+	pthread_cond_destroy(&h->wake);
+	close(h->fd);
+	for (size_t i = 0; i < h->nsegs; i++) {
+		if (h->segs[i].map) munmap(h->segs[i].map,HIST_SEGSIZE);
+		free(h->segs[i].offs);
+	}
+	free(h->segs);
+	free(h->dir);
+	memset(h,0,sizeof(*h));
+}
+
+/* start a new segment after the current one */
+static int roll(history* h)
+{
+	histSegment* cur = &h->segs[h->nsegs-1];
+	uint64_t first = cur->first + cur->count;
+	char path[PATH_MAX];
+	segPath(h,first,path,sizeof(path));
+	int fd = open(path,O_RDWR|O_CREAT|O_APPEND,0600);
+	if (fd < 0) return -1;
+	histSegment* s = addSeg(h,first);
+	if (!s || scanSeg(s,fd,1) != 0) {
+		if (s) h->nsegs--;
+		close(fd);
+		unlink(path);
+		return -1;
+	}
+	syncDir(h);
+	pthread_mutex_lock(&h->lock);
+	if (h->oldfd >= 0) { /* the flusher hasn't got to the last one yet */
+		fdatasync(h->oldfd);
+		close(h->oldfd);
+	}
+	h->oldfd = h->fd;
+	h->fd = fd;
+	pthread_cond_signal(&h->wake);
+	pthread_mutex_unlock(&h->lock);
+	return 0;
+}
+
+int hist_append(history* h, int kind, const char* name, size_t nlen,
+		const char* text, size_t len)
+{
+	size_t reclen = HIST_HDRLEN + nlen + len;
+	if (kind < 0 || kind > 255 || nlen > 255 || reclen > HIST_MAXREC) return -1;
+	if (h->segs[h->nsegs-1].len + reclen > HIST_SEGSIZE && roll(h) != 0)
+		return -1;
+	histSegment* s = &h->segs[h->nsegs-1];
+	unsigned char hdr[HIST_HDRLEN];
+	uint32_t len_le = htole32(reclen);
+	memcpy(hdr,&len_le,4);
+	hdr[4] = kind;
+	hdr[5] = nlen;
+	struct iovec iov[3] = {
+		{hdr,HIST_HDRLEN},
+		{(void*)name,nlen},
+		{(void*)text,len},
+	};
+	ssize_t n;
+	do {
+		n = writev(h->fd,iov,3);
+	} while (n < 0 && errno == EINTR);
+	if (n != (ssize_t)reclen || pushOff(s,s->len) != 0) {
+		if (n > 0 && ftruncate(h->fd,s->len) != 0)
+			perror("history: could not drop partial record");
+		return -1;
+	}
+	s->len += reclen;
+	pthread_mutex_lock(&h->lock);
+	if (!h->dirty) {
+		h->dirty = 1;
+		pthread_cond_signal(&h->wake);
+	}
+	pthread_mutex_unlock(&h->lock);
+	return 0;
+}
+
+uint64_t hist_count(history* h)
+{
+	const histSegment* last = &h->segs[h->nsegs-1];
+	return last->first + last->count;
+}
+
+int hist_get(history* h, uint64_t i, histMsg* m)
+{
+	/* last segment with first <= i */
+	size_t lo = 0, hi = h->nsegs;
+	while (hi - lo > 1) {
+		size_t mid = lo + (hi - lo)/2;
+		if (h->segs[mid].first <= i)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	histSegment* s = &h->segs[lo];
+	if (i < s->first) return -1;
+	if (!s->scanned) {
+		char path[PATH_MAX];
+		segPath(h,s->first,path,sizeof(path));
+		int fd = open(path,O_RDONLY);
+		if (fd < 0) return -1;
+		int rv = scanSeg(s,fd,0);
+		close(fd); /* the mapping stays */
+		if (rv != 0) return -1;
+	}
+	if (i - s->first >= s->count) return -1;
+	const unsigned char* r = s->map + s->offs[i - s->first];
+	uint32_t len_le;
+	memcpy(&len_le,r,4);
+	m->kind = r[4];
+	m->nlen = r[5];
+	m->name = (const char*)r + HIST_HDRLEN;
+	m->text = m->name + m->nlen;
+	m->len = le32toh(len_le) - HIST_HDRLEN - m->nlen;
+	return 0;
+}
+
+int hist_sync(history* h)
+{
+	pthread_mutex_lock(&h->lock);
+	int old = h->oldfd;
+	h->oldfd = -1;
+	h->dirty = 0;
+	pthread_mutex_unlock(&h->lock);
+	if (old >= 0) {
+		fdatasync(old);
+		close(old);
+	}
+	return fdatasync(h->fd);
+}
@@ -0,0 +1,66 @@
+/* Persistent message history: an append-only log per peer, split into
+ * segment files so that opening it only ever looks at the newest one. */
+#pragma once
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define HIST_SEGSIZE (4 << 20) /* start a new segment beyond this size */
+#define HIST_SYNC_MS 50        /* appends are made durable in batches, at
+                                  most this long after they were written */
+
+typedef struct {
+	uint64_t first;       /* number of the first message in it */
+	uint32_t count;       /* messages in it, once scanned */
+	uint32_t* offs;       /* offs[i] = offset of message first+i */
+	size_t offcap;
+	size_t len;           /* bytes of whole records */
+	unsigned char* map;   /* HIST_SEGSIZE bytes, mapped when first read */
+	int scanned;
+} histSegment;
+
+typedef struct {
+	char* dir;
+	histSegment* segs;    /* oldest first; the last one is being written */
+	size_t nsegs, segcap;
+	int fd;               /* the last segment, open for appending */
+	/* group commit: appends mark the log dirty, the flusher syncs it */
+	pthread_t flusher;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	int dirty, oldfd, stop;
+} history;
+
+typedef struct {
+	int kind;
+	const char* name;
+	size_t nlen;
+	const char* text;
+	size_t len;
+} histMsg;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/** Open (creating if need be) the history in directory dir.  Only the
+ * newest segment is read, and a partly written last record is dropped.
+ * @return 0 on success, -1 on error. */
+int hist_open(history* h, const char* dir);
+/** Make everything durable and close. */
+void hist_close(history* h);
+/** Append a message (kind and nlen at most 255).  It is written right
+ * away and fsync'd by a background thread within HIST_SYNC_MS, together
+ * with whatever else came in.
+ * @return 0 on success, -1 on error. */
+int hist_append(history* h, int kind, const char* name, size_t nlen,
+		const char* text, size_t len);
+/** Number of messages in the history. */
+uint64_t hist_count(history* h);
+/** Look up message i.  m's pointers stay valid until hist_close.
+ * @return 0 on success, -1 if i is out of range or unreadable. */
+int hist_get(history* h, uint64_t i, histMsg* m);
+/** Wait until everything appended so far is on disk. */
+int hist_sync(history* h);
+#ifdef __cplusplus
+}
+#endif
@@ -14,6 +14,7 @@ int initKey(dhKey* k)
 	mpz_init(k->SK);
 	/* NOTE: PK == SK == 0 at this point */
 	strncpy(k->name,"default",MAX_NAME);
+	k->group = DH_GROUP_FF;
 	return 0;
 }
 
@@ -32,6 +33,7 @@ int shredKey(dhKey* k)
 
 /* straightforward, lazy key format:
  * name:<name...>
+ * group:x25519      (only present for non finite field keys)
  * pk:<base 10 rep of A>
  * sk:<base 10 rep of a>
  * (where A = g^a)
@@ -58,6 +60,8 @@ int writeDH(char* fname, dhKey* k)
 		f = fdopen(fd,"wb");
 		if (!f) return -1;
 		fprintf(f, "name:%s\n", k->name);
+		if (k->group == DH_GROUP_X25519)
+			fprintf(f, "group:x25519\n");
 		gmp_fprintf(f, "pk:%Zd\n", k->PK);
 		gmp_fprintf(f, "sk:%Zd\n", k->SK);
 		fclose(f);
@@ -65,6 +69,8 @@ int writeDH(char* fname, dhKey* k)
 	f = fopen(fnamepub,"wb");
 	if (!f) return -1;
 	fprintf(f, "name:%s\n", k->name);
+	if (k->group == DH_GROUP_X25519)
+		fprintf(f, "group:x25519\n");
 	gmp_fprintf(f, "pk:%Zd\n", k->PK);
 	fprintf(f, "sk:0\n");
 	fclose(f);
@@ -87,6 +93,17 @@ int readDH(char* fname, dhKey* k)
 	strncpy(k->name,name,MAX_NAME);
 	k->name[MAX_NAME] = 0; /* make sure it's a c-string */
 	free(name);
+	/* optional group line; on a mismatch fscanf leaves the 'p' of "pk:"
+	 * unread, so older key files still parse as finite field keys. */
+	char group[16];
+	if (fscanf(f,"group:%15s\n",group) == 1) {
+		if (strcmp(group,"x25519") == 0) {
+			k->group = DH_GROUP_X25519;
+		} else {
+			rv = -2;
+			goto end;
+		}
+	}
 	if (gmp_fscanf(f,"pk:%Zd\n",k->PK) != 1) {
 		rv = -2;
 		goto end;
@@ -100,14 +117,23 @@ end:
 	return rv;
 }
 
+int hashPKbin(dhKey* k, unsigned char* hash)
+{
+	assert(k);
+	size_t nB;
+	unsigned char* buf = Z2BYTES(NULL,&nB,k->PK);
+	/* NOTE: buf is NULL (and nB 0) if PK == 0 */
+	SHA256(buf ? buf : (unsigned char*)"",nB,hash);
+	free(buf);
+	return 0;
+}
+
 char* hashPK(dhKey* k, char* hash)
 {
 	assert(k);
 	const size_t hlen = 32; /* byte len of binary hash */
 	unsigned char H[hlen]; /* buffer for binary hash */
-	size_t nB;
-	unsigned char* buf = Z2BYTES(NULL,&nB,k->PK);
-	SHA256(buf,nB,H);
+	hashPKbin(k,H);
 	char hc[17] = "0123456789abcdef";
 	if (!hash) hash = malloc(2*hlen);
 	for (size_t i = 0; i < 2*hlen; i++) {
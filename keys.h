@@ -4,8 +4,15 @@
 
 #define MAX_NAME 128
 
+/* groups a key can live in.  Finite field keys use the parameters in
+ * ./params; X25519 keys store the raw 32 byte strings (little endian) in
+ * the PK / SK integers so the rest of the code can treat them the same. */
+#define DH_GROUP_FF     0
+#define DH_GROUP_X25519 1
+
 typedef struct {
 	char name[MAX_NAME+1];
+	int group; /* one of the DH_GROUP_* values; initKey sets DH_GROUP_FF */
 	mpz_t PK;
 	mpz_t SK;
 	/* NOTE: in general would want to add pointers for g,p,q,
@@ -31,3 +38,6 @@ int shredKey(dhKey* k);
  * @return pointer to a buffer containing the hash.  This will either
  * be the input parameter hash, or a newly allocated buffer if hash==NULL. */
 char* hashPK(dhKey* k, char* hash);
+/** Same hash as hashPK, but the raw 32 bytes (for indexing).
+ * @param hash points to a caller-allocated buffer of at least 32 bytes. */
+int hashPKbin(dhKey* k, unsigned char* hash);
@@ -0,0 +1,100 @@
+/* Convert text key files (see keys.c) into a binary keystore, or look
+ * keys up in one by fingerprint. */
+#include "keys.h"
+#include "keystore.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <limits.h>
+
+static const char* usage =
+"Usage: %s [OPTIONS]... STORE [KEYFILE]...\n"
+"Append the public keys in each KEYFILE to the keystore STORE.\n\n"
+"   -m, --manifest FILE  Also import every key listed in FILE (as written\n"
+"                        by provision-keys).\n"
+"   -q, --query    HASH  Look up the key with fingerprint HASH instead.\n"
+"   -h, --help           show this message and exit.\n";
+
+static int import(keystore* ks, char* fname)
+{
+	dhKey k;
+	int rv = readDH(fname,&k);
+	if (rv == 0) rv = ks_append(ks,&k);
+	if (rv != 0) fprintf(stderr, "could not import %s\n", fname);
+	shredKey(&k);
+	return rv;
+}
+
+int main(int argc, char* argv[])
+{
+	static struct option long_opts[] = {
+		{"manifest", required_argument, 0, 'm'},
+		{"query",    required_argument, 0, 'q'},
+		{"help",     no_argument,       0, 'h'},
+		{0,0,0,0}
+	};
+	int c;
+	int opt_index = 0;
+	char* manifest = NULL;
+	char* query = NULL;
+	while ((c = getopt_long(argc, argv, "m:q:h", long_opts, &opt_index)) != -1) {
+		switch (c) {
+			case 'm':
+				manifest = optarg;
+				break;
+			case 'q':
+				query = optarg;
+				break;
+			case 'h':
+				printf(usage,argv[0]);
+				return 0;
+			default:
+				printf(usage,argv[0]);
+				return 1;
+		}
+	}
+	if (optind >= argc) {
+		printf(usage,argv[0]);
+		return 1;
+	}
+	keystore ks;
+	if (ks_open(&ks,argv[optind]) != 0) {
+		fprintf(stderr, "could not open keystore %s\n", argv[optind]);
+		return 1;
+	}
+	int failed = 0;
+	if (query) {
+		dhKey k;
+		if (strlen(query) != 2*KS_FPLEN || ks_lookup_hex(&ks,query,&k) != 0) {
+			fprintf(stderr, "no key with fingerprint %s\n", query);
+			failed = 1;
+		} else {
+			printf("%s %s\n", k.name, (k.group == DH_GROUP_X25519) ? "x25519" : "ff");
+			shredKey(&k);
+		}
+		ks_close(&ks);
+		return failed;
+	}
+	size_t before = ks.count;
+	for (int i = optind + 1; i < argc; i++)
+		failed |= import(&ks,argv[i]);
+	if (manifest) {
+		FILE* f = fopen(manifest,"rb");
+		if (!f) {
+			perror(manifest);
+			failed = 1;
+		} else {
+			/* lines are: name fingerprint group path */
+			char path[PATH_MAX];
+			while (fscanf(f,"%*s %*s %*s %1000s\n",path) == 1) {
+				strcat(path,".pub");
+				failed |= import(&ks,path);
+			}
+			fclose(f);
+		}
+	}
+	printf("%zu keys imported, %zu in %s\n", ks.count - before, ks.count, argv[optind]);
+	ks_close(&ks);
+	return failed;
+}
@@ -0,0 +1,190 @@
+#include "keystore.h"
+#include "util.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* File layout: a 16 byte header followed by fixed size records, so record
+ * i lives at KS_HDRLEN + i*KS_RECLEN and the file is only ever appended to.
+ *   header: | "DHKS" | version | KS_RECLEN | 0 |      (4 bytes each, l.e.)
+ *   record: | fingerprint (32) | group (4) | pklen (4) | name (136) |
+ *           | pk, little endian, zero padded (KS_MAXPK)               |
+ * A crash in the middle of an append leaves a partial record at the end,
+ * which ks_open truncates away. */
+#define KS_MAGIC    0x534b4844 /* "DHKS" */
+#define KS_VERSION  1
+#define KS_HDRLEN   16
+#define KS_NAMELEN  136        /* MAX_NAME+1, rounded up to a multiple of 8 */
+#define KS_OFF_GRP  KS_FPLEN
+#define KS_OFF_PKL  (KS_OFF_GRP + 4)
+#define KS_OFF_NAME (KS_OFF_PKL + 4)
+#define KS_OFF_PK   (KS_OFF_NAME + KS_NAMELEN)
+#define KS_RECLEN   (KS_OFF_PK + KS_MAXPK)
+
+static inline const unsigned char* record(keystore* ks, size_t i)
+{
+	return ks->map + KS_HDRLEN + i*KS_RECLEN;
+}
+
+/* fingerprints are SHA256 outputs, so any 8 bytes of them make a fine hash */
+static inline size_t slot(const unsigned char* fp, size_t indexlen)
+{
+	uint64_t h;
+	memcpy(&h,fp,sizeof(h));
+	return h & (indexlen - 1);
+}
+
+/* record i goes into the index, replacing an older record with the same
+ * fingerprint if there is one. */
+static void indexInsert(keystore* ks, size_t i)
+{
+	const unsigned char* fp = record(ks,i);
+	size_t j = slot(fp,ks->indexlen);
+	while (ks->index[j] && memcmp(record(ks,ks->index[j]-1),fp,KS_FPLEN) != 0)
+		j = (j + 1) & (ks->indexlen - 1);
+	ks->index[j] = i + 1;
+}
+
+static int indexBuild(keystore* ks, size_t want)
+{
+	size_t len = 64;
+	while (len < 2*want) len *= 2;
+	uint32_t* index = calloc(len,sizeof(uint32_t));
+	if (!index) return -1;
+	free(ks->index);
+	ks->index = index;
+	ks->indexlen = len;
+	for (size_t i = 0; i < ks->count; i++)
+		indexInsert(ks,i);
+	return 0;
+}
+
+static int remap(keystore* ks, size_t len)
+{
+	if (ks->map) munmap(ks->map,ks->maplen);
+	ks->map = mmap(NULL,len,PROT_READ,MAP_SHARED,ks->fd,0);
+	if (ks->map == MAP_FAILED) {
+		ks->map = NULL;
+		return -1;
+	}
+	ks->maplen = len;
+	return 0;
+}
+
+int ks_open(keystore* ks, const char* fname)
+{
+	assert(ks);
+	memset(ks,0,sizeof(*ks));
+	ks->fd = open(fname,O_RDWR|O_CREAT|O_APPEND,0644);
+	if (ks->fd < 0) return -1;
+	struct stat st;
+	if (fstat(ks->fd,&st) != 0) goto fail;
+	size_t len = st.st_size;
+	if (len == 0) { /* new store; write the header */
+		uint32_t hdr[4] = {htole32(KS_MAGIC),htole32(KS_VERSION),
+			htole32(KS_RECLEN),0};
+		xwrite(ks->fd,hdr,KS_HDRLEN);
+		len = KS_HDRLEN;
+	}
+	if (len < KS_HDRLEN || remap(ks,KS_HDRLEN) != 0) goto bad;
+	uint32_t hdr[4];
+	memcpy(hdr,ks->map,KS_HDRLEN);
+	if (le32toh(hdr[0]) != KS_MAGIC || le32toh(hdr[1]) != KS_VERSION ||
+			le32toh(hdr[2]) != KS_RECLEN)
+		goto bad;
+	ks->count = (len - KS_HDRLEN) / KS_RECLEN;
+	size_t used = KS_HDRLEN + ks->count*KS_RECLEN;
+	if (used != len && ftruncate(ks->fd,used) != 0) /* torn append */
+		goto fail;
+	if (remap(ks,used) != 0 || indexBuild(ks,ks->count) != 0)
+		goto fail;
+	return 0;
+bad:
+	ks_close(ks);
+	return -2;
+fail:
+	ks_close(ks);
+	return -1;
+}
+
+void ks_close(keystore* ks)
+{
+	assert(ks);
+	if (ks->map) munmap(ks->map,ks->maplen);
+	free(ks->index);
+	if (ks->fd >= 0) close(ks->fd);
+	memset(ks,0,sizeof(*ks));
+	ks->fd = -1;
+}
+
+int ks_lookup(keystore* ks, const unsigned char* fp, dhKey* k)
+{
+	assert(ks && fp && k);
+	size_t j = slot(fp,ks->indexlen);
+	for (; ks->index[j]; j = (j + 1) & (ks->indexlen - 1)) {
+		const unsigned char* r = record(ks,ks->index[j]-1);
+		if (memcmp(r,fp,KS_FPLEN) != 0) continue;
+		uint32_t group, pklen;
+		memcpy(&group,r+KS_OFF_GRP,4);
+		memcpy(&pklen,r+KS_OFF_PKL,4);
+		pklen = le32toh(pklen);
+		if (pklen > KS_MAXPK) return -1;
+		initKey(k);
+		k->group = le32toh(group);
+		memcpy(k->name,r+KS_OFF_NAME,MAX_NAME);
+		k->name[MAX_NAME] = 0;
+		BYTES2Z(k->PK,r+KS_OFF_PK,pklen);
+		return 0;
+	}
+	return -1;
+}
+
+int ks_lookup_hex(keystore* ks, const char* hex, dhKey* k)
+{
+	unsigned char fp[KS_FPLEN];
+	for (size_t i = 0; i < KS_FPLEN; i++) {
+		unsigned int b;
+		if (sscanf(hex+2*i,"%2x",&b) != 1) return -1;
+		fp[i] = b;
+	}
+	return ks_lookup(ks,fp,k);
+}
+
+int ks_append(keystore* ks, dhKey* k)
+{
+	assert(ks && k);
+	size_t pklen = (mpz_sizeinbase(k->PK,2) + 7) / 8;
+	if (pklen > KS_MAXPK) return -1;
+	unsigned char r[KS_RECLEN];
+	memset(r,0,KS_RECLEN);
+	hashPKbin(k,r);
+	uint32_t group = htole32(k->group);
+	uint32_t pklen_le = htole32(pklen);
+	memcpy(r+KS_OFF_GRP,&group,4);
+	memcpy(r+KS_OFF_PKL,&pklen_le,4);
+	memcpy(r+KS_OFF_NAME,k->name,strnlen(k->name,MAX_NAME));
+	Z2BYTES(r+KS_OFF_PK,NULL,k->PK);
+	if (2*(ks->count + 1) > ks->indexlen && indexBuild(ks,ks->count + 1) != 0)
+		return -1;
+	/* one write() with O_APPEND: readers see all of the record or none */
+	ssize_t n;
+	do {
+		n = write(ks->fd,r,KS_RECLEN);
+	} while (n < 0 && errno == EINTR);
+	if (n != KS_RECLEN) {
+		if (n > 0 && ftruncate(ks->fd,KS_HDRLEN + ks->count*KS_RECLEN) != 0)
+			perror("keystore: could not drop partial record");
+		return -1;
+	}
+	if (remap(ks,KS_HDRLEN + (ks->count + 1)*KS_RECLEN) != 0)
+		return -1;
+	indexInsert(ks,ks->count++);
+	return 0;
+}
@@ -0,0 +1,43 @@
+/* Binary store of long-term public keys, looked up by fingerprint */
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include "keys.h"
+
+#define KS_FPLEN 32   /* fingerprint length: SHA256 of the key (see hashPKbin) */
+#define KS_MAXPK 512  /* largest public key we can store, in bytes */
+
+typedef struct {
+	int fd;
+	unsigned char* map;  /* the whole file, mapped read only */
+	size_t maplen;
+	size_t count;        /* number of complete records */
+	uint32_t* index;     /* open addressing table of (record number + 1) */
+	size_t indexlen;     /* always a power of 2, at least 2*count */
+} keystore;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/** Open (creating if necessary) the keystore in fname and map it.
+ * The fingerprint index is built from the mapped records, so this costs
+ * one pass over 32 bytes per key but no parsing.
+ * @return 0 on success, -1 if the file can't be opened, -2 if it isn't a
+ * keystore. */
+int ks_open(keystore* ks, const char* fname);
+/** Unmap and close. */
+void ks_close(keystore* ks);
+/** Find the public key whose hashPKbin is fp.  On success *k is
+ * initialized with the name, group and PK (SK is 0).
+ * @return 0 if found, -1 if not. */
+int ks_lookup(keystore* ks, const unsigned char* fp, dhKey* k);
+/** Same as ks_lookup, but with the 64 character hex form from hashPK. */
+int ks_lookup_hex(keystore* ks, const char* hex, dhKey* k);
+/** Append the public part of k.  Appending a key whose fingerprint is
+ * already present supersedes the old record (e.g. to rename it).
+ * NOTE: lookups and appends on the same keystore need outside locking.
+ * @return 0 on success. */
+int ks_append(keystore* ks, dhKey* k);
+#ifdef __cplusplus
+}
+#endif
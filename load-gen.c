@@ -0,0 +1,392 @@
+/* load generator: opens many sessions to a chat-server over loopback (or
+ * anywhere), using the real handshake and record layer, then has each one
+ * send messages at a given rate and times the echoes.  With -b, each
+ * session also uploads as fast as it can on a bulk stream, to see what
+ * that does to the messages' latency.  Prints one tab separated "metric
+ * value" line per result. */
+#define _GNU_SOURCE /* ppoll */
+#include "dh.h"
+#include "mux.h"
+#include "session.h"
+#include "util.h"
+#include <endian.h>
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct {
+	pthread_t t;
+	int ok;               /* handshake succeeded */
+	int64_t hsNs;         /* connect + handshake */
+	int64_t* lat;         /* round trip of each echoed message, ns */
+	size_t nlat, latcap;
+	uint64_t sent;
+	uint64_t bulkBytes;
+} lgSession;
+
+/* how a session's messages go out: straight, or (-b) next to a bulk
+ * upload, through a mux or (-N) taking turns at the socket */
+typedef struct {
+	chatSession* cs;
+	lgSession* s;
+	chatMux mux;
+	int chat, bulk;       /* stream IDs */
+	pthread_mutex_t lock; /* -N: one sender at a time */
+	int64_t end;
+} lgSender;
+
+static hsConfig hscfg = {.isclient = 1, .groupPref = -1, .peers = NULL,
+	.timeout_ms = HS_TIMEOUT_MS, .cancelfd = -1};
+static struct sockaddr_in serverAddr;
+static size_t msgSize = 64;
+static double rate = 10;        /* messages/s per session; 0: one at a time */
+static double duration = 10;    /* seconds of messaging */
+static pthread_barrier_t started, connected;
+static const char* capfile;    /* capture the first session here */
+static int bulk;               /* upload on a bulk stream too */
+static int nomux;              /* ... without the scheduler */
+static lgSession* sessions;
+
+static int64_t nowNs()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC,&t);
+	return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static int pushLat(lgSession* s, int64_t ns)
+{
+	if (s->nlat == s->latcap) {
+		size_t cap = s->latcap ? 2*s->latcap : 1024;
+		int64_t* lat = realloc(s->lat,cap*sizeof(int64_t));
+		if (!lat) return -1;
+		s->lat = lat;
+		s->latcap = cap;
+	}
+	s->lat[s->nlat++] = ns;
+	return 0;
+}
+
+/* send one message stamped with t (when it was due) */
+static int sendStamped(lgSender* snd, unsigned char* msg, int64_t t)
+{
+	uint64_t t_le = htole64(t);
+	memcpy(msg,&t_le,8);
+	if (!bulk) return session_send(snd->cs,msg,msgSize);
+	if (!nomux) return mux_send(&snd->mux,snd->chat,msg,msgSize);
+	pthread_mutex_lock(&snd->lock);
+	int rv = session_send(snd->cs,msg,msgSize);
+	pthread_mutex_unlock(&snd->lock);
+	return rv;
+}
+
+/* -b: upload until the end of the exchange */
+static void* bulkFeed(void* arg)
+{
+	lgSender* snd = arg;
+	/* one record's worth, so that mux_send's copy comes from a bufpool
+	 * class rather than malloc */
+	static const unsigned char chunk[REC_MAXDATA];
+	unsigned char rec[REC_MAXLEN];
+	while (nowNs() < snd->end) {
+		if (!nomux) {
+			if (mux_send(&snd->mux,snd->bulk,chunk,sizeof(chunk)) != 0) break;
+			snd->s->bulkBytes += sizeof(chunk);
+			continue;
+		}
+		pthread_mutex_lock(&snd->lock);
+		ssize_t len = session_protect(snd->cs,1,REC_PRIO_BULK,chunk,sizeof(chunk),rec,sizeof(rec));
+		int ok = len > 0 && xwrite_deadline(snd->cs->fd,rec,len,0,-1) == 0;
+		pthread_mutex_unlock(&snd->lock);
+		if (!ok) break;
+		snd->s->bulkBytes += sizeof(chunk);
+	}
+	return NULL;
+}
+
+/* read one echo and note how long it took */
+static int readEcho(chatSession* cs, lgSession* s)
+{
+	unsigned char pt[REC_MAXDATA];
+	if (session_recv(cs,pt,sizeof(pt)) < 8)
+		return -1;
+	uint64_t t_le;
+	memcpy(&t_le,pt,8);
+	return pushLat(s,nowNs() - (int64_t)le64toh(t_le));
+}
+
+/* With a rate, messages go out on a fixed schedule whether or not echoes
+ * have come back, and latency is counted from when each was due (so a
+ * stalled server can't hide its stalls by slowing us down).  Without one,
+ * each message waits for the previous echo. */
+static void exchange(lgSender* snd, int64_t end)
+{
+	chatSession* cs = snd->cs;
+	lgSession* s = snd->s;
+	unsigned char msg[REC_MAXDATA];
+	memset(msg,'x',msgSize);
+	int64_t now = nowNs();
+	int64_t interval = rate > 0 ? (int64_t)(1e9 / rate) : 0;
+	int64_t next = now;
+	uint64_t inflight = 0;
+	while ((now = nowNs()) < end) {
+		if (interval ? now >= next : inflight == 0) {
+			if (sendStamped(snd,msg,interval ? next : now) != 0) return;
+			s->sent++;
+			inflight++;
+			next += interval;
+			continue;
+		}
+		int64_t until = (interval && next < end) ? next : end;
+		struct timespec ts = {(until - now) / 1000000000LL, (until - now) % 1000000000LL};
+		struct pollfd pfd = {cs->fd, POLLIN, 0};
+		int r = ppoll(&pfd,1,&ts,NULL);
+		if (r < 0 && errno != EINTR) return;
+		if (r > 0) {
+			if (readEcho(cs,s) != 0) return;
+			inflight--;
+		}
+	}
+}
+
+static void* runSession(void* arg)
+{
+	lgSession* s = arg;
+	pthread_barrier_wait(&started);
+	int64_t t0 = nowNs();
+	chatSession cs;
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd >= 0 && connect(fd,(struct sockaddr*)&serverAddr,sizeof(serverAddr)) == 0) {
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		s->ok = (session_handshake(&cs,fd,&hscfg,(s == sessions) ? capfile : NULL) == 0);
+	} else if (fd >= 0) {
+		close(fd);
+	}
+	s->hsNs = nowNs() - t0;
+	pthread_barrier_wait(&connected);
+	if (!s->ok) return NULL;
+	lgSender snd = {.cs = &cs, .s = s};
+	snd.end = nowNs() + (int64_t)(duration * 1e9);
+	pthread_t feeder;
+	int feeding = 0;
+	if (bulk) {
+		pthread_mutex_init(&snd.lock,NULL);
+		if (!nomux) {
+			if (mux_start(&snd.mux,&cs,MUX_TIMEOUT_MS,-1) != 0) {
+				session_close(&cs);
+				return NULL;
+			}
+			snd.chat = mux_open(&snd.mux,REC_PRIO_CHAT,1);
+			snd.bulk = mux_open(&snd.mux,REC_PRIO_BULK,1);
+		}
+		feeding = (pthread_create(&feeder,NULL,bulkFeed,&snd) == 0);
+	}
+	exchange(&snd,snd.end);
+	if (feeding) pthread_join(feeder,NULL);
+	if (bulk && !nomux) mux_stop(&snd.mux);
+	session_close(&cs);
+	return NULL;
+}
+
+static int cmpI64(const void* a, const void* b)
+{
+	int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+	return (x > y) - (x < y);
+}
+
+/* p50 .. max of v (sorted in place), in microseconds */
+static void percentiles(const char* what, int64_t* v, size_t n)
+{
+	static const double ps[] = {50, 90, 99, 99.9};
+	if (!n) return;
+	qsort(v,n,sizeof(int64_t),cmpI64);
+	for (size_t i = 0; i < sizeof(ps)/sizeof(ps[0]); i++) {
+		size_t k = (size_t)(ps[i] / 100 * (n - 1) + 0.5);
+		printf("%s_us_p%g\t%.1f\n", what, ps[i], v[k] / 1e3);
+	}
+	printf("%s_us_max\t%.1f\n", what, v[n-1] / 1e3);
+}
+
+static const char* usage =
+"Usage: %s [OPTIONS]...\n"
+"Drive many sessions against a chat-server and report handshakes/s,\n"
+"messages/s and round trip latency.\n\n"
+"   -c, --connect HOST  Server to connect to (defaults to localhost).\n"
+"   -p, --port    PORT  Port to connect on (defaults to 1337).\n"
+"   -n, --sessions N    Concurrent sessions (default 100).\n"
+"   -s, --size    BYTES Message size, 8 to %d (default 64).\n"
+"   -r, --rate    R     Messages/s per session (default 10); 0 sends each\n"
+"                       message as soon as the previous one is echoed.\n"
+"   -d, --duration SEC  How long to send messages for (default 10).\n"
+"   -g, --group   GROUP Only use key exchange GROUP (ff or x25519).\n"
+"   -T, --timeout MS    Give up on handshakes after MS (default %d).\n"
+"   -b, --bulk          Each session also uploads as fast as it can, on a\n"
+"                       bulk stream (chat-server doesn't echo those).\n"
+"   -N, --no-mux        With -b: don't schedule the two streams, just take\n"
+"                       turns at the socket (to see what the scheduler buys).\n"
+"   -C, --capture FILE  Record the first session's traffic to FILE (see\n"
+"                       replay; test keys only).\n"
+"   -h, --help          show this message and exit.\n";
+
+int main(int argc, char *argv[])
+{
+	if (init("params") != 0) {
+		fprintf(stderr, "could not read DH params from file 'params'\n");
+		return 1;
+	}
+	static struct option long_opts[] = {
+		{"connect",  required_argument, 0, 'c'},
+		{"port",     required_argument, 0, 'p'},
+		{"sessions", required_argument, 0, 'n'},
+		{"size",     required_argument, 0, 's'},
+		{"rate",     required_argument, 0, 'r'},
+		{"duration", required_argument, 0, 'd'},
+		{"group",    required_argument, 0, 'g'},
+		{"timeout",  required_argument, 0, 'T'},
+		{"bulk",     no_argument,       0, 'b'},
+		{"no-mux",   no_argument,       0, 'N'},
+		{"capture",  required_argument, 0, 'C'},
+		{"help",     no_argument,       0, 'h'},
+		{0,0,0,0}
+	};
+	int c;
+	const char* hostname = "localhost";
+	int port = 1337;
+	size_t nsessions = 100;
+	while ((c = getopt_long(argc, argv, "c:p:n:s:r:d:g:T:bNC:h", long_opts, NULL)) != -1) {
+		switch (c) {
+			case 'c':
+				hostname = optarg;
+				break;
+			case 'p':
+				port = atoi(optarg);
+				break;
+			case 'n':
+				nsessions = strtoul(optarg,NULL,10);
+				break;
+			case 's':
+				msgSize = strtoul(optarg,NULL,10);
+				break;
+			case 'r':
+				rate = atof(optarg);
+				break;
+			case 'd':
+				duration = atof(optarg);
+				break;
+			case 'g':
+				if (strcmp(optarg,"ff") == 0) {
+					hscfg.groupPref = DH_GROUP_FF;
+				} else if (strcmp(optarg,"x25519") == 0) {
+					hscfg.groupPref = DH_GROUP_X25519;
+				} else {
+					fprintf(stderr,usage,argv[0],REC_MAXDATA,HS_TIMEOUT_MS);
+					return 1;
+				}
+				break;
+			case 'T':
+				hscfg.timeout_ms = atoi(optarg);
+				break;
+			case 'b':
+				bulk = 1;
+				break;
+			case 'N':
+				nomux = 1;
+				break;
+			case 'C':
+				capfile = optarg;
+				break;
+			case 'h':
+				printf(usage,argv[0],REC_MAXDATA,HS_TIMEOUT_MS);
+				return 0;
+			default:
+				fprintf(stderr,usage,argv[0],REC_MAXDATA,HS_TIMEOUT_MS);
+				return 1;
+		}
+	}
+	if (nsessions == 0 || msgSize < 8 || msgSize > REC_MAXDATA || rate < 0) {
+		fprintf(stderr,usage,argv[0],REC_MAXDATA,HS_TIMEOUT_MS);
+		return 1;
+	}
+	if (hs_load_keys(&hscfg) != 0) {
+		fprintf(stderr, "no client and server long-term keys to use\n");
+		return 1;
+	}
+	struct hostent* server = gethostbyname(hostname);
+	if (!server) {
+		fprintf(stderr, "no such host: %s\n", hostname);
+		return 1;
+	}
+	memset(&serverAddr,0,sizeof(serverAddr));
+	serverAddr.sin_family = AF_INET;
+	memcpy(&serverAddr.sin_addr.s_addr,server->h_addr,server->h_length);
+	serverAddr.sin_port = htons(port);
+	signal(SIGPIPE,SIG_IGN);
+
+	lgSession* s = sessions = calloc(nsessions,sizeof(lgSession));
+	if (!s) return 1;
+	pthread_barrier_init(&started,NULL,nsessions+1);
+	pthread_barrier_init(&connected,NULL,nsessions+1);
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, 256 << 10);
+	for (size_t i = 0; i < nsessions; i++) {
+		if (pthread_create(&s[i].t,&attr,runSession,&s[i]) != 0) {
+			fprintf(stderr, "could only start %zu sessions\n", i);
+			return 1;
+		}
+	}
+	pthread_barrier_wait(&started);
+	int64_t t0 = nowNs();
+	pthread_barrier_wait(&connected);
+	int64_t t1 = nowNs();
+	for (size_t i = 0; i < nsessions; i++)
+		pthread_join(s[i].t,NULL);
+	int64_t t2 = nowNs();
+
+	size_t ok = 0, nlat = 0;
+	uint64_t sent = 0, bulkBytes = 0;
+	int64_t* hs = malloc(nsessions*sizeof(int64_t));
+	if (!hs) return 1;
+	for (size_t i = 0; i < nsessions; i++) {
+		if (s[i].ok) hs[ok++] = s[i].hsNs;
+		nlat += s[i].nlat;
+		sent += s[i].sent;
+		bulkBytes += s[i].bulkBytes;
+	}
+	int64_t* lat = malloc((nlat ? nlat : 1)*sizeof(int64_t));
+	if (!lat) return 1;
+	for (size_t i = 0, k = 0; i < nsessions; i++) {
+		memcpy(lat+k,s[i].lat,s[i].nlat*sizeof(int64_t));
+		k += s[i].nlat;
+	}
+
+	printf("# metric\tvalue\n");
+	printf("sessions\t%zu\n", nsessions);
+	printf("handshake_failures\t%zu\n", nsessions - ok);
+	printf("handshakes_per_s\t%.1f\n", ok / ((t1 - t0) / 1e9));
+	percentiles("handshake",hs,ok);
+	printf("message_bytes\t%zu\n", msgSize);
+	printf("messages_sent\t%" PRIu64 "\n", sent);
+	printf("messages_echoed\t%zu\n", nlat);
+	printf("messages_per_s\t%.1f\n", nlat / ((t2 - t1) / 1e9));
+	percentiles("latency",lat,nlat);
+	if (bulk)
+		printf("bulk_MB_per_s\t%.2f\n", bulkBytes / ((t2 - t1) / 1e3));
+	hs_free_keys(&hscfg);
+	return ok == nsessions ? 0 : 2;
+}
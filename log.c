@@ -0,0 +1,148 @@
+#include "log.h"
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef NDEBUG
+int log_level = LL_INFO;
+#else
+int log_level = LL_DEBUG;
+#endif
+
+/* A bounded multi-producer queue (after Vyukov): each slot's seq says
+ * whose turn it is.  With lap = pos & ~(LOG_SLOTS-1), slot pos is free
+ * for a producer when seq == lap, holds a message when seq == lap + 1,
+ * and is handed to the next lap (seq = lap + LOG_SLOTS) once written out.
+ * Everything starts at zero, so no setup is needed before the first
+ * message. */
+typedef struct {
+	atomic_uint_fast64_t seq;
+	int level;
+	struct timespec when;
+	size_t len;
+	char text[LOG_LINE];
+} logSlot;
+
+static logSlot slots[LOG_SLOTS];
+static alignas(64) atomic_uint_fast64_t head; /* next position to claim */
+static alignas(64) uint64_t tail;             /* next to write; under drainLock */
+static atomic_ulong dropped;
+static pthread_mutex_t drainLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t started = PTHREAD_ONCE_INIT;
+
+#define LAP(pos) ((pos) & ~(uint64_t)(LOG_SLOTS-1))
+
+static const char levelChar[] = "DIWE";
+
+static void out(const char* buf, size_t len)
+{
+	while (len) {
+		ssize_t n = write(STDERR_FILENO,buf,len);
+		if (n < 0) return; /* nowhere to complain */
+		buf += n;
+		len -= n;
+	}
+}
+
+/* "HH:MM:SS.mmm L text\n" for each message ready to go, written in
+ * batches.  Stops at the first slot still being filled in. */
+static void drain()
+{
+	char buf[16 << 10];
+	size_t len = 0;
+	static time_t lastSec = -1;
+	static char stamp[16];
+	pthread_mutex_lock(&drainLock);
+	unsigned long lost = atomic_exchange(&dropped,0);
+	if (lost)
+		len += snprintf(buf,sizeof(buf),"(%lu log messages dropped)\n",lost);
+	for (;;) {
+		logSlot* s = &slots[tail & (LOG_SLOTS-1)];
+		if (atomic_load_explicit(&s->seq,memory_order_acquire) != LAP(tail) + 1)
+			break;
+		if (len + LOG_LINE + 32 > sizeof(buf)) {
+			out(buf,len);
+			len = 0;
+		}
+		if (s->when.tv_sec != lastSec) {
+			struct tm tm;
+			localtime_r(&s->when.tv_sec,&tm);
+			strftime(stamp,sizeof(stamp),"%H:%M:%S",&tm);
+			lastSec = s->when.tv_sec;
+		}
+		len += snprintf(buf+len,sizeof(buf)-len,"%s.%03ld %c %.*s\n",stamp,
+				s->when.tv_nsec / 1000000,levelChar[s->level],(int)s->len,s->text);
+		atomic_store_explicit(&s->seq,LAP(tail) + LOG_SLOTS,memory_order_release);
+		tail++;
+	}
+	out(buf,len);
+	pthread_mutex_unlock(&drainLock);
+}
+
+static void* flushLoop(void*)
+{
+	struct timespec nap = {0, LOG_FLUSH_MS * 1000000L};
+	for (;;) {
+		drain();
+		nanosleep(&nap,NULL);
+	}
+	return NULL;
+}
+
+static void start()
+{
+	pthread_t t;
+	if (pthread_create(&t,NULL,flushLoop,NULL) == 0)
+		pthread_detach(t);
+	atexit(log_flush);
+}
+
+void log_msg(int level, const char* fmt, ...)
+{
+	if (level < log_level) return;
+	pthread_once(&started,start);
+	uint64_t pos = atomic_load_explicit(&head,memory_order_relaxed);
+	logSlot* s;
+	int waited = 0;
+	for (;;) {
+		s = &slots[pos & (LOG_SLOTS-1)];
+		uint64_t seq = atomic_load_explicit(&s->seq,memory_order_acquire);
+		int64_t diff = (int64_t)(seq - LAP(pos));
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&head,&pos,pos+1,
+						memory_order_relaxed,memory_order_relaxed))
+				break;
+		} else if (diff < 0) { /* a whole lap behind: full */
+			/* warnings and errors are rare enough to be worth making
+			 * room for ourselves; everything else is dropped */
+			if (level < LL_WARN || waited++) {
+				atomic_fetch_add_explicit(&dropped,1,memory_order_relaxed);
+				return;
+			}
+			drain();
+			pos = atomic_load_explicit(&head,memory_order_relaxed);
+		} else {
+			pos = atomic_load_explicit(&head,memory_order_relaxed);
+		}
+	}
+	clock_gettime(CLOCK_REALTIME,&s->when);
+	s->level = (level < LL_DEBUG) ? LL_DEBUG : (level > LL_ERROR) ? LL_ERROR : level;
+	va_list ap;
+	va_start(ap,fmt);
+	int n = vsnprintf(s->text,LOG_LINE,fmt,ap);
+	va_end(ap);
+	s->len = (n < 0) ? 0 : (n >= LOG_LINE) ? LOG_LINE-1 : (size_t)n;
+	atomic_store_explicit(&s->seq,LAP(pos) + 1,memory_order_release);
+}
+
+void log_flush()
+{
+	drain();
+}
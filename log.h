@@ -0,0 +1,40 @@
+/* Leveled logging that stays off the hot path: a message is formatted
+ * into a slot of a lock-free ring, and a background thread stamps and
+ * writes out whatever has piled up, in one write() per batch. */
+#pragma once
+
+#define LL_DEBUG 0
+#define LL_INFO  1
+#define LL_WARN  2
+#define LL_ERROR 3
+
+#define LOG_SLOTS    1024 /* messages that can wait for the flusher; a power of 2 */
+#define LOG_LINE     200  /* longer messages are cut short */
+#define LOG_FLUSH_MS 20   /* how often the flusher looks for new messages */
+
+/* Debug messages are compiled out of release (NDEBUG) builds; the
+ * arguments are still type checked, but never evaluated. */
+#ifdef NDEBUG
+#define LOGD(...) do { if (0) log_msg(LL_DEBUG, __VA_ARGS__); } while (0)
+#else
+#define LOGD(...) log_msg(LL_DEBUG, __VA_ARGS__)
+#endif
+#define LOGI(...) log_msg(LL_INFO, __VA_ARGS__)
+#define LOGW(...) log_msg(LL_WARN, __VA_ARGS__)
+#define LOGE(...) log_msg(LL_ERROR, __VA_ARGS__)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/** Messages below this level are dropped right away.  Defaults to
+ * LL_INFO (LL_DEBUG in debug builds). */
+extern int log_level;
+/** Queue a message (no newline needed).  If the ring is full, debug and
+ * info messages are dropped (the flusher says how many); warnings and
+ * errors write out the backlog themselves to make room. */
+void log_msg(int level, const char* fmt, ...) __attribute__((format(printf,2,3)));
+/** Write out everything queued so far.  Also runs at exit. */
+void log_flush();
+#ifdef __cplusplus
+}
+#endif
@@ -28,6 +28,25 @@ int main() {
     writeDH(clientKeyFileName, &clientKey);
     printf("Client long-term DH key saved to %s\n", clientKeyFileName);
 
+    shredKey(&serverKey); 
+    shredKey(&clientKey); 
+
+    // Same again for X25519 (used when both sides support it)
+    initKey(&serverKey);
+    initKey(&clientKey);
+    serverKey.group = DH_GROUP_X25519;
+    clientKey.group = DH_GROUP_X25519;
+
+    dhGenk(&serverKey);
+    serverKeyFileName = "server_long_term_key_x25519";
+    writeDH(serverKeyFileName, &serverKey);
+    printf("Server long-term X25519 key saved to %s\n", serverKeyFileName);
+
+    dhGenk(&clientKey);
+    clientKeyFileName = "client_long_term_key_x25519";
+    writeDH(clientKeyFileName, &clientKey);
+    printf("Client long-term X25519 key saved to %s\n", clientKeyFileName);
+
     shredKey(&serverKey); 
     shredKey(&clientKey); 
     return 0;
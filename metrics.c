@@ -0,0 +1,294 @@
+#include "metrics.h"
+#include "util.h"
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static const struct {
+	const char* name;
+	const char* help;
+} counterInfo[MC_COUNT] = {
+	[MC_RECORDS_SENT]       = {"chat_records_sent_total", "Records encrypted and sent."},
+	[MC_RECORDS_RECEIVED]   = {"chat_records_received_total", "Records received intact."},
+	[MC_BYTES_SENT]         = {"chat_sent_bytes_total", "Plaintext bytes sent."},
+	[MC_BYTES_RECEIVED]     = {"chat_received_bytes_total", "Plaintext bytes received."},
+	[MC_MALFORMED]          = {"chat_malformed_records_total", "Records rejected for bad framing."},
+	[MC_MAC_FAILURES]       = {"chat_mac_failures_total", "Records rejected for a bad MAC."},
+	[MC_REPLAYS]            = {"chat_replayed_records_total", "Records rejected as out of sequence."},
+	[MC_HANDSHAKES]         = {"chat_handshakes_total", "Handshakes completed."},
+	[MC_HANDSHAKE_FAILURES] = {"chat_handshake_failures_total", "Handshakes failed or timed out."},
+	[MC_COOKIES]            = {"chat_handshake_cookies_total", "Cookies asked of busy clients."},
+};
+
+static const struct {
+	const char* name;
+	const char* help;
+	double bounds[METRICS_BUCKETS]; /* seconds */
+} histInfo[MH_COUNT] = {
+	[MH_HANDSHAKE_SECONDS] = {"chat_handshake_seconds", "Time taken by handshakes.",
+		{.001, .0025, .005, .01, .025, .05, .1, .25, .5, 1, 2.5, 10}},
+};
+
+/* One per thread.  Only the owner writes it (relaxed load + store, i.e.
+ * a plain add); the scraper reads it with relaxed loads.  Buckets are
+ * not cumulative here; the count doubles as the +Inf bucket. */
+typedef struct mtShard {
+	atomic_uint_fast64_t c[MC_COUNT];
+	struct {
+		atomic_uint_fast64_t bucket[METRICS_BUCKETS];
+		atomic_uint_fast64_t count, sumNs;
+	} h[MH_COUNT];
+	struct mtShard* next;
+} mtShard;
+
+/* live shards, and what threads that have exited left behind.  The lock
+ * is only taken when a thread starts or stops counting, and by scrapes. */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static mtShard* live;
+static mtShard* spare;
+static mtShard retired;
+static pthread_key_t shardKey;
+static pthread_once_t keyOnce = PTHREAD_ONCE_INIT;
+static _Thread_local mtShard* mine;
+
+static struct {
+	const char* name;
+	const char* help;
+	double (*fn)(void*);
+	void* arg;
+} gauges[METRICS_MAXGAUGES];
+static size_t ngauges;
+
+static uint64_t bump(atomic_uint_fast64_t* x, uint64_t n)
+{
+	uint64_t v = atomic_load_explicit(x,memory_order_relaxed) + n;
+	atomic_store_explicit(x,v,memory_order_relaxed);
+	return v;
+}
+
+static uint64_t get(atomic_uint_fast64_t* x)
+{
+	return atomic_load_explicit(x,memory_order_relaxed);
+}
+
+/* add all of s into t, which must not be live */
+static void fold(mtShard* t, mtShard* s)
+{
+	for (int i = 0; i < MC_COUNT; i++)
+		bump(&t->c[i],get(&s->c[i]));
+	for (int i = 0; i < MH_COUNT; i++) {
+		for (int b = 0; b < METRICS_BUCKETS; b++)
+			bump(&t->h[i].bucket[b],get(&s->h[i].bucket[b]));
+		bump(&t->h[i].count,get(&s->h[i].count));
+		bump(&t->h[i].sumNs,get(&s->h[i].sumNs));
+	}
+}
+
+/* thread exit: keep its counts, recycle its shard */
+static void detach(void* arg)
+{
+	mtShard* s = arg;
+	pthread_mutex_lock(&lock);
+	fold(&retired,s);
+	mtShard** p = &live;
+	while (*p != s) p = &(*p)->next;
+	*p = s->next;
+	memset(s,0,sizeof(*s));
+	s->next = spare;
+	spare = s;
+	pthread_mutex_unlock(&lock);
+	mine = NULL;
+}
+
+static void makeKey()
+{
+	pthread_key_create(&shardKey,detach);
+}
+
+static mtShard* attach()
+{
+	pthread_once(&keyOnce,makeKey);
+	pthread_mutex_lock(&lock);
+	mtShard* s = spare;
+	if (s)
+		spare = s->next;
+	else
+		s = calloc(1,sizeof(mtShard));
+	if (s) {
+		s->next = live;
+		live = s;
+	}
+	pthread_mutex_unlock(&lock);
+	if (s) pthread_setspecific(shardKey,s);
+	return s;
+}
+
+void metrics_add(int c, uint64_t n)
+{
+	if (!mine && !(mine = attach())) return;
+	bump(&mine->c[c],n);
+}
+
+void metrics_observe_ns(int h, uint64_t ns)
+{
+	if (!mine && !(mine = attach())) return;
+	double secs = ns / 1e9;
+	int b = 0;
+	while (b < METRICS_BUCKETS && secs > histInfo[h].bounds[b]) b++;
+	if (b < METRICS_BUCKETS) bump(&mine->h[h].bucket[b],1);
+	bump(&mine->h[h].count,1);
+	bump(&mine->h[h].sumNs,ns);
+}
+
+int metrics_gauge(const char* name, const char* help, double (*fn)(void*), void* arg)
+{
+	pthread_mutex_lock(&lock);
+	int rv = -1;
+	if (ngauges < METRICS_MAXGAUGES) {
+		gauges[ngauges].name = name;
+		gauges[ngauges].help = help;
+		gauges[ngauges].fn = fn;
+		gauges[ngauges].arg = arg;
+		ngauges++;
+		rv = 0;
+	}
+	pthread_mutex_unlock(&lock);
+	return rv;
+}
+
+#define OUT(...) (n += snprintf(buf + (n < len ? n : len), n < len ? len - n : 0, __VA_ARGS__))
+
+size_t metrics_format(char* buf, size_t len)
+{
+	static mtShard sum; /* only touched under the lock */
+	size_t n = 0;
+	pthread_mutex_lock(&lock);
+	memset(&sum,0,sizeof(sum));
+	fold(&sum,&retired);
+	for (mtShard* s = live; s; s = s->next)
+		fold(&sum,s);
+	for (int i = 0; i < MC_COUNT; i++) {
+		OUT("# HELP %s %s\n# TYPE %s counter\n%s %lu\n", counterInfo[i].name,
+				counterInfo[i].help, counterInfo[i].name, counterInfo[i].name,
+				get(&sum.c[i]));
+	}
+	for (int i = 0; i < MH_COUNT; i++) {
+		const char* name = histInfo[i].name;
+		OUT("# HELP %s %s\n# TYPE %s histogram\n", name, histInfo[i].help, name);
+		uint64_t cum = 0;
+		for (int b = 0; b < METRICS_BUCKETS; b++) {
+			cum += get(&sum.h[i].bucket[b]);
+			OUT("%s_bucket{le=\"%g\"} %lu\n", name, histInfo[i].bounds[b], cum);
+		}
+		OUT("%s_bucket{le=\"+Inf\"} %lu\n%s_sum %.9g\n%s_count %lu\n",
+				name, get(&sum.h[i].count), name, get(&sum.h[i].sumNs) / 1e9,
+				name, get(&sum.h[i].count));
+	}
+	for (size_t i = 0; i < ngauges; i++) {
+		OUT("# HELP %s %s\n# TYPE %s gauge\n%s %.17g\n", gauges[i].name,
+				gauges[i].help, gauges[i].name, gauges[i].name,
+				gauges[i].fn(gauges[i].arg));
+	}
+	pthread_mutex_unlock(&lock);
+	return n;
+}
+
+static int listenfd = -1;
+static char sockPath[sizeof(((struct sockaddr_un*)0)->sun_path)];
+
+static void removeSocket()
+{
+	unlink(sockPath);
+}
+
+/* answer one scraper.  Whatever it sends within a moment is its request;
+ * a scraper that says nothing gets the plain text. */
+static void answer(int fd)
+{
+	char req[512];
+	ssize_t r = 0;
+	struct pollfd pfd = {fd, POLLIN, 0};
+	if (poll(&pfd,1,100) > 0)
+		r = recv(fd,req,sizeof(req)-1,0);
+	int http = (r >= 4 && memcmp(req,"GET ",4) == 0);
+	size_t cap = 16 << 10;
+	char* body = NULL;
+	size_t len;
+	for (;;) {
+		char* b = realloc(body,cap);
+		if (!b) {
+			free(body);
+			return;
+		}
+		body = b;
+		len = metrics_format(body,cap);
+		if (len < cap) break;
+		cap = len + 1024;
+	}
+	int64_t deadline = monotonic_ms() + 1000;
+	if (http) {
+		char hdr[128];
+		int hlen = snprintf(hdr,sizeof(hdr),"HTTP/1.0 200 OK\r\n"
+				"Content-Type: text/plain; version=0.0.4\r\n"
+				"Content-Length: %zu\r\n\r\n", len);
+		if (xwrite_deadline(fd,hdr,hlen,deadline,-1) != 0) {
+			free(body);
+			return;
+		}
+	}
+	xwrite_deadline(fd,body,len,deadline,-1);
+	free(body);
+}
+
+static void* serveLoop(void*)
+{
+	for (;;) {
+		int fd = accept(listenfd,NULL,NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			return NULL;
+		}
+		answer(fd);
+		close(fd);
+	}
+}
+
+int metrics_serve(const char* path)
+{
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	if (listenfd >= 0 || strlen(path) >= sizeof(addr.sun_path)) return -1;
+	strcpy(addr.sun_path,path);
+	/* a socket there is left over from an earlier run; anything else is
+	 * someone's file, and not ours to remove */
+	struct stat st;
+	if (lstat(path,&st) == 0) {
+		if (!S_ISSOCK(st.st_mode)) {
+			fprintf(stderr, "%s exists and is not a socket\n", path);
+			errno = EEXIST;
+			return -1;
+		}
+		unlink(path);
+	}
+	listenfd = socket(AF_UNIX,SOCK_STREAM|SOCK_CLOEXEC,0);
+	if (listenfd < 0) return -1;
+	pthread_t t;
+	if (bind(listenfd,(struct sockaddr*)&addr,sizeof(addr)) != 0 ||
+			listen(listenfd,16) != 0 ||
+			pthread_create(&t,NULL,serveLoop,NULL) != 0) {
+		close(listenfd);
+		listenfd = -1;
+		return -1;
+	}
+	pthread_detach(t);
+	strcpy(sockPath,path);
+	atexit(removeSocket);
+	return 0;
+}
@@ -0,0 +1,54 @@
+/* Process metrics.  Counters and histograms are kept per thread, so an
+ * update is a plain add to memory no other thread writes; a scrape sums
+ * them up.  metrics_serve answers scrapes in Prometheus text format on a
+ * Unix socket. */
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/* counters (names and help text are in metrics.c) */
+enum {
+	MC_RECORDS_SENT,
+	MC_RECORDS_RECEIVED,
+	MC_BYTES_SENT,
+	MC_BYTES_RECEIVED,
+	MC_MALFORMED,
+	MC_MAC_FAILURES,
+	MC_REPLAYS,
+	MC_HANDSHAKES,
+	MC_HANDSHAKE_FAILURES,
+	MC_COOKIES,
+	MC_COUNT
+};
+
+/* histograms */
+enum {
+	MH_HANDSHAKE_SECONDS,
+	MH_COUNT
+};
+
+#define METRICS_BUCKETS   12 /* finite bucket bounds per histogram */
+#define METRICS_MAXGAUGES 16
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/** Add n to counter c. */
+void metrics_add(int c, uint64_t n);
+/** Record an observation of ns nanoseconds in histogram h. */
+void metrics_observe_ns(int h, uint64_t ns);
+/** Report fn(arg) as gauge name on every scrape.  fn runs on the scraping
+ * thread.  @return 0 on success, -1 if there are too many gauges. */
+int metrics_gauge(const char* name, const char* help, double (*fn)(void*), void* arg);
+/** Write the current values in Prometheus text format to buf.
+ * @return the length of the whole text (which may be more than len). */
+size_t metrics_format(char* buf, size_t len);
+/** Serve metrics_format on a Unix socket at path, from a thread of its
+ * own.  Plain connections get the text; "GET ..." gets an HTTP response,
+ * so curl --unix-socket works too.  A socket already at path (from an
+ * earlier run) is replaced; anything else there is an error.
+ * @return 0 on success, -1 on error. */
+int metrics_serve(const char* path);
+#ifdef __cplusplus
+}
+#endif
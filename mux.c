@@ -0,0 +1,205 @@
+#include "mux.h"
+#include "bufpool.h"
+#include "log.h"
+#include "util.h"
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+
+struct muxMsg {
+	muxMsg* next;
+	size_t len, off;          /* off: how much of it has gone out */
+	unsigned char data[];
+};
+
+static int isBulk(const muxStream* st)
+{
+	return st->prio >= REC_PRIO_BULK;
+}
+
+/* the stream the next record should come from, or -1 if there is nothing
+ * to send.  Call with the lock held. */
+static int pick(chatMux* m)
+{
+	for (int prio = 0; prio < REC_PRIO_BULK; prio++) {
+		for (int i = 0; i < MUX_STREAMS; i++) {
+			muxStream* st = &m->streams[i];
+			if (st->open && st->prio == prio && st->first) return i;
+		}
+	}
+	/* bulk: a stream keeps its turn while it has data and credit; then
+	 * the next one gets its turn and a fresh quantum.  Twice round, so
+	 * that everyone gets a quantum before we give up. */
+	for (int n = 0; n < 2*MUX_STREAMS; n++) {
+		muxStream* st = &m->streams[m->turn];
+		if (st->open && isBulk(st) && st->first && st->credit > 0) return m->turn;
+		st->credit = 0;
+		m->turn = (m->turn + 1) % MUX_STREAMS;
+		m->streams[m->turn].credit = m->streams[m->turn].weight;
+	}
+	return -1;
+}
+
+/* the session failed: drop everything, and let mux_send callers go */
+static void fail(chatMux* m)
+{
+	m->failed = 1;
+	for (int i = 0; i < MUX_STREAMS; i++) {
+		muxStream* st = &m->streams[i];
+		while (st->first) {
+			muxMsg* msg = st->first;
+			st->first = msg->next;
+			bp_put(msg);
+		}
+		st->last = NULL;
+		st->queued = 0;
+	}
+	pthread_cond_broadcast(&m->room);
+}
+
+static void* sendLoop(void* arg)
+{
+	chatMux* m = arg;
+	pthread_mutex_lock(&m->lock);
+	for (;;) {
+		while (pick(m) < 0 && !m->stop)
+			pthread_cond_wait(&m->work,&m->lock);
+		if (pick(m) < 0) break;
+		/* wait until the kernel wants more, and only then choose: anything
+		 * more urgent that turns up meanwhile goes first */
+		pthread_mutex_unlock(&m->lock);
+		int64_t deadline = m->timeout_ms ? monotonic_ms() + m->timeout_ms : 0;
+		int err = poll_deadline(m->s->fd,POLLOUT,deadline,m->cancelfd);
+		pthread_mutex_lock(&m->lock);
+		if (err) {
+			LOGW("mux: sending failed: %s", strerror(-err));
+			fail(m);
+			break;
+		}
+		int id = pick(m);
+		muxStream* st = &m->streams[id];
+		muxMsg* msg = st->first;
+		size_t n = msg->len - msg->off;
+		if (n > REC_MAXDATA) n = REC_MAXDATA;
+		int prio = st->prio;
+		if (isBulk(st)) st->credit--;
+		/* only we take messages off, so msg stays put without the lock */
+		pthread_mutex_unlock(&m->lock);
+		ssize_t len = session_protect(m->s,id,prio,msg->data+msg->off,n,m->rec,sizeof(m->rec));
+		err = (len > 0) ? xwrite_deadline(m->s->fd,m->rec,len,deadline,m->cancelfd) : -EINVAL;
+		pthread_mutex_lock(&m->lock);
+		if (err) {
+			LOGW("mux: sending failed: %s", strerror(-err));
+			fail(m);
+			break;
+		}
+		msg->off += n;
+		st->queued -= n;
+		if (msg->off == msg->len) {
+			if (!(st->first = msg->next)) st->last = NULL;
+			bp_put(msg);
+			if (!st->first && st->closing) st->open = st->closing = 0;
+		}
+		pthread_cond_broadcast(&m->room);
+	}
+	pthread_mutex_unlock(&m->lock);
+	return NULL;
+}
+
+int mux_start(chatMux* m, chatSession* s, int timeout_ms, int cancelfd)
+{
+	memset(m->streams,0,sizeof(m->streams));
+	m->s = s;
+	m->timeout_ms = (timeout_ms > 0) ? timeout_ms : 0;
+	m->cancelfd = cancelfd;
+	m->turn = 0;
+	m->stop = m->failed = 0;
+	/* not a TCP socket (a capture's relay, say): the scheduling still
+	 * works, with whatever the socket buffer holds ahead of it */
+	int lowat = MUX_LOWAT;
+	setsockopt(s->fd,IPPROTO_TCP,TCP_NOTSENT_LOWAT,&lowat,sizeof(lowat));
+	pthread_mutex_init(&m->lock,NULL);
+	pthread_cond_init(&m->work,NULL);
+	pthread_cond_init(&m->room,NULL);
+	if (pthread_create(&m->sender,NULL,sendLoop,m) != 0) {
+		pthread_cond_destroy(&m->room);
+		pthread_cond_destroy(&m->work);
+		pthread_mutex_destroy(&m->lock);
+		return -1;
+	}
+	return 0;
+}
+
+int mux_open(chatMux* m, int prio, int weight)
+{
+	int id = -1;
+	pthread_mutex_lock(&m->lock);
+	for (int i = 0; i < MUX_STREAMS && id < 0; i++) {
+		muxStream* st = &m->streams[i];
+		if (st->open) continue;
+		st->open = 1;
+		st->prio = (prio < 0) ? 0 : (prio > REC_PRIO_BULK) ? REC_PRIO_BULK : prio;
+		st->weight = (weight < 1) ? 1 : weight;
+		st->credit = 0;
+		id = i;
+	}
+	pthread_mutex_unlock(&m->lock);
+	return id;
+}
+
+int mux_send(chatMux* m, int stream, const void* msg, size_t len)
+{
+	if (stream < 0 || stream >= MUX_STREAMS) return -1;
+	muxMsg* mm = bp_get(sizeof(muxMsg) + len);
+	if (!mm) return -1;
+	mm->next = NULL;
+	mm->len = len;
+	mm->off = 0;
+	memcpy(mm->data,msg,len);
+	pthread_mutex_lock(&m->lock);
+	muxStream* st = &m->streams[stream];
+	while (st->open && !st->closing && !m->failed &&
+			st->queued && st->queued + len > MUX_STREAMMAX)
+		pthread_cond_wait(&m->room,&m->lock);
+	if (!st->open || st->closing || m->failed || m->stop) {
+		pthread_mutex_unlock(&m->lock);
+		bp_put(mm);
+		return -1;
+	}
+	*(st->last ? &st->last->next : &st->first) = mm;
+	st->last = mm;
+	st->queued += len;
+	pthread_cond_signal(&m->work);
+	pthread_mutex_unlock(&m->lock);
+	return 0;
+}
+
+void mux_close(chatMux* m, int stream)
+{
+	if (stream < 0 || stream >= MUX_STREAMS) return;
+	pthread_mutex_lock(&m->lock);
+	muxStream* st = &m->streams[stream];
+	if (!st->first)
+		st->open = 0;
+	else if (st->open)
+		st->closing = 1;
+	pthread_cond_broadcast(&m->room);
+	pthread_mutex_unlock(&m->lock);
+}
+
+int mux_stop(chatMux* m)
+{
+	pthread_mutex_lock(&m->lock);
+	m->stop = 1;
+	pthread_cond_signal(&m->work);
+	pthread_mutex_unlock(&m->lock);
+	pthread_join(m->sender,NULL);
+	int rv = m->failed ? -1 : 0;
+	pthread_cond_destroy(&m->room);
+	pthread_cond_destroy(&m->work);
+	pthread_mutex_destroy(&m->lock);
+	return rv;
+}
@@ -0,0 +1,73 @@
+/* Logical streams over one session, with a weighted scheduler on the
+ * sending side.  Each stream has a priority (REC_PRIO_*), and bulk streams
+ * a weight.  mux_send only queues; a thread of the mux's own sends one
+ * record at a time, choosing each as late as it can: the kernel is only
+ * given more once little of what it has is still unsent (TCP_NOTSENT_LOWAT),
+ * so a chat message queued in the middle of a big transfer waits for at
+ * most the record being sent and MUX_LOWAT bytes ahead of it.
+ *
+ * Priorities are strict: control, then chat, then bulk.  Bulk streams
+ * share what is left in proportion to their weights (deficit round robin,
+ * a credit being one record).  A message longer than REC_MAXDATA goes out
+ * in REC_MAXDATA pieces, which the peer gets as separate messages
+ * (session_recv_stream tells it which stream each is on). */
+#pragma once
+#include "session.h"
+#include <pthread.h>
+
+#define MUX_STREAMS   16          /* stream IDs are 0 .. MUX_STREAMS-1 */
+#define MUX_STREAMMAX (256 << 10) /* bytes queued on a stream before mux_send waits */
+#define MUX_LOWAT     (16 << 10)  /* unsent bytes the kernel may hold */
+#define MUX_TIMEOUT_MS 10000      /* default time limit for sending one record */
+
+typedef struct muxMsg muxMsg;
+
+typedef struct {
+	int open, closing;
+	int prio, weight;
+	int credit;               /* bulk: records left in its current turn */
+	muxMsg *first, *last;
+	size_t queued;            /* bytes */
+} muxStream;
+
+typedef struct {
+	chatSession* s;
+	pthread_mutex_t lock;
+	pthread_cond_t work;      /* for the sender: something queued, or stop */
+	pthread_cond_t room;      /* for mux_send: a queue got shorter */
+	muxStream streams[MUX_STREAMS];
+	int turn;                 /* bulk: the stream whose turn it is */
+	int stop, failed;
+	int timeout_ms;           /* per record; 0 for none */
+	int cancelfd;             /* fails the session once readable; -1 for none */
+	pthread_t sender;
+	unsigned char rec[REC_MAXLEN]; /* the sender's */
+} chatMux;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/** Start sending s's records through m.  From now until mux_stop, only m
+ * may send on s (receiving is as before).  If a record takes longer than
+ * timeout_ms to go out (the peer has stopped reading), or cancelfd (if
+ * >= 0) becomes readable, the session fails: what is queued is dropped and
+ * mux_send and mux_stop return -1 rather than waiting on it.
+ * @param timeout_ms 0 to wait forever (say MUX_TIMEOUT_MS).
+ * @return 0 on success, -1 on error. */
+int mux_start(chatMux* m, chatSession* s, int timeout_ms, int cancelfd);
+/** Open a stream with priority prio (REC_PRIO_*) and, for bulk streams,
+ * weight (its share relative to the other bulk streams; at least 1).
+ * @return its ID, or -1 if they are all in use. */
+int mux_open(chatMux* m, int prio, int weight);
+/** Queue a copy of len bytes on stream.  Waits while the stream has more
+ * than MUX_STREAMMAX bytes queued.
+ * @return 0 on success, -1 if the stream isn't open or the session failed. */
+int mux_send(chatMux* m, int stream, const void* msg, size_t len);
+/** Close stream once what is queued on it has gone out. */
+void mux_close(chatMux* m, int stream);
+/** Send everything queued, then stop the sender (the session stays open).
+ * @return 0 if everything was sent, -1 if the session failed. */
+int mux_stop(chatMux* m);
+#ifdef __cplusplus
+}
+#endif
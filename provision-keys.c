@@ -0,0 +1,219 @@
+/* Bulk long-term key provisioning: generate many key pairs on a pool of
+ * threads, write them with writeDH and record each one's fingerprint
+ * (hashPK) in a manifest. */
+#include "dh.h"
+#include "keys.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char* usage =
+"Usage: %s [OPTIONS]...\n"
+"Generate long-term keys in bulk.\n\n"
+"   -n, --count   N     Number of key pairs to generate (default 100).\n"
+"   -o, --out     DIR   Directory for the key files (default keys).\n"
+"   -P, --prefix  NAME  Key names are NAME000000, NAME000001, ...\n"
+"                       (default user).\n"
+"   -g, --group   GROUP ff or x25519 (default ff).\n"
+"   -t, --threads N     Worker threads (default: one per cpu).\n"
+"   -b, --batch   N     Keys generated per batch before writing (default 64).\n"
+"   -h, --help          show this message and exit.\n";
+
+static size_t nKeys = 100;
+static size_t batchSize = 64;
+static int group = DH_GROUP_FF;
+static const char* outdir = "keys";
+static const char* prefix = "user";
+
+static atomic_size_t nextBatch;  /* index of next batch to claim */
+static atomic_size_t nDone;      /* keys written so far */
+static atomic_int failed;
+static pthread_mutex_t manifestLock = PTHREAD_MUTEX_INITIALIZER;
+static FILE* manifest;
+static double tEnd;              /* when the last worker finished */
+
+static double now()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC,&t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/* generate [first,first+n) into keys, then write them out and append
+ * their manifest lines in one go. */
+static int doBatch(size_t first, size_t n, dhKey* keys, char* lines, size_t linelen)
+{
+	char fname[PATH_MAX];
+	char fp[65]; fp[64] = 0;
+	size_t used = 0, live = 0, shredded = 0;
+	for (size_t i = 0; i < n; i++) {
+		initKey(&keys[i]);
+		live++;
+		keys[i].group = group;
+		if (dhGenk(&keys[i]) != 0) goto fail;
+		snprintf(keys[i].name,MAX_NAME+1,"%s%06zu",prefix,first+i);
+	}
+	for (size_t i = 0; i < n; i++) {
+		snprintf(fname,sizeof(fname),"%s/%s",outdir,keys[i].name);
+		if (writeDH(fname,&keys[i]) != 0) {
+			fprintf(stderr, "could not write %s\n", fname);
+			goto fail;
+		}
+		hashPK(&keys[i],fp);
+		used += snprintf(lines+used,linelen-used,"%s %s %s %s\n",keys[i].name,fp,
+				(group == DH_GROUP_X25519) ? "x25519" : "ff",fname);
+		shredKey(&keys[i]);
+		shredded++;
+	}
+	pthread_mutex_lock(&manifestLock);
+	fwrite(lines,1,used,manifest);
+	pthread_mutex_unlock(&manifestLock);
+	atomic_fetch_add(&nDone,n);
+	return 0;
+fail:
+	/* the keys not yet written out still hold their secrets */
+	for (size_t i = shredded; i < live; i++)
+		shredKey(&keys[i]);
+	return -1;
+}
+
+static void* worker(void*)
+{
+	dhKey* keys = malloc(batchSize * sizeof(dhKey));
+	/* name, 64 hex digits, group and path, plus separators */
+	size_t linelen = batchSize * (MAX_NAME + 64 + 8 + PATH_MAX + 4);
+	char* lines = malloc(linelen);
+	if (!keys || !lines) {
+		fprintf(stderr, "out of memory\n");
+		atomic_store(&failed,1);
+	}
+	size_t nBatches = (nKeys + batchSize - 1) / batchSize;
+	size_t b;
+	while (!atomic_load(&failed) && (b = atomic_fetch_add(&nextBatch,1)) < nBatches) {
+		size_t first = b * batchSize;
+		size_t n = (first + batchSize > nKeys) ? nKeys - first : batchSize;
+		if (doBatch(first,n,keys,lines,linelen) != 0)
+			atomic_store(&failed,1);
+	}
+	free(keys);
+	free(lines);
+	pthread_mutex_lock(&manifestLock);
+	tEnd = now();
+	pthread_mutex_unlock(&manifestLock);
+	return 0;
+}
+
+int main(int argc, char* argv[])
+{
+	static struct option long_opts[] = {
+		{"count",   required_argument, 0, 'n'},
+		{"out",     required_argument, 0, 'o'},
+		{"prefix",  required_argument, 0, 'P'},
+		{"group",   required_argument, 0, 'g'},
+		{"threads", required_argument, 0, 't'},
+		{"batch",   required_argument, 0, 'b'},
+		{"help",    no_argument,       0, 'h'},
+		{0,0,0,0}
+	};
+	int c;
+	int opt_index = 0;
+	size_t nthreads = 0;
+	while ((c = getopt_long(argc, argv, "n:o:P:g:t:b:h", long_opts, &opt_index)) != -1) {
+		switch (c) {
+			case 'n':
+				nKeys = strtoul(optarg,NULL,10);
+				break;
+			case 'o':
+				outdir = optarg;
+				break;
+			case 'P':
+				prefix = optarg;
+				break;
+			case 'g':
+				if (strcmp(optarg,"ff") == 0) {
+					group = DH_GROUP_FF;
+				} else if (strcmp(optarg,"x25519") == 0) {
+					group = DH_GROUP_X25519;
+				} else {
+					printf(usage,argv[0]);
+					return 1;
+				}
+				break;
+			case 't':
+				nthreads = strtoul(optarg,NULL,10);
+				break;
+			case 'b':
+				batchSize = strtoul(optarg,NULL,10);
+				break;
+			case 'h':
+				printf(usage,argv[0]);
+				return 0;
+			default:
+				printf(usage,argv[0]);
+				return 1;
+		}
+	}
+	if (batchSize == 0 || strlen(prefix) + 20 > MAX_NAME) {
+		printf(usage,argv[0]);
+		return 1;
+	}
+	if (nthreads == 0) {
+		long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		nthreads = (ncpu > 0) ? ncpu : 1;
+	}
+	if (group == DH_GROUP_FF && init("params") != 0) {
+		fprintf(stderr, "could not read DH params from file 'params'\n");
+		return 1;
+	}
+	if (mkdir(outdir,0700) != 0 && errno != EEXIST) {
+		perror(outdir);
+		return 1;
+	}
+	char mname[PATH_MAX];
+	snprintf(mname,sizeof(mname),"%s/MANIFEST",outdir);
+	manifest = fopen(mname,"ab");
+	if (!manifest) {
+		perror(mname);
+		return 1;
+	}
+
+	double t0 = now();
+	pthread_t* workers = malloc(nthreads * sizeof(pthread_t));
+	size_t started = 0;
+	for (; started < nthreads; started++) {
+		if (pthread_create(&workers[started],NULL,worker,NULL))
+			break;
+	}
+	if (started == 0) {
+		fprintf(stderr, "could not start any worker threads\n");
+		return 1;
+	}
+	/* progress report (about once a second) while the pool works: */
+	size_t done;
+	for (unsigned int tick = 1; (done = atomic_load(&nDone)) < nKeys &&
+			!atomic_load(&failed); tick++) {
+		usleep(100000);
+		if (tick % 10) continue;
+		fprintf(stderr, "\r%zu/%zu keys, %.1f keys/s", done, nKeys,
+				done / (now() - t0));
+	}
+	for (size_t i = 0; i < started; i++)
+		pthread_join(workers[i],NULL);
+	free(workers);
+	double dt = tEnd - t0;
+	fclose(manifest);
+	done = atomic_load(&nDone);
+	fprintf(stderr, "\r");
+	printf("%zu keys (%s) in %.3fs on %zu threads: %.1f keys/s; manifest in %s\n",
+			done, (group == DH_GROUP_X25519) ? "x25519" : "ff", dt, started,
+			done / dt, mname);
+	return atomic_load(&failed) ? 1 : 0;
+}
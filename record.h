@@ -0,0 +1,83 @@
+/* Record layer: AES-256-CTR + HMAC-SHA256 over framed records */
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+
+#define REC_KEYLEN  32   /* AES-256 key and HMAC key, each */
+#define REC_IVLEN   16
+#define REC_MACLEN  32
+#define REC_HDRLEN  13   /* length (2) + sequence number (8) + stream (2) + priority (1) */
+#define REC_MAXDATA 2048 /* largest plaintext per record */
+#define REC_MAXLEN  (REC_HDRLEN + REC_MAXDATA + REC_MACLEN)
+/* key material for one session: client->server cipher and mac keys, then
+ * server->client cipher and mac keys. */
+#define REC_KEYMAT  (4*REC_KEYLEN)
+
+/* Wire format of a record (integers little endian):
+ *  +------------+--------------+------------+--------------+------------------------+-----------+
+ *  | length (2) | sequence (8) | stream (2) | priority (1) | ciphertext (length-43) | HMAC (32) |
+ *  +------------+--------------+------------+--------------+------------------------+-----------+
+ * length counts everything after itself.  The HMAC covers the header and
+ * the ciphertext.  Sequence numbers start at 0 in each direction and must
+ * arrive in order.  A session carries any number of logical streams, whose
+ * records interleave (see mux.h); priority is the sender's REC_PRIO_* for
+ * the stream, so a peer that forwards or answers it can keep the order. */
+
+/* priorities, most urgent first */
+#define REC_PRIO_CONTROL 0 /* session control */
+#define REC_PRIO_CHAT    1 /* interactive messages (plain record_protect) */
+#define REC_PRIO_BULK    2 /* transfers, which get what is left */
+#define REC_NPRIO        3
+
+typedef struct {
+	EVP_CIPHER_CTX* ctx;
+	SHA256_CTX ipad, opad; /* the HMAC key, already hashed into its pads */
+	uint64_t seq;  /* sequence number of the next record */
+} recordDir;
+
+typedef struct {
+	recordDir out; /* records we send */
+	recordDir in;  /* records we receive */
+} recordState;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/** Set up both directions from REC_KEYMAT bytes of key material and the
+ * client's and server's IVs.  Returns 0 on success. */
+int record_init(recordState* rs, const unsigned char* keymat,
+		const unsigned char* civ, const unsigned char* siv, int isclient);
+/** Free cipher contexts and erase keys. */
+void record_cleanup(recordState* rs);
+/** Encrypt and MAC len bytes of pt into a framed record in rec, on
+ * stream 0 with REC_PRIO_CHAT.
+ * @return total record length, or -1 if the message is too large. */
+ssize_t record_protect(recordState* rs, const void* pt, size_t len,
+		unsigned char* rec, size_t recmax);
+/** record_protect on a given stream and priority. */
+ssize_t record_protect_stream(recordState* rs, int stream, int prio,
+		const void* pt, size_t len, unsigned char* rec, size_t recmax);
+/** Check and decrypt one framed record of reclen bytes (as read by
+ * record_read) into pt.
+ * @return plaintext length, or -1 if the record is malformed, fails the MAC
+ * check, or is out of sequence (replayed/dropped). */
+ssize_t record_unprotect(recordState* rs, const unsigned char* rec,
+		size_t reclen, void* pt, size_t ptmax);
+/** record_unprotect, also storing the record's stream and priority in
+ * *stream and *prio (either may be NULL). */
+ssize_t record_unprotect_stream(recordState* rs, const unsigned char* rec,
+		size_t reclen, void* pt, size_t ptmax, int* stream, int* prio);
+/** Length of the framed record at the start of buf, of which have bytes
+ * are in, for callers that do their own buffering.
+ * @return the record's total length (which may be more than have), 0 if
+ * have is too short to tell, or -1 if the length field is out of range. */
+ssize_t record_framelen(const unsigned char* buf, size_t have);
+/** Read exactly one framed record from fd into rec.
+ * @return record length, 0 on orderly EOF, -1 on error or bad framing. */
+ssize_t record_read(int fd, unsigned char* rec, size_t recmax);
+#ifdef __cplusplus
+}
+#endif
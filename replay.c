@@ -0,0 +1,194 @@
+/* replay a session capture (see capture.h): play our side of it for real,
+ * with the same keys and random seed, against the peer's recorded bytes,
+ * and report how long the handshake and the record layer took.  Prints
+ * tab separated "metric value" lines. */
+#include "capture.h"
+#include "dh.h"
+#include "keystore.h"
+#include "session.h"
+#include "util.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CHECKLEN 8192 /* how much of what we send is compared to the capture */
+
+static FILE* capf;
+static int peerfd;             /* the peer's end of the socketpair */
+static int realtime;           /* keep the captured pace */
+static int64_t maxLagNs;       /* realtime: furthest behind schedule */
+static unsigned char sentWant[CHECKLEN]; /* what we sent in the capture */
+static size_t sentWantLen;
+
+/* play the peer: write its chunks into the socketpair, on schedule if
+ * realtime, then hang up */
+static void* feed(void*)
+{
+	unsigned char* buf = malloc(CAP_MAXCHUNK);
+	capChunk ch;
+	int64_t start = monotonic_ns();
+	while (buf && cap_read_chunk(capf,&ch,buf) == 1) {
+		if (ch.dir != CAP_IN) continue;
+		if (realtime) {
+			int64_t wait = start + ch.t - monotonic_ns();
+			if (wait > 0) {
+				struct timespec ts = {wait / 1000000000, wait % 1000000000};
+				nanosleep(&ts,NULL);
+			}
+		}
+		if (xwrite_deadline(peerfd,buf,ch.len,0,-1) != 0) break;
+		int64_t lag = monotonic_ns() - (start + ch.t);
+		if (lag > maxLagNs) maxLagNs = lag;
+	}
+	free(buf);
+	shutdown(peerfd,SHUT_WR);
+	return NULL;
+}
+
+/* the start of what we sent in the capture, to check the replay against */
+static int readSent()
+{
+	unsigned char* buf = malloc(CAP_MAXCHUNK);
+	capChunk ch;
+	int r;
+	while (buf && (r = cap_read_chunk(capf,&ch,buf)) == 1 && sentWantLen < CHECKLEN) {
+		if (ch.dir != CAP_OUT) continue;
+		size_t n = (ch.len < CHECKLEN - sentWantLen) ? ch.len : CHECKLEN - sentWantLen;
+		memcpy(sentWant+sentWantLen,buf,n);
+		sentWantLen += n;
+	}
+	free(buf);
+	return (buf && r >= 0) ? 0 : -1;
+}
+
+static const char* usage =
+"Usage: %s [OPTIONS] CAPTURE\n"
+"Replay our side of a captured session (chat --capture) against the\n"
+"peer's recorded traffic.  Needs the long-term keys and params the\n"
+"capture was made with.\n\n"
+"   -t, --timing        Feed the peer's data at the captured pace (default:\n"
+"                       as fast as possible).\n"
+"   -k, --keystore FILE Server captures: look client keys up in FILE.\n"
+"   -h, --help          show this message and exit.\n";
+
+int main(int argc, char* argv[])
+{
+	static struct option long_opts[] = {
+		{"timing",   no_argument,       0, 't'},
+		{"keystore", required_argument, 0, 'k'},
+		{"help",     no_argument,       0, 'h'},
+		{0,0,0,0}
+	};
+	hsConfig cfg = {.timeout_ms = HS_TIMEOUT_MS, .cancelfd = -1};
+	keystore ks;
+	int c;
+	while ((c = getopt_long(argc, argv, "tk:h", long_opts, NULL)) != -1) {
+		switch (c) {
+			case 't':
+				realtime = 1;
+				break;
+			case 'k':
+				if (ks_open(&ks,optarg) != 0) {
+					fprintf(stderr, "could not open keystore %s\n", optarg);
+					return 1;
+				}
+				cfg.peers = &ks;
+				break;
+			case 'h':
+				printf(usage,argv[0]);
+				return 0;
+			default:
+				fprintf(stderr,usage,argv[0]);
+				return 1;
+		}
+	}
+	if (optind != argc - 1) {
+		fprintf(stderr,usage,argv[0]);
+		return 1;
+	}
+	if (init("params") != 0) {
+		fprintf(stderr, "could not read DH params from file 'params'\n");
+		return 1;
+	}
+	capHeader hdr;
+	long body;
+	if (!(capf = fopen(argv[optind],"rb")) || cap_read_header(capf,&hdr) != 0 ||
+			(body = ftell(capf)) < 0 || readSent() != 0 ||
+			fseek(capf,body,SEEK_SET) != 0) {
+		fprintf(stderr, "%s is not a readable capture\n", argv[optind]);
+		return 1;
+	}
+	cfg.isclient = hdr.isclient;
+	cfg.groupPref = hdr.groupPref;
+	if (realtime) cfg.timeout_ms = 0x7fffffff; /* the capture keeps time */
+	if (hs_load_keys(&cfg) != 0)
+		fprintf(stderr, "no long-term keys for the %s's side; the handshake will fail\n",
+				cfg.isclient ? "client" : "server");
+
+	int sv[2];
+	pthread_t feeder;
+	if (socketpair(AF_UNIX,SOCK_STREAM,0,sv) != 0) {
+		perror("socketpair");
+		return 1;
+	}
+	peerfd = sv[1];
+	int64_t t0 = monotonic_ns();
+	if (pthread_create(&feeder,NULL,feed,NULL) != 0) {
+		perror("pthread_create");
+		return 1;
+	}
+
+	/* our side, as in chat: handshake, then recvMsg's loop */
+	chatSession s;
+	rng_set_seed(hdr.seed);
+	int ok = (session_handshake(&s,sv[0],&cfg,NULL) == 0);
+	rng_clear_seed();
+	int64_t t1 = monotonic_ns();
+	uint64_t nrec = 0, nbad = 0, nbytes = 0;
+	if (ok) {
+		unsigned char pt[REC_MAXDATA];
+		ssize_t len;
+		while ((len = session_recv(&s,pt,sizeof(pt))) >= 0 || len == -EBADMSG) {
+			if (len < 0) {
+				nbad++;
+				continue;
+			}
+			nrec++;
+			nbytes += len;
+		}
+	}
+	int64_t t2 = monotonic_ns();
+	if (ok) session_close(&s); /* (which also stops the feeder, if we stopped early) */
+	pthread_join(feeder,NULL);
+	hs_free_keys(&cfg);
+
+	/* did we say what we said the first time? */
+	unsigned char sent[CHECKLEN];
+	size_t nsent = 0;
+	ssize_t r;
+	fcntl(peerfd,F_SETFL,O_NONBLOCK);
+	while (nsent < CHECKLEN && (r = read(peerfd,sent+nsent,CHECKLEN-nsent)) > 0)
+		nsent += r;
+	int same = nsent <= sentWantLen && memcmp(sent,sentWant,nsent) == 0;
+
+	printf("# metric\tvalue\n");
+	printf("handshake_ok\t%d\n", ok);
+	printf("handshake_matches_capture\t%d\n", same);
+	printf("handshake_us\t%.1f\n", (t1 - t0) / 1e3);
+	printf("records\t%lu\n", nrec);
+	printf("record_failures\t%lu\n", nbad);
+	printf("record_bytes\t%lu\n", nbytes);
+	printf("records_seconds\t%.6f\n", (t2 - t1) / 1e9);
+	if (t2 > t1) {
+		printf("records_per_s\t%.1f\n", nrec / ((t2 - t1) / 1e9));
+		printf("record_MB_per_s\t%.2f\n", nbytes / ((t2 - t1) / 1e3));
+	}
+	if (realtime)
+		printf("max_lag_ms\t%.3f\n", maxLagNs / 1e6);
+	return (ok && same && !nbad) ? 0 : 2;
+}
@@ -0,0 +1,125 @@
+#include "ring.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Messages are stored as | length (4) | bytes | padded to 4 bytes, so a
+ * length never straddles the end of the buffer.  A message that doesn't
+ * fit before the end goes at the start, and RING_WRAP in the length slot
+ * tells the consumer to skip ahead.  head and tail count bytes forever;
+ * & (size-1) gives the place in buf. */
+#define RING_WRAP UINT32_MAX
+#define ALIGN4(n) (((n) + 3) & ~(size_t)3)
+
+int ring_init(spscRing* r, size_t size)
+{
+	memset(r,0,sizeof(*r));
+	r->size = 64;
+	while (r->size < size) r->size *= 2;
+	r->buf = malloc(r->size);
+	if (!r->buf) return -1;
+	atomic_init(&r->head,0);
+	atomic_init(&r->tail,0);
+	atomic_init(&r->waiting,0);
+	pthread_mutex_init(&r->lock,NULL);
+	pthread_cond_init(&r->room,NULL);
+	return 0;
+}
+
+void ring_free(spscRing* r)
+{
+	pthread_cond_destroy(&r->room);
+	pthread_mutex_destroy(&r->lock);
+	free(r->buf);
+	r->buf = NULL;
+}
+
+void* ring_reserve(spscRing* r, size_t maxlen)
+{
+	size_t need = 4 + ALIGN4(maxlen);
+	if (need > r->size/2) return NULL;
+	size_t head = atomic_load_explicit(&r->head,memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&r->tail,memory_order_acquire);
+	size_t off = head & (r->size - 1);
+	size_t toEnd = r->size - off;
+	size_t skip = (toEnd < need) ? toEnd : 0;
+	if (head + skip + need - tail > r->size) return NULL;
+	if (skip) {
+		uint32_t wrap = RING_WRAP;
+		memcpy(r->buf + off,&wrap,4);
+		/* the consumer can't see the marker until head moves past it */
+		atomic_store_explicit(&r->head,head + skip,memory_order_release);
+		off = 0;
+	}
+	r->reserved = head + skip;
+	return r->buf + off + 4;
+}
+
+void* ring_reserve_wait(spscRing* r, size_t maxlen)
+{
+	if (4 + ALIGN4(maxlen) > r->size/2) return NULL;
+	void* p = ring_reserve(r,maxlen);
+	if (p) return p;
+	pthread_mutex_lock(&r->lock);
+	for (;;) {
+		/* announce ourselves, then look again: either we see what the
+		 * consumer released, or it sees waiting and signals, which it
+		 * can't do before cond_wait has let go of the lock */
+		atomic_store(&r->waiting,1);
+		atomic_thread_fence(memory_order_seq_cst);
+		if ((p = ring_reserve(r,maxlen))) break;
+		pthread_cond_wait(&r->room,&r->lock);
+	}
+	atomic_store(&r->waiting,0);
+	pthread_mutex_unlock(&r->lock);
+	return p;
+}
+
+void ring_commit(spscRing* r, size_t len)
+{
+	uint32_t len32 = len;
+	memcpy(r->buf + (r->reserved & (r->size - 1)),&len32,4);
+	atomic_store_explicit(&r->head,r->reserved + 4 + ALIGN4(len),
+			memory_order_release);
+}
+
+size_t ring_cursor(spscRing* r)
+{
+	return atomic_load_explicit(&r->tail,memory_order_relaxed);
+}
+
+const void* ring_next(spscRing* r, size_t* cursor, size_t* len)
+{
+	size_t head = atomic_load_explicit(&r->head,memory_order_acquire);
+	while (*cursor != head) {
+		size_t off = *cursor & (r->size - 1);
+		uint32_t n;
+		memcpy(&n,r->buf + off,4);
+		if (n == RING_WRAP) {
+			*cursor += r->size - off;
+			continue;
+		}
+		*len = n;
+		*cursor += 4 + ALIGN4(n);
+		return r->buf + off + 4;
+	}
+	return NULL;
+}
+
+void ring_release(spscRing* r, size_t cursor)
+{
+	atomic_store_explicit(&r->tail,cursor,memory_order_release);
+	/* pairs with the fence in ring_reserve_wait */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&r->waiting,memory_order_relaxed)) {
+		pthread_mutex_lock(&r->lock);
+		pthread_cond_signal(&r->room);
+		pthread_mutex_unlock(&r->lock);
+	}
+}
+
+size_t ring_used(spscRing* r)
+{
+	size_t tail = atomic_load_explicit(&r->tail,memory_order_relaxed);
+	return atomic_load_explicit(&r->head,memory_order_relaxed) - tail;
+}
@@ -0,0 +1,58 @@
+/* Lock-free single producer / single consumer ring of variable length
+ * messages, for handing data from one thread to another without locks or
+ * per-message allocation.  Only a producer that waits for room (see
+ * ring_reserve_wait) ever takes a lock. */
+#pragma once
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+typedef struct {
+	unsigned char* buf;
+	size_t size;                 /* bytes; a power of two */
+	alignas(64) atomic_size_t head; /* next write position; producer only */
+	alignas(64) atomic_size_t tail; /* oldest unreleased byte; consumer only */
+	size_t reserved;             /* producer: position of the open reservation */
+	atomic_int waiting;          /* the producer is (about to be) waiting for room */
+	pthread_mutex_t lock;        /* for waiting and room */
+	pthread_cond_t room;
+} spscRing;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/** Allocate a ring of size bytes (rounded up to a power of two).
+ * @return 0 on success, -1 if out of memory. */
+int ring_init(spscRing* r, size_t size);
+void ring_free(spscRing* r);
+
+/* producer side */
+/** Reserve room for a message of up to maxlen bytes.  Fill it in, then
+ * publish it with ring_commit.
+ * @return where to write, or NULL if the ring is full right now. */
+void* ring_reserve(spscRing* r, size_t maxlen);
+/** Like ring_reserve, but if the ring is full, wait until the consumer
+ * releases enough of it.
+ * @return where to write, or NULL if maxlen could never fit. */
+void* ring_reserve_wait(spscRing* r, size_t maxlen);
+/** Publish the reserved message, which turned out to be len bytes. */
+void ring_commit(spscRing* r, size_t len);
+
+/* consumer side */
+/** Where the consumer starts reading: pass this to ring_next, then to
+ * ring_release once done with everything read. */
+size_t ring_cursor(spscRing* r);
+/** Next message at *cursor; stores its length in *len and advances *cursor.
+ * The message stays valid until ring_release.
+ * @return the message, or NULL if there is nothing more. */
+const void* ring_next(spscRing* r, size_t* cursor, size_t* len);
+/** Give everything before cursor back to the producer (waking it if it
+ * is waiting for room). */
+void ring_release(spscRing* r, size_t cursor);
+
+/** Bytes currently queued (including padding); callable from any thread. */
+size_t ring_used(spscRing* r);
+#ifdef __cplusplus
+}
+#endif
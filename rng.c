@@ -0,0 +1,139 @@
+/* per-thread CSPRNG.  Each refill runs ChaCha20 under the current key over
+ * a block of zeros; the first 32 bytes of output become the next key and
+ * the rest is handed out (and wiped as it is handed out), so compromising
+ * the state later reveals nothing about bytes already returned.  Fresh
+ * kernel entropy is mixed into the key every RNG_RESEED bytes. */
+#include "rng.h"
+#include <openssl/evp.h>
+#include <sys/random.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <errno.h>
+
+#define RNG_KEYLEN RNG_SEEDLEN
+#define RNG_BUFLEN 480       /* bytes handed out per refill */
+#define RNG_RESEED (1 << 20) /* mix in kernel entropy after this many bytes */
+
+typedef struct {
+	EVP_CIPHER_CTX* ctx;
+	unsigned char key[RNG_KEYLEN];
+	unsigned char buf[RNG_BUFLEN];
+	size_t avail;        /* unused bytes, at the end of buf */
+	size_t sinceSeed;    /* bytes produced since the last reseed */
+	unsigned int forks;  /* value of forkCount when we last seeded */
+	int seeded;
+	int fixed;           /* rng_set_seed: never reseed */
+} rngState;
+
+static __thread rngState rng;
+static atomic_uint forkCount; /* bumped in the child after each fork */
+static pthread_key_t rngKey;  /* only used to clean up at thread exit */
+static pthread_once_t rngOnce = PTHREAD_ONCE_INIT;
+static const unsigned char zeros[RNG_KEYLEN + RNG_BUFLEN];
+
+static void rngAtFork()
+{
+	atomic_fetch_add(&forkCount,1);
+}
+
+static void rngFree(void* arg)
+{
+	rngState* s = arg;
+	EVP_CIPHER_CTX_free(s->ctx);
+	memset(s,0,sizeof(*s));
+}
+
+static void rngInit()
+{
+	pthread_key_create(&rngKey,rngFree);
+	pthread_atfork(NULL,NULL,rngAtFork);
+}
+
+/* xor RNG_KEYLEN bytes from the kernel into the key */
+static int reseed(rngState* s)
+{
+	unsigned char seed[RNG_KEYLEN];
+	size_t got = 0;
+	while (got < RNG_KEYLEN) {
+		ssize_t n = getrandom(seed+got,RNG_KEYLEN-got,0);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0) return -1;
+		got += n;
+	}
+	for (size_t i = 0; i < RNG_KEYLEN; i++)
+		s->key[i] ^= seed[i];
+	memset(seed,0,RNG_KEYLEN);
+	s->sinceSeed = 0;
+	s->avail = 0; /* don't hand out anything made under the old key */
+	s->forks = atomic_load(&forkCount);
+	return 0;
+}
+
+static int refill(rngState* s)
+{
+	unsigned char out[RNG_KEYLEN + RNG_BUFLEN];
+	unsigned char iv[16] = {0}; /* fine: every key is used exactly once */
+	int outlen;
+	if (EVP_EncryptInit_ex(s->ctx,EVP_chacha20(),NULL,s->key,iv) != 1 ||
+			EVP_EncryptUpdate(s->ctx,out,&outlen,zeros,sizeof(zeros)) != 1)
+		return -1;
+	memcpy(s->key,out,RNG_KEYLEN);
+	memcpy(s->buf,out+RNG_KEYLEN,RNG_BUFLEN);
+	memset(out,0,sizeof(out));
+	s->avail = RNG_BUFLEN;
+	s->sinceSeed += RNG_BUFLEN;
+	return 0;
+}
+
+/* this thread's generator, set up if need be */
+static rngState* state()
+{
+	rngState* s = &rng;
+	if (!s->ctx) {
+		pthread_once(&rngOnce,rngInit);
+		if (!(s->ctx = EVP_CIPHER_CTX_new())) return NULL;
+		pthread_setspecific(rngKey,s);
+	}
+	return s;
+}
+
+int rng_set_seed(const unsigned char* seed)
+{
+	rngState* s = state();
+	if (!s) return -1;
+	memcpy(s->key,seed,RNG_KEYLEN);
+	s->avail = 0;
+	s->seeded = s->fixed = 1;
+	return 0;
+}
+
+void rng_clear_seed()
+{
+	rngState* s = &rng;
+	s->fixed = s->seeded = 0; /* the next call reseeds (over the old key) */
+	s->avail = 0;
+}
+
+int rng_bytes(void* buf, size_t len)
+{
+	rngState* s = state();
+	if (!s) return -1;
+	if (!s->fixed && (!s->seeded || s->forks != atomic_load(&forkCount) ||
+			s->sinceSeed >= RNG_RESEED)) {
+		if (reseed(s)) return -1;
+		s->seeded = 1;
+	}
+	unsigned char* out = buf;
+	while (len) {
+		if (s->avail == 0 && refill(s)) return -1;
+		size_t n = (len < s->avail) ? len : s->avail;
+		unsigned char* src = s->buf + RNG_BUFLEN - s->avail;
+		memcpy(out,src,n);
+		memset(src,0,n);
+		s->avail -= n;
+		out += n;
+		len -= n;
+	}
+	return 0;
+}
@@ -0,0 +1,26 @@
+/* Random bytes for keys, nonces and parameter search */
+#pragma once
+#include <stddef.h>
+
+#define RNG_SEEDLEN 32
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/** Fill buf with len cryptographically secure random bytes.
+ * Each thread has its own generator (ChaCha20 with fast key erasure),
+ * seeded and periodically reseeded with getrandom(), so this does not
+ * open any files or take any locks; most calls don't enter the kernel.
+ * Safe across fork (the child reseeds).
+ * @return 0 on success, -1 if the kernel would not give us a seed. */
+int rng_bytes(void* buf, size_t len);
+/** FOR TESTS AND SESSION REPLAY ONLY: from now on this thread's generator
+ * produces the stream determined by the RNG_SEEDLEN byte seed, and is not
+ * reseeded, until rng_clear_seed.  Anyone who knows the seed knows every
+ * key made meanwhile.  @return 0 on success. */
+int rng_set_seed(const unsigned char* seed);
+/** Go back to seeding this thread's generator from the kernel. */
+void rng_clear_seed();
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,486 @@
+#define _GNU_SOURCE /* qsort_r */
+#include "search.h"
+#include <endian.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* The dictionary is a hash table (to find a word's postings while
+ * indexing) plus a sorted array of all terms (for prefix queries).  New
+ * terms go into a small unsorted tail that prefix queries scan linearly,
+ * and which is merged into the sorted array once it grows past 1/64th of
+ * it; that keeps both the scan and the amortized merge cost small. */
+#define SEARCH_TAIL 256
+
+/* Saved index (integers little endian, "v" meaning LEB128 varint):
+ *   header: | "DHSI" (4) | version (4) | messages (4) | terms (4) |
+ *   then for each term, in byte order:
+ *           | length (1) | term | v: count | v: first id | v: id deltas... | */
+#define SEARCH_MAGIC   0x49534844 /* "DHSI" */
+#define SEARCH_VERSION 1
+
+static inline const char* termStr(const searchIndex* idx, uint32_t t)
+{
+	return idx->pool + idx->terms[t].off;
+}
+
+/* order terms by bytes; a prefix comes before the longer words */
+static int termCmp(const searchIndex* idx, uint32_t t, const char* s, size_t len)
+{
+	size_t tlen = idx->terms[t].len;
+	int c = memcmp(termStr(idx,t),s,(tlen < len) ? tlen : len);
+	if (c) return c;
+	return (tlen > len) - (tlen < len);
+}
+
+static int sortCmp(const void* a, const void* b, void* arg)
+{
+	const searchIndex* idx = arg;
+	uint32_t tb = *(const uint32_t*)b;
+	return termCmp(idx,*(const uint32_t*)a,termStr(idx,tb),idx->terms[tb].len);
+}
+
+static uint64_t fnv1a(const char* s, size_t len)
+{
+	uint64_t h = 0xcbf29ce484222325;
+	for (size_t i = 0; i < len; i++)
+		h = (h ^ (unsigned char)s[i]) * 0x100000001b3;
+	return h;
+}
+
+static long findTerm(const searchIndex* idx, const char* s, size_t len)
+{
+	if (!idx->hashlen) return -1;
+	size_t mask = idx->hashlen - 1;
+	for (size_t j = fnv1a(s,len) & mask; idx->hash[j]; j = (j + 1) & mask) {
+		uint32_t t = idx->hash[j] - 1;
+		if (idx->terms[t].len == len && memcmp(termStr(idx,t),s,len) == 0)
+			return t;
+	}
+	return -1;
+}
+
+static void hashInsert(searchIndex* idx, uint32_t t)
+{
+	size_t mask = idx->hashlen - 1;
+	size_t j = fnv1a(termStr(idx,t),idx->terms[t].len) & mask;
+	while (idx->hash[j])
+		j = (j + 1) & mask;
+	idx->hash[j] = t + 1;
+}
+
+static int hashGrow(searchIndex* idx)
+{
+	size_t len = idx->hashlen ? 2*idx->hashlen : 1024;
+	uint32_t* hash = calloc(len,sizeof(uint32_t));
+	if (!hash) return -1;
+	free(idx->hash);
+	idx->hash = hash;
+	idx->hashlen = len;
+	for (size_t t = 0; t < idx->nterms; t++)
+		hashInsert(idx,t);
+	return 0;
+}
+
+/* new term with no postings; doesn't touch the sorted array */
+static long addTerm(searchIndex* idx, const char* s, size_t len)
+{
+	if (idx->poollen + len > idx->poolcap) {
+		size_t cap = idx->poolcap ? 2*idx->poolcap : 4096;
+		char* pool = realloc(idx->pool,cap);
+		if (!pool) return -1;
+		idx->pool = pool;
+		idx->poolcap = cap;
+	}
+	if (idx->nterms == idx->termcap) {
+		size_t cap = idx->termcap ? 2*idx->termcap : 256;
+		searchTerm* terms = realloc(idx->terms,cap*sizeof(searchTerm));
+		if (!terms) return -1;
+		idx->terms = terms;
+		idx->termcap = cap;
+	}
+	if (2*(idx->nterms + 1) > idx->hashlen && hashGrow(idx) != 0)
+		return -1;
+	uint32_t t = idx->nterms++;
+	idx->terms[t] = (searchTerm){NULL, 0, 0, idx->poollen, len};
+	memcpy(idx->pool + idx->poollen,s,len);
+	idx->poollen += len;
+	hashInsert(idx,t);
+	return t;
+}
+
+/* sort the tail and merge it into the sorted array */
+static int mergeTail(searchIndex* idx)
+{
+	size_t ntail = idx->nterms - idx->nsorted;
+	if (!ntail) return 0;
+	uint32_t* merged = malloc(idx->nterms*sizeof(uint32_t));
+	if (!merged) return -1;
+	uint32_t* tail = merged + idx->nsorted; /* sort in place, then merge */
+	for (size_t i = 0; i < ntail; i++)
+		tail[i] = idx->nsorted + i;
+	qsort_r(tail,ntail,sizeof(uint32_t),sortCmp,idx);
+	/* merge from the front: the output never catches up with the part of
+	 * the tail not yet read, since that starts at nsorted + j */
+	size_t i = 0, j = 0, k = 0;
+	while (i < idx->nsorted) {
+		if (j < ntail && sortCmp(&tail[j],&idx->sorted[i],idx) < 0)
+			merged[k++] = tail[j++];
+		else
+			merged[k++] = idx->sorted[i++];
+	}
+	free(idx->sorted);
+	idx->sorted = merged;
+	idx->nsorted = idx->nterms;
+	return 0;
+}
+
+static int post(searchIndex* idx, uint32_t t, uint32_t id)
+{
+	searchTerm* term = &idx->terms[t];
+	if (term->n && term->ids[term->n-1] == id) return 0;
+	if (term->n == term->cap) {
+		uint32_t cap = term->cap ? 2*term->cap : 4;
+		uint32_t* ids = realloc(term->ids,cap*sizeof(uint32_t));
+		if (!ids) return -1;
+		term->ids = ids;
+		term->cap = cap;
+	}
+	term->ids[term->n++] = id;
+	return 0;
+}
+
+static inline int wordChar(unsigned char c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+		(c >= '0' && c <= '9') || c >= 0x80;
+}
+
+/* next word at or after *pos, folded into word[SEARCH_MAXTERM].  Returns
+ * its length, or 0 at the end of the text. */
+static size_t nextWord(const char* text, size_t len, size_t* pos, char* word)
+{
+	size_t i = *pos, n = 0;
+	while (i < len && !wordChar(text[i])) i++;
+	for (; i < len && wordChar(text[i]); i++) {
+		unsigned char c = text[i];
+		if (n < SEARCH_MAXTERM)
+			word[n++] = (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+	}
+	*pos = i;
+	return n;
+}
+
+void search_init(searchIndex* idx)
+{
+	memset(idx,0,sizeof(*idx));
+}
+
+void search_free(searchIndex* idx)
+{
+	for (size_t t = 0; t < idx->nterms; t++)
+		free(idx->terms[t].ids);
+	free(idx->terms);
+	free(idx->pool);
+	free(idx->hash);
+	free(idx->sorted);
+	memset(idx,0,sizeof(*idx));
+}
+
+int search_add(searchIndex* idx, const char* text, size_t len)
+{
+	char word[SEARCH_MAXTERM];
+	size_t pos = 0, wlen;
+	int rv = 0;
+	while (rv == 0 && (wlen = nextWord(text,len,&pos,word))) {
+		long t = findTerm(idx,word,wlen);
+		if (t < 0) t = addTerm(idx,word,wlen);
+		rv = (t < 0) ? -1 : post(idx,t,idx->nmsgs);
+	}
+	idx->nmsgs++; /* even if it failed, so later numbers stay right */
+	size_t tailmax = idx->nsorted / 64;
+	if (idx->nterms - idx->nsorted > (tailmax > SEARCH_TAIL ? tailmax : SEARCH_TAIL))
+		rv |= mergeTail(idx);
+	return rv;
+}
+
+/* all terms starting with s, into *out (malloc'd).  Returns how many. */
+static size_t prefixTerms(searchIndex* idx, const char* s, size_t len, uint32_t** out)
+{
+	/* first sorted term >= s */
+	size_t lo = 0, hi = idx->nsorted;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo)/2;
+		if (termCmp(idx,idx->sorted[mid],s,len) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	size_t end = lo;
+	while (end < idx->nsorted && idx->terms[idx->sorted[end]].len >= len &&
+			memcmp(termStr(idx,idx->sorted[end]),s,len) == 0)
+		end++;
+	size_t n = 0;
+	*out = malloc((end - lo + idx->nterms - idx->nsorted + 1)*sizeof(uint32_t));
+	if (!*out) return 0;
+	for (size_t i = lo; i < end; i++)
+		(*out)[n++] = idx->sorted[i];
+	for (size_t t = idx->nsorted; t < idx->nterms; t++) {
+		if (idx->terms[t].len >= len && memcmp(termStr(idx,t),s,len) == 0)
+			(*out)[n++] = t;
+	}
+	return n;
+}
+
+static int contains(const searchTerm* term, uint32_t id)
+{
+	size_t lo = 0, hi = term->n;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo)/2;
+		if (term->ids[mid] < id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo < term->n && term->ids[lo] == id;
+}
+
+/* The union of many posting lists, walked newest first: a max-heap of
+ * the lists keyed on the id each is currently at. */
+typedef struct {
+	uint32_t id, pos;
+	const searchTerm* term;
+} cursor;
+
+typedef struct {
+	cursor* h;
+	size_t n;
+	uint32_t last; /* last id returned, to skip duplicates */
+	int started;
+} unionWalk;
+
+static void siftDown(cursor* h, size_t n, size_t i)
+{
+	for (;;) {
+		size_t big = i, l = 2*i + 1, r = l + 1;
+		if (l < n && h[l].id > h[big].id) big = l;
+		if (r < n && h[r].id > h[big].id) big = r;
+		if (big == i) return;
+		cursor c = h[i]; h[i] = h[big]; h[big] = c;
+		i = big;
+	}
+}
+
+static int unionOpen(unionWalk* u, searchIndex* idx, const uint32_t* terms, size_t nterms)
+{
+	u->h = malloc((nterms + 1)*sizeof(cursor));
+	if (!u->h) return -1;
+	u->n = 0;
+	u->started = 0;
+	for (size_t i = 0; i < nterms; i++) {
+		const searchTerm* term = &idx->terms[terms[i]];
+		if (term->n)
+			u->h[u->n++] = (cursor){term->ids[term->n-1], term->n-1, term};
+	}
+	for (size_t i = u->n/2; i-- > 0;)
+		siftDown(u->h,u->n,i);
+	return 0;
+}
+
+/* next (older) id in the union; 0 when there are no more */
+static int unionNext(unionWalk* u, uint32_t* id)
+{
+	while (u->n) {
+		cursor* top = &u->h[0];
+		uint32_t got = top->id;
+		if (top->pos) {
+			top->pos--;
+			top->id = top->term->ids[top->pos];
+		} else {
+			*top = u->h[--u->n];
+		}
+		siftDown(u->h,u->n,0);
+		if (u->started && got == u->last) continue;
+		u->started = 1;
+		u->last = *id = got;
+		return 1;
+	}
+	return 0;
+}
+
+size_t search_query(searchIndex* idx, const char* query, uint32_t* hits, size_t max)
+{
+	char words[SEARCH_MAXWORDS][SEARCH_MAXTERM];
+	size_t wlen[SEARCH_MAXWORDS];
+	size_t nwords = 0, pos = 0, qlen = strlen(query);
+	while (nwords < SEARCH_MAXWORDS &&
+			(wlen[nwords] = nextWord(query,qlen,&pos,words[nwords])))
+		nwords++;
+	if (!nwords || !max) return 0;
+	/* every word but the last must match exactly */
+	size_t nexact = nwords - 1;
+	const searchTerm* exact[SEARCH_MAXWORDS];
+	const searchTerm* rarest = NULL;
+	for (size_t w = 0; w < nexact; w++) {
+		long t = findTerm(idx,words[w],wlen[w]);
+		if (t < 0) return 0;
+		exact[w] = &idx->terms[t];
+		if (!rarest || exact[w]->n < rarest->n)
+			rarest = exact[w];
+	}
+	uint32_t* pterms;
+	size_t npterms = prefixTerms(idx,words[nwords-1],wlen[nwords-1],&pterms);
+	size_t nprefix = 0; /* postings under the prefix */
+	for (size_t p = 0; p < npterms; p++)
+		nprefix += idx->terms[pterms[p]].n;
+	size_t nhits = 0;
+	uint32_t id;
+	if (rarest && (uint64_t)rarest->n * npterms < nprefix) {
+		/* few candidates: walk the rarest list and probe the rest */
+		for (size_t i = rarest->n; i-- > 0 && nhits < max;) {
+			id = rarest->ids[i];
+			size_t w;
+			for (w = 0; w < nexact; w++) {
+				if (exact[w] != rarest && !contains(exact[w],id)) break;
+			}
+			if (w < nexact) continue;
+			for (size_t p = 0; p < npterms; p++) {
+				if (contains(&idx->terms[pterms[p]],id)) {
+					hits[nhits++] = id;
+					break;
+				}
+			}
+		}
+	} else {
+		/* walk everything under the prefix and probe the exact words */
+		unionWalk u;
+		if (unionOpen(&u,idx,pterms,npterms) == 0) {
+			while (nhits < max && unionNext(&u,&id)) {
+				size_t w;
+				for (w = 0; w < nexact; w++) {
+					if (!contains(exact[w],id)) break;
+				}
+				if (w == nexact)
+					hits[nhits++] = id;
+			}
+			free(u.h);
+		}
+	}
+	free(pterms);
+	return nhits;
+}
+
+static void putVarint(FILE* f, uint32_t x)
+{
+	while (x >= 0x80) {
+		putc((x & 0x7f) | 0x80,f);
+		x >>= 7;
+	}
+	putc(x,f);
+}
+
+static int getVarint(const unsigned char** p, const unsigned char* end, uint32_t* x)
+{
+	*x = 0;
+	for (int shift = 0; shift < 35 && *p < end; shift += 7) {
+		unsigned char c = *(*p)++;
+		*x |= (uint32_t)(c & 0x7f) << shift;
+		if (!(c & 0x80)) return 0;
+	}
+	return -1;
+}
+
+int search_save(searchIndex* idx, const char* fname)
+{
+	if (mergeTail(idx) != 0) return -1;
+	char tmpname[PATH_MAX+16];
+	snprintf(tmpname,sizeof(tmpname),"%s.tmp",fname);
+	FILE* f = fopen(tmpname,"wb");
+	if (!f) return -1;
+	uint32_t hdr[4] = {htole32(SEARCH_MAGIC),htole32(SEARCH_VERSION),
+		htole32(idx->nmsgs),htole32(idx->nterms)};
+	fwrite(hdr,sizeof(hdr),1,f);
+	for (size_t i = 0; i < idx->nsorted; i++) {
+		const searchTerm* term = &idx->terms[idx->sorted[i]];
+		putc(term->len,f);
+		fwrite(idx->pool + term->off,1,term->len,f);
+		putVarint(f,term->n);
+		for (uint32_t j = 0; j < term->n; j++)
+			putVarint(f,term->ids[j] - (j ? term->ids[j-1] : 0));
+	}
+	int bad = ferror(f);
+	bad |= fflush(f) != 0 || fsync(fileno(f)) != 0;
+	bad |= fclose(f) != 0;
+	if (bad || rename(tmpname,fname) != 0) {
+		unlink(tmpname);
+		return -1;
+	}
+	return 0;
+}
+
+int search_load(searchIndex* idx, const char* fname)
+{
+	FILE* f = fopen(fname,"rb");
+	if (!f) return -1;
+	unsigned char* buf = NULL;
+	size_t len = 0;
+	if (fseek(f,0,SEEK_END) == 0) {
+		long n = ftell(f);
+		rewind(f);
+		if (n > 0 && (buf = malloc(n)) && fread(buf,1,n,f) == (size_t)n)
+			len = n;
+	}
+	fclose(f);
+	if (!len) {
+		free(buf);
+		return -1;
+	}
+	searchIndex new;
+	search_init(&new);
+	const unsigned char* p = buf + 16;
+	const unsigned char* end = buf + len;
+	uint32_t hdr[4];
+	if (len < 16) goto bad;
+	memcpy(hdr,buf,16);
+	if (le32toh(hdr[0]) != SEARCH_MAGIC || le32toh(hdr[1]) != SEARCH_VERSION)
+		goto bad;
+	new.nmsgs = le32toh(hdr[2]);
+	uint32_t nterms = le32toh(hdr[3]);
+	for (uint32_t i = 0; i < nterms; i++) {
+		if (p >= end) goto bad;
+		size_t tlen = *p++;
+		if (tlen == 0 || tlen > SEARCH_MAXTERM || (size_t)(end - p) < tlen ||
+				findTerm(&new,(const char*)p,tlen) >= 0)
+			goto bad;
+		long t = addTerm(&new,(const char*)p,tlen);
+		if (t < 0) goto bad;
+		/* saved in order, so each must sort after the last */
+		if (t && termCmp(&new,t-1,(const char*)p,tlen) >= 0) goto bad;
+		p += tlen;
+		uint32_t n, id = 0, delta;
+		if (getVarint(&p,end,&n) != 0 || n > new.nmsgs) goto bad;
+		for (uint32_t j = 0; j < n; j++) {
+			if (getVarint(&p,end,&delta) != 0 || (j && !delta) ||
+					delta > UINT32_MAX - id)
+				goto bad;
+			id += delta;
+			if (id >= new.nmsgs || post(&new,t,id) != 0) goto bad;
+		}
+	}
+	if (p != end) goto bad;
+	new.sorted = malloc((new.nterms + 1)*sizeof(uint32_t));
+	if (!new.sorted) goto bad;
+	for (size_t t = 0; t < new.nterms; t++)
+		new.sorted[t] = t;
+	new.nsorted = new.nterms;
+	free(buf);
+	search_free(idx);
+	*idx = new;
+	return 0;
+bad:
+	free(buf);
+	search_free(&new);
+	return -2;
+}
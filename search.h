@@ -0,0 +1,53 @@
+/* Incremental inverted index over chat messages, for term and prefix
+ * search.  Messages are numbered in the order they are added. */
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#define SEARCH_MAXTERM  32 /* longer words are indexed by their first 32 bytes */
+#define SEARCH_MAXWORDS 8  /* words in a query beyond this are ignored */
+
+typedef struct {
+	uint32_t* ids;  /* messages containing the term, ascending */
+	uint32_t n, cap;
+	uint32_t off;   /* the term (not NUL terminated) is at pool + off */
+	uint8_t len;
+} searchTerm;
+
+typedef struct {
+	char* pool;           /* all the terms' bytes */
+	size_t poollen, poolcap;
+	searchTerm* terms;
+	size_t nterms, termcap;
+	uint32_t* hash;       /* term number + 1, open addressing */
+	size_t hashlen;
+	/* terms[sorted[0..nsorted)] are in byte order; terms added since the
+	 * last merge (number nsorted and up) are the unsorted tail. */
+	uint32_t* sorted;
+	size_t nsorted;
+	uint32_t nmsgs;       /* messages indexed so far */
+} searchIndex;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/** Initialize an empty index. */
+void search_init(searchIndex* idx);
+void search_free(searchIndex* idx);
+/** Index message number idx->nmsgs, which is len bytes of text.  Words are
+ * runs of letters, digits and non-ASCII bytes; ASCII is folded to lower
+ * case.  @return 0 on success, -1 if out of memory. */
+int search_add(searchIndex* idx, const char* text, size_t len);
+/** Find messages containing every word in query, where the last word may
+ * also be the start of a longer word.  Stores up to max message numbers in
+ * hits, newest first.
+ * @return the number of hits stored. */
+size_t search_query(searchIndex* idx, const char* query, uint32_t* hits, size_t max);
+/** Write the index to fname (atomically).  @return 0 on success. */
+int search_save(searchIndex* idx, const char* fname);
+/** Replace idx with the index saved in fname.
+ * @return 0 on success, -1 if it could not be read, -2 if it is corrupt. */
+int search_load(searchIndex* idx, const char* fname);
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,97 @@
+#include "session.h"
+#include "log.h"
+#include "rng.h"
+#include "util.h"
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+int session_handshake(chatSession* s, int fd, const hsConfig* cfg, const char* capfile)
+{
+	memset(s,0,sizeof(*s));
+	s->fd = fd;
+	if (capfile) {
+		int cfd = cap_start(&s->cap,fd,capfile,cfg->isclient,cfg->groupPref);
+		if (cfd < 0) {
+			LOGW("could not capture the session to %s", capfile);
+			close(fd);
+			return -1;
+		}
+		s->fd = cfd;
+		s->capturing = 1;
+	}
+	int rv = cfg->isclient ? hs_client(s->fd,cfg,&s->rs,s->peer)
+		: hs_server(s->fd,cfg,&s->rs,s->peer);
+	if (s->capturing) rng_clear_seed();
+	if (rv != 0) {
+		close(s->fd);
+		if (s->capturing) {
+			shutdown(s->cap.net,SHUT_RDWR); /* don't wait for the peer */
+			cap_finish(&s->cap);
+		}
+		memset(s,0,sizeof(*s));
+		return -1;
+	}
+	return 0;
+}
+
+int session_start(chatSession* s, hsState* hs, int fd, const hsConfig* cfg)
+{
+	memset(s,0,sizeof(*s));
+	s->fd = fd;
+	if (hs_start(hs,fd,cfg,&s->rs,s->peer) != 0) {
+		close(fd);
+		return -1;
+	}
+	return 0;
+}
+
+ssize_t session_protect(chatSession* s, int stream, int prio, const void* msg,
+		size_t len, unsigned char* rec, size_t recmax)
+{
+	return record_protect_stream(&s->rs,stream,prio,msg,len,rec,recmax);
+}
+
+ssize_t session_unprotect(chatSession* s, const unsigned char* rec,
+		size_t reclen, void* msg, size_t max, int* stream, int* prio)
+{
+	return record_unprotect_stream(&s->rs,rec,reclen,msg,max,stream,prio);
+}
+
+int session_send(chatSession* s, const void* msg, size_t len)
+{
+	unsigned char rec[REC_MAXLEN];
+	ssize_t n = record_protect(&s->rs,msg,len,rec,sizeof(rec));
+	return (n < 0 || xwrite_deadline(s->fd,rec,n,0,-1) != 0) ? -1 : 0;
+}
+
+ssize_t session_recv_stream(chatSession* s, void* msg, size_t max, int* stream, int* prio)
+{
+	unsigned char rec[REC_MAXLEN];
+	ssize_t n = record_read(s->fd,rec,sizeof(rec));
+	if (n == 0) return -EPIPE;
+	if (n < 0) return -EIO;
+	n = record_unprotect_stream(&s->rs,rec,n,msg,max,stream,prio);
+	return (n < 0) ? -EBADMSG : n;
+}
+
+ssize_t session_recv(chatSession* s, void* msg, size_t max)
+{
+	return session_recv_stream(s,msg,max,NULL,NULL);
+}
+
+void session_close(chatSession* s)
+{
+	record_cleanup(&s->rs);
+	shutdown(s->fd,SHUT_RDWR);
+	unsigned char dummy[64];
+	ssize_t r;
+	do {
+		r = recv(s->fd,dummy,sizeof(dummy),0);
+	} while (r != 0 && r != -1);
+	close(s->fd);
+	if (s->capturing) cap_finish(&s->cap);
+	memset(s,0,sizeof(*s));
+	s->fd = -1;
+}
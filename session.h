@@ -0,0 +1,60 @@
+/* A chat session: one connection's socket, record keys and peer, with the
+ * handshake, record layer and capture behind one small API.  There is no
+ * global state, so a process can hold any number of sessions, each driven
+ * by threads of its own.  Within a session, one thread may send while
+ * another receives (the two directions share nothing); more than one
+ * sender or receiver at a time needs a lock around the calls. */
+#pragma once
+#include "capture.h"
+#include "handshake.h"
+#include "record.h"
+
+typedef struct {
+	int fd;                 /* the connection (or the capture relay's end) */
+	recordState rs;
+	char peer[MAX_NAME+1];  /* name on the peer's long-term key */
+	capture cap;
+	int capturing;
+} chatSession;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/** Take over the connected socket fd and run the handshake on it, as
+ * client or server according to cfg.  If capfile is not NULL, the session
+ * is captured to it (see capture.h; test keys only).
+ * @return 0 on success; -1 on failure, in which case fd has been closed. */
+int session_handshake(chatSession* s, int fd, const hsConfig* cfg, const char* capfile);
+/** Non-blocking alternative to session_handshake (no capture): take over
+ * fd and start the handshake in hs, which the caller then drives with
+ * hs_step (see handshake.h).  Once that returns 0 the session is ready;
+ * if it fails, session_close the session.  Neither s nor hs may move
+ * meanwhile.  @return 0, or -1 (fd closed) if there are no keys to offer. */
+int session_start(chatSession* s, hsState* hs, int fd, const hsConfig* cfg);
+/** Encrypt and MAC a message on stream with priority prio into a record,
+ * for callers that do their own I/O.  See record_protect_stream. */
+ssize_t session_protect(chatSession* s, int stream, int prio, const void* msg,
+		size_t len, unsigned char* rec, size_t recmax);
+/** Check and decrypt a record, noting its stream and priority in *stream
+ * and *prio (either may be NULL).  See record_unprotect_stream. */
+ssize_t session_unprotect(chatSession* s, const unsigned char* rec,
+		size_t reclen, void* msg, size_t max, int* stream, int* prio);
+/** Send len (up to REC_MAXDATA) bytes as one message, on stream 0 (see
+ * mux.h for anything else).
+ * @return 0 on success, -1 on error. */
+int session_send(chatSession* s, const void* msg, size_t len);
+/** Wait for the next message and decrypt it into msg (max bytes).
+ * @return its length (which may be 0); -EPIPE once the peer has closed
+ * the connection; -EBADMSG if a record failed its checks (it is dropped);
+ * -EIO if the connection failed or the framing was bad. */
+ssize_t session_recv(chatSession* s, void* msg, size_t max);
+/** session_recv for sessions with more than one stream: also stores the
+ * message's stream and priority in *stream and *prio (either may be
+ * NULL). */
+ssize_t session_recv_stream(chatSession* s, void* msg, size_t max, int* stream, int* prio);
+/** Shut the connection down, wait for the peer to close its end, and
+ * free everything (erasing the keys). */
+void session_close(chatSession* s);
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,504 @@
+#include "transcript.h"
+#include "log.h"
+#include <endian.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/* Messages are numbered from the start of the attached history: [0,base)
+ * are read from it, the rest are records in the log.
+ *
+ * Log records, appended in order (integers little endian):
+ *   | length (4) | kind (1) | name length (1) | name | text |
+ * length counts the whole record, and text always ends in a newline.  The
+ * offset of every TS_STRIDE'th record is kept in memory, so finding any
+ * message costs at most TS_STRIDE-1 short reads. */
+#define TS_HDRLEN 6
+#define TS_STRIDE 64
+/* the buffer holds at most this many messages (the window plus one page
+ * being scrolled in) */
+#define TS_CAP (TS_WINDOW + TS_PAGE)
+
+typedef struct {
+	int kind;
+	const char* name;
+	size_t nlen;
+	const char* text;
+	size_t tlen;
+} tsMsg;
+
+static const char* tagName[TS_NKINDS] = {
+	[TS_STATUS] = "status",
+	[TS_SELF]   = "self",
+	[TS_FRIEND] = "friend",
+};
+
+static struct {
+	GtkTextView* view;
+	GtkTextBuffer* buf;
+	GtkAdjustment* vadj;
+	GtkTextMark* mark;      /* for scrolling to the end */
+	FILE* log;
+	uint64_t logend;        /* where the next record goes */
+	uint64_t* index;        /* index[i] = offset of record i*TS_STRIDE */
+	size_t indexcap;
+	unsigned char* rbuf;    /* holds the record last read by logNext */
+	size_t rbufcap;
+	size_t base;            /* messages from history, before the log's */
+	size_t total;           /* messages, history included */
+	size_t lo, hi;          /* the buffer holds messages [lo,hi) ... */
+	uint32_t chars[TS_CAP]; /* ... message lo+i being chars[(head+i)%TS_CAP]
+	                           characters long */
+	size_t head;
+	int pending;            /* pageIn is scheduled */
+	char* text;             /* a batch of messages, built for one insert */
+	size_t textcap;
+	searchIndex words;      /* words in every logged message's text */
+	searchIndex* hwords;    /* words in history messages [0,base) */
+	history* hist;          /* where messages are kept between sessions */
+} ts;
+
+/* characters [start,end) of a batch get the tag for kind */
+typedef struct {
+	gint start, end;
+	int kind;
+} tsSpan;
+
+static int logWrite(const tsMsg* m)
+{
+	size_t r = ts.total - ts.base; /* its record number */
+	if (r / TS_STRIDE >= ts.indexcap) {
+		size_t cap = ts.indexcap ? 2*ts.indexcap : 64;
+		uint64_t* index = realloc(ts.index,cap*sizeof(uint64_t));
+		if (!index) return -1;
+		ts.index = index;
+		ts.indexcap = cap;
+	}
+	int nl = (m->tlen == 0 || m->text[m->tlen-1] != '\n');
+	size_t reclen = TS_HDRLEN + m->nlen + m->tlen + nl;
+	unsigned char hdr[TS_HDRLEN];
+	uint32_t len_le = htole32(reclen);
+	memcpy(hdr,&len_le,4);
+	hdr[4] = m->kind;
+	hdr[5] = m->nlen;
+	struct iovec iov[4] = {
+		{hdr,TS_HDRLEN},
+		{(void*)m->name,m->nlen},
+		{(void*)m->text,m->tlen},
+		{"\n",nl},
+	};
+	ssize_t n;
+	do {
+		n = pwritev(fileno(ts.log),iov,4,ts.logend);
+	} while (n < 0 && errno == EINTR);
+	if (n != (ssize_t)reclen) return -1;
+	if (r % TS_STRIDE == 0)
+		ts.index[r / TS_STRIDE] = ts.logend;
+	ts.logend += reclen;
+	ts.total++;
+	return 0;
+}
+
+/* offset of record i */
+static uint64_t logSeek(size_t i)
+{
+	uint64_t off = ts.index[i / TS_STRIDE];
+	for (size_t j = i - i % TS_STRIDE; j < i; j++) {
+		uint32_t len_le;
+		if (pread(fileno(ts.log),&len_le,4,off) != 4) return ts.logend;
+		off += le32toh(len_le);
+	}
+	return off;
+}
+
+/* read the record at *off into m (valid until the next call), and move
+ * *off to the record after it. */
+static int logNext(uint64_t* off, tsMsg* m)
+{
+	unsigned char hdr[TS_HDRLEN];
+	int fd = fileno(ts.log);
+	if (pread(fd,hdr,TS_HDRLEN,*off) != TS_HDRLEN) return -1;
+	uint32_t len_le;
+	memcpy(&len_le,hdr,4);
+	size_t len = le32toh(len_le);
+	if (len < TS_HDRLEN + hdr[5] || hdr[4] >= TS_NKINDS)
+		return -1;
+	if (len > ts.rbufcap) {
+		unsigned char* rbuf = realloc(ts.rbuf,len);
+		if (!rbuf) return -1;
+		ts.rbuf = rbuf;
+		ts.rbufcap = len;
+	}
+	if (pread(fd,ts.rbuf,len - TS_HDRLEN,*off + TS_HDRLEN) != (ssize_t)(len - TS_HDRLEN))
+		return -1;
+	m->kind = hdr[4];
+	m->name = (char*)ts.rbuf;
+	m->nlen = hdr[5];
+	m->text = (char*)ts.rbuf + m->nlen;
+	m->tlen = len - TS_HDRLEN - m->nlen;
+	*off += len;
+	return 0;
+}
+
+/* read history message i into m.  The kind picks the text tag and the
+ * buffer only takes UTF-8, so a record that breaks either is corrupt. */
+static int histRead(size_t i, tsMsg* m)
+{
+	histMsg h;
+	if (hist_get(ts.hist,i,&h) != 0 || h.kind < 0 || h.kind >= TS_NKINDS ||
+			!g_utf8_validate(h.name,h.nlen,NULL) ||
+			!g_utf8_validate(h.text,h.len,NULL))
+		return -1;
+	*m = (tsMsg){h.kind, h.name, h.nlen, h.text, h.len};
+	return 0;
+}
+
+/* insert m at it, leaving it after the message.  Returns the number of
+ * characters inserted. */
+static gint insertMsg(GtkTextIter* it, const tsMsg* m)
+{
+	gint start = gtk_text_iter_get_offset(it);
+	GtkTextIter t0;
+	if (m->nlen) {
+		gtk_text_buffer_insert(ts.buf,it,m->name,m->nlen);
+		gtk_text_buffer_get_iter_at_offset(ts.buf,&t0,start);
+		gtk_text_buffer_apply_tag_by_name(ts.buf,tagName[m->kind],&t0,it);
+	}
+	gint tstart = gtk_text_iter_get_offset(it);
+	gtk_text_buffer_insert(ts.buf,it,m->text,m->tlen);
+	if (m->tlen == 0 || m->text[m->tlen-1] != '\n')
+		gtk_text_buffer_insert(ts.buf,it,"\n",1);
+	if (m->kind == TS_STATUS) {
+		gtk_text_buffer_get_iter_at_offset(ts.buf,&t0,tstart);
+		gtk_text_buffer_apply_tag_by_name(ts.buf,tagName[m->kind],&t0,it);
+	}
+	return gtk_text_iter_get_offset(it) - start;
+}
+
+static inline size_t windowLen()
+{
+	return ts.hi - ts.lo;
+}
+
+/* characters in the first (front) or last k messages of the window */
+static gint windowChars(size_t k, int front)
+{
+	gint sum = 0;
+	size_t first = front ? 0 : windowLen() - k;
+	for (size_t i = first; i < first + k; i++)
+		sum += ts.chars[(ts.head + i) % TS_CAP];
+	return sum;
+}
+
+static void trimFront(size_t k)
+{
+	GtkTextIter t0, t1;
+	gtk_text_buffer_get_start_iter(ts.buf,&t0);
+	gtk_text_buffer_get_iter_at_offset(ts.buf,&t1,windowChars(k,1));
+	gtk_text_buffer_delete(ts.buf,&t0,&t1);
+	ts.head = (ts.head + k) % TS_CAP;
+	ts.lo += k;
+}
+
+static void trimBack(size_t k)
+{
+	GtkTextIter t0, t1;
+	gint total = gtk_text_buffer_get_char_count(ts.buf);
+	gtk_text_buffer_get_iter_at_offset(ts.buf,&t0,total - windowChars(k,0));
+	gtk_text_buffer_get_end_iter(ts.buf,&t1);
+	gtk_text_buffer_delete(ts.buf,&t0,&t1);
+	ts.hi -= k;
+}
+
+/* read up to n messages starting at message `from` from history and the
+ * log and insert them at it, storing their lengths in chars.  Returns how
+ * many it got. */
+static size_t loadRange(size_t from, size_t n, GtkTextIter* it, uint32_t* chars)
+{
+	uint64_t off = (from + n > ts.base) ? logSeek((from > ts.base) ? from - ts.base : 0) : 0;
+	size_t i;
+	for (i = 0; i < n; i++) {
+		tsMsg m;
+		if (from + i < ts.base) {
+			/* keep the numbering: a placeholder for a bad one */
+			if (histRead(from + i,&m) != 0) {
+				LOGW("transcript: history message %zu is corrupt", from + i);
+				m = (tsMsg){TS_STATUS, "", 0, "(unreadable message)", 20};
+			}
+		} else if (logNext(&off,&m) != 0) {
+			LOGW("transcript: could not read message %zu from log", from + i);
+			break;
+		}
+		chars[i] = insertMsg(it,&m);
+	}
+	return i;
+}
+
+/* page older messages in above the window, dropping newer ones from the
+ * bottom so the window stays the same size. */
+static void loadOlder()
+{
+	size_t n = (ts.lo < TS_PAGE) ? ts.lo : TS_PAGE;
+	uint32_t chars[TS_PAGE];
+	GtkTextIter it;
+	gtk_text_buffer_get_start_iter(ts.buf,&it);
+	/* right gravity: stays on what is now the first line */
+	GtkTextMark* anchor = gtk_text_buffer_create_mark(ts.buf,NULL,&it,FALSE);
+	n = loadRange(ts.lo - n,n,&it,chars);
+	for (size_t i = n; i-- > 0;) {
+		ts.head = (ts.head + TS_CAP - 1) % TS_CAP;
+		ts.chars[ts.head] = chars[i];
+	}
+	ts.lo -= n;
+	if (windowLen() > TS_WINDOW)
+		trimBack(windowLen() - TS_WINDOW);
+	gtk_text_view_scroll_to_mark(ts.view,anchor,0.0,TRUE,0.0,0.0);
+	gtk_text_buffer_delete_mark(ts.buf,anchor);
+}
+
+/* the reverse of loadOlder */
+static void loadNewer()
+{
+	size_t n = (ts.total - ts.hi < TS_PAGE) ? ts.total - ts.hi : TS_PAGE;
+	uint32_t chars[TS_PAGE];
+	GtkTextIter it;
+	gtk_text_buffer_get_end_iter(ts.buf,&it);
+	/* left gravity: stays at the end of what is now the last line */
+	GtkTextMark* anchor = gtk_text_buffer_create_mark(ts.buf,NULL,&it,TRUE);
+	n = loadRange(ts.hi,n,&it,chars);
+	for (size_t i = 0; i < n; i++)
+		ts.chars[(ts.head + windowLen() + i) % TS_CAP] = chars[i];
+	ts.hi += n;
+	if (windowLen() > TS_WINDOW)
+		trimFront(windowLen() - TS_WINDOW);
+	gtk_text_view_scroll_to_mark(ts.view,anchor,0.0,TRUE,0.0,1.0);
+	gtk_text_buffer_delete_mark(ts.buf,anchor);
+}
+
+static int nearTop()
+{
+	return ts.lo > 0 &&
+		gtk_adjustment_get_value(ts.vadj) < gtk_adjustment_get_page_size(ts.vadj);
+}
+
+static int nearBottom()
+{
+	double page = gtk_adjustment_get_page_size(ts.vadj);
+	return ts.hi < ts.total &&
+		gtk_adjustment_get_value(ts.vadj) + 2*page > gtk_adjustment_get_upper(ts.vadj);
+}
+
+static gboolean pageIn(gpointer)
+{
+	ts.pending = 0;
+	if (nearTop())
+		loadOlder();
+	else if (nearBottom())
+		loadNewer();
+	return G_SOURCE_REMOVE;
+}
+
+/* don't touch the buffer from inside the scroll handler; do it when idle */
+static void onScroll(GtkAdjustment*, gpointer)
+{
+	if (!ts.pending && (nearTop() || nearBottom())) {
+		ts.pending = 1;
+		g_idle_add(pageIn,NULL);
+	}
+}
+
+int ts_init(GtkTextView* view, GtkScrolledWindow* sw)
+{
+	memset(&ts,0,sizeof(ts));
+	ts.log = tmpfile(); /* already unlinked; goes away with us */
+	if (!ts.log) {
+		perror("transcript: could not create log");
+		return -1;
+	}
+	ts.view = view;
+	ts.buf = gtk_text_view_get_buffer(view);
+	ts.vadj = gtk_scrolled_window_get_vadjustment(sw);
+	ts.mark = gtk_text_mark_new(NULL,TRUE);
+	search_init(&ts.words);
+	g_signal_connect(ts.vadj,"value-changed",G_CALLBACK(onScroll),NULL);
+	return 0;
+}
+
+/* make sure ts.text has room for len more bytes after used */
+static int textReserve(size_t used, size_t len)
+{
+	if (used + len <= ts.textcap) return 0;
+	size_t cap = ts.textcap ? ts.textcap : 4096;
+	while (cap < used + len) cap *= 2;
+	char* text = realloc(ts.text,cap);
+	if (!text) return -1;
+	ts.text = text;
+	ts.textcap = cap;
+	return 0;
+}
+
+/* replace the window with (up to) TS_WINDOW messages from lo on */
+static void reloadAt(size_t lo)
+{
+	GtkTextIter t0, t1;
+	gtk_text_buffer_get_start_iter(ts.buf,&t0);
+	gtk_text_buffer_get_end_iter(ts.buf,&t1);
+	gtk_text_buffer_delete(ts.buf,&t0,&t1);
+	size_t n = (ts.total - lo < TS_WINDOW) ? ts.total - lo : TS_WINDOW;
+	ts.head = 0;
+	ts.lo = ts.hi = lo;
+	ts.hi += loadRange(lo,n,&t1,ts.chars);
+}
+
+/* the window only holds messages up to the end of the log, so after
+ * scrolling back (or a huge batch), start over with the latest ones. */
+static void reloadTail()
+{
+	reloadAt((ts.total > TS_WINDOW) ? ts.total - TS_WINDOW : 0);
+}
+
+static void scrollToEnd()
+{
+	GtkTextIter it;
+	gtk_text_buffer_get_end_iter(ts.buf,&it);
+	gtk_text_buffer_add_mark(ts.buf,ts.mark,&it);
+	gtk_text_view_scroll_to_mark(ts.view,ts.mark,0.0,0,0.0,0.0);
+	gtk_text_buffer_delete_mark(ts.buf,ts.mark);
+}
+
+int ts_append_batch(const tsEntry* e, size_t n)
+{
+	/* if we're showing the end of the transcript and the batch is small,
+	 * all of it goes in with one insert; otherwise we reload. */
+	int live = (ts.hi == ts.total && n <= TS_PAGE);
+	tsSpan spans[2*TS_PAGE];
+	size_t nspans = 0, used = 0;
+	gint nchars = 0;
+	int rv = 0;
+	for (size_t i = 0; i < n; i++) {
+		tsMsg m = {e[i].kind, e[i].name ? e[i].name : "",
+			e[i].name ? strnlen(e[i].name,255) : 0, e[i].text, e[i].len};
+		/* the buffer only takes UTF-8; the network might send anything */
+		char* fixed = NULL;
+		if (!g_utf8_validate(m.text,m.tlen,NULL)) {
+			fixed = g_utf8_make_valid(m.text,m.tlen);
+			m.text = fixed;
+			m.tlen = strlen(fixed);
+		}
+		if (logWrite(&m) != 0) {
+			perror("transcript: could not log message");
+			g_free(fixed);
+			rv = -1;
+			break;
+		}
+		if (search_add(&ts.words,m.text,m.tlen) != 0)
+			LOGE("transcript: out of memory for search index");
+		if (ts.hist && m.kind != TS_STATUS &&
+				hist_append(ts.hist,m.kind,m.name,m.nlen,m.text,m.tlen) != 0)
+			LOGW("transcript: could not save message to history");
+		if (live) {
+			int nl = (m.tlen == 0 || m.text[m.tlen-1] != '\n');
+			if (textReserve(used,m.nlen + m.tlen + nl) != 0) {
+				g_free(fixed);
+				rv = -1;
+				break;
+			}
+			gint c0 = nchars;
+			gint nameChars = g_utf8_strlen(m.name,m.nlen);
+			gint textChars = g_utf8_strlen(m.text,m.tlen) + nl;
+			if (m.kind == TS_STATUS)
+				spans[nspans++] = (tsSpan){c0 + nameChars, c0 + nameChars + textChars, m.kind};
+			if (m.nlen)
+				spans[nspans++] = (tsSpan){c0, c0 + nameChars, m.kind};
+			memcpy(ts.text + used,m.name,m.nlen);
+			memcpy(ts.text + used + m.nlen,m.text,m.tlen);
+			if (nl) ts.text[used + m.nlen + m.tlen] = '\n';
+			used += m.nlen + m.tlen + nl;
+			nchars += nameChars + textChars;
+			ts.chars[(ts.head + windowLen()) % TS_CAP] = nameChars + textChars;
+			ts.hi++;
+		}
+		g_free(fixed);
+	}
+	GtkTextIter it, t0;
+	if (live) {
+		gtk_text_buffer_get_end_iter(ts.buf,&it);
+		gint base = gtk_text_iter_get_offset(&it);
+		gtk_text_buffer_insert(ts.buf,&it,ts.text,used);
+		for (size_t i = 0; i < nspans; i++) {
+			gtk_text_buffer_get_iter_at_offset(ts.buf,&t0,base + spans[i].start);
+			gtk_text_buffer_get_iter_at_offset(ts.buf,&it,base + spans[i].end);
+			gtk_text_buffer_apply_tag_by_name(ts.buf,tagName[spans[i].kind],&t0,&it);
+		}
+		if (windowLen() > TS_WINDOW)
+			trimFront(windowLen() - TS_WINDOW);
+	} else {
+		reloadTail();
+	}
+	scrollToEnd();
+	return rv;
+}
+
+int ts_append(int kind, const char* name, const char* text, size_t len)
+{
+	tsEntry e = {kind, name, text, len};
+	return ts_append_batch(&e,1);
+}
+
+size_t ts_count()
+{
+	return ts.total;
+}
+
+size_t ts_attach_history(history* h, searchIndex* words)
+{
+	/* history goes before everything so far, which moves up by as much */
+	ts.hist = h;
+	ts.hwords = words;
+	ts.base = hist_count(h);
+	ts.lo += ts.base;
+	ts.hi += ts.base;
+	ts.total += ts.base;
+	reloadTail();
+	scrollToEnd();
+	return ts.base;
+}
+
+size_t ts_find(const char* query, uint32_t* hits, size_t max)
+{
+	/* everything logged is newer than all of history */
+	size_t n = search_query(&ts.words,query,hits,max);
+	for (size_t i = 0; i < n; i++)
+		hits[i] += ts.base;
+	if (ts.hwords)
+		n += search_query(ts.hwords,query,hits + n,max - n);
+	return n;
+}
+void ts_show(size_t i)
+{
+	if (i >= ts.total) return;
+	if (i < ts.lo || i >= ts.hi)
+		reloadAt((i > TS_WINDOW/2) ? i - TS_WINDOW/2 : 0);
+	if (i < ts.lo || i >= ts.hi) return; /* log unreadable */
+	GtkTextIter t0, t1;
+	gint start = windowChars(i - ts.lo,1);
+	gtk_text_buffer_get_iter_at_offset(ts.buf,&t0,start);
+	gtk_text_buffer_get_iter_at_offset(ts.buf,&t1,
+			start + ts.chars[(ts.head + i - ts.lo) % TS_CAP]);
+	gtk_text_buffer_select_range(ts.buf,&t0,&t1);
+	gtk_text_view_scroll_to_iter(ts.view,&t0,0.0,TRUE,0.0,0.5);
+}
+
+void ts_close()
+{
+	if (ts.log) fclose(ts.log);
+	free(ts.index);
+	free(ts.rbuf);
+	free(ts.text);
+	search_free(&ts.words);
+	memset(&ts,0,sizeof(ts));
+}
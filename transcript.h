@@ -0,0 +1,61 @@
+/* Bounded chat transcript: the GtkTextBuffer only holds a window of recent
+ * messages.  Every message is also appended to a log file, from which
+ * older ones are paged back in as the user scrolls up, so memory and
+ * layout cost stay flat however long the session runs.  Messages from
+ * earlier sessions are paged in the same way, straight from history. */
+#pragma once
+#include <gtk/gtk.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "history.h"
+#include "search.h"
+
+#define TS_WINDOW 500  /* messages normally kept in the text buffer */
+#define TS_PAGE   100  /* messages paged in per scrollback step */
+
+/* kinds of message; each is shown with the text tag of the same name */
+enum { TS_STATUS, TS_SELF, TS_FRIEND, TS_NKINDS };
+
+typedef struct {
+	int kind;
+	const char* name;
+	const char* text;
+	size_t len;
+} tsEntry;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/** Set up the transcript for view, which lives in the scrolled window sw.
+ * The buffer must already have "status", "self" and "friend" tags.
+ * @return 0 on success, -1 if the log file could not be created. */
+int ts_init(GtkTextView* view, GtkScrolledWindow* sw);
+/** Append a message: name (may be NULL) in the style for kind, then len
+ * bytes of text, plus a newline if text doesn't end with one.  Jumps the
+ * view to the end of the transcript.
+ * @return 0 on success, -1 if the message could not be logged. */
+int ts_append(int kind, const char* name, const char* text, size_t len);
+/** Append n messages at once: one buffer insert, one scroll.  Invalid
+ * UTF-8 in the text is replaced.
+ * @return 0 on success, -1 if some could not be logged. */
+int ts_append_batch(const tsEntry* e, size_t n);
+/** Put the messages in h before everything in the transcript (the view
+ * jumps to the end), then save every message appended from now on (except
+ * status lines) to h as well.  words must index exactly h's messages so
+ * far, numbered as in h (see search_add); ts_find searches it, but doesn't
+ * add to it.  Both must stay valid until ts_close.
+ * @return the number of messages from h. */
+size_t ts_attach_history(history* h, searchIndex* words);
+/** Number of messages in the transcript, history included. */
+size_t ts_count();
+/** Search the text of all messages, history included (see search_query).
+ * Stores up to max message numbers in hits, newest first; returns how
+ * many. */
+size_t ts_find(const char* query, uint32_t* hits, size_t max);
+/** Bring message i into view and select it. */
+void ts_show(size_t i);
+/** Close the log; the transcript must not be used afterwards. */
+void ts_close();
+#ifdef __cplusplus
+}
+#endif
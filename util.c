@@ -7,44 +7,133 @@
 #include <inttypes.h>
 #include <endian.h>
 #include <string.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
 
 /* when reading long integers, never read more than this many bytes: */
 #define MPZ_MAX_LEN 1024
 
-/* Like read(), but retry on EINTR and EWOULDBLOCK,
- * abort on other errors, and don't return early. */
-void xread(int fd, void *buf, size_t nBytes)
+int64_t monotonic_ms()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (int64_t)t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
+int64_t monotonic_ns()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (int64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+int poll_deadline(int fd, short events, int64_t deadline, int cancelfd)
 {
-	do
+	struct pollfd pfd[2] = {{fd, events, 0}, {cancelfd, POLLIN, 0}};
+	nfds_t nfds = (cancelfd >= 0) ? 2 : 1;
+	for (;;) {
+		int timeout = -1;
+		if (deadline) {
+			int64_t left = deadline - monotonic_ms();
+			if (left <= 0)
+				return -ETIMEDOUT;
+			timeout = (left > INT_MAX) ? INT_MAX : (int)left;
+		}
+		int r = poll(pfd, nfds, timeout);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			return -errno;
+		if (r == 0)
+			continue; /* timed out; the check above reports it */
+		if (nfds == 2 && pfd[1].revents)
+			return -ECANCELED;
+		return 0;
+	}
+}
+
+int xread_deadline(int fd, void *buf, size_t nBytes, int64_t deadline, int cancelfd)
+{
+	/* with no deadline or cancellation we can just try the read, and only
+	 * poll if the fd is non-blocking and has nothing for us yet. */
+	int mustPoll = deadline || cancelfd >= 0;
+	while (nBytes)
 	{
+		if (mustPoll) {
+			int rv = poll_deadline(fd, POLLIN, deadline, cancelfd);
+			if (rv)
+				return rv;
+		}
 		ssize_t n = read(fd, buf, nBytes);
+		if (n == 0)
+			return -EPIPE; /* EOF before we got everything */
 		if (n < 0 && errno == EINTR)
 			continue;
-		if (n < 0 && errno == EWOULDBLOCK)
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			int rv = mustPoll ? 0 : poll_deadline(fd, POLLIN, 0, -1);
+			if (rv)
+				return rv;
 			continue;
+		}
 		if (n < 0)
-			perror("read"), abort();
+			return -errno;
 		buf = (char *)buf + n;
 		nBytes -= n;
-	} while (nBytes);
+	}
+	return 0;
 }
 
-/* Like write(), but retry on EINTR and EWOULDBLOCK,
- * abort on other errors, and don't return early. */
-void xwrite(int fd, const void *buf, size_t nBytes)
+int xwrite_deadline(int fd, const void *buf, size_t nBytes, int64_t deadline, int cancelfd)
 {
-	do
+	int mustPoll = deadline || cancelfd >= 0;
+	int isSocket = 1; /* use send() so a closed peer can't SIGPIPE us */
+	while (nBytes)
 	{
-		ssize_t n = write(fd, buf, nBytes);
+		if (mustPoll) {
+			int rv = poll_deadline(fd, POLLOUT, deadline, cancelfd);
+			if (rv)
+				return rv;
+		}
+		ssize_t n = isSocket ? send(fd, buf, nBytes, MSG_NOSIGNAL)
+		                     : write(fd, buf, nBytes);
+		if (n < 0 && errno == ENOTSOCK) {
+			isSocket = 0;
+			continue;
+		}
 		if (n < 0 && errno == EINTR)
 			continue;
-		if (n < 0 && errno == EWOULDBLOCK)
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			int rv = mustPoll ? 0 : poll_deadline(fd, POLLOUT, 0, -1);
+			if (rv)
+				return rv;
 			continue;
+		}
 		if (n < 0)
-			perror("write"), abort();
+			return -errno;
 		buf = (const char *)buf + n;
 		nBytes -= n;
-	} while (nBytes);
+	}
+	return 0;
+}
+
+/* Like read(), but retry on EINTR and EWOULDBLOCK,
+ * abort on other errors, and don't return early. */
+void xread(int fd, void *buf, size_t nBytes)
+{
+	int rv = xread_deadline(fd, buf, nBytes, 0, -1);
+	if (rv)
+		errno = -rv, perror("read"), abort();
+}
+
+/* Like write(), but retry on EINTR and EWOULDBLOCK,
+ * abort on other errors, and don't return early. */
+void xwrite(int fd, const void *buf, size_t nBytes)
+{
+	int rv = xwrite_deadline(fd, buf, nBytes, 0, -1);
+	if (rv)
+		errno = -rv, perror("write"), abort();
 }
 
 size_t serialize_mpz(int fd, mpz_t x)
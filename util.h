@@ -1,5 +1,6 @@
 #pragma once
 #include <gmp.h>
+#include <stdint.h>
 /* convenience macros */
 #define ISPRIME(x) mpz_probab_prime_p(x,10)
 #define NEWZ(x) mpz_t x; mpz_init(x)
@@ -25,14 +26,40 @@ size_t serialize_mpz(int fd, mpz_t x);
  * @return 0 for success */
 int deserialize_mpz(mpz_t x, int fd);
 
-/** Like read(), but retry on EINTR and EWOULDBLOCK,
- * abort on other errors, and don't return early. */
+/** Like read(), but retry on EINTR and EWOULDBLOCK (waiting in poll()
+ * rather than spinning), abort on other errors or EOF, and don't return
+ * early. */
 void xread(int fd, void *buf, size_t nBytes);
 
 /** Like write(), but retry on EINTR and EWOULDBLOCK,
  * abort on other errors, and don't return early. */
 void xwrite(int fd, const void *buf, size_t nBytes);
 
+/** Milliseconds on CLOCK_MONOTONIC, for the deadlines below. */
+int64_t monotonic_ms();
+/** Nanoseconds on CLOCK_MONOTONIC, for timing things. */
+int64_t monotonic_ns();
+
+/** Wait until fd is ready for events (POLLIN, POLLOUT), the deadline
+ * passes, or cancelfd becomes readable; deadline and cancelfd are as for
+ * xread_deadline below.
+ * @return 0 if fd is ready (or has an error / hangup for read or write to
+ * report), otherwise -ETIMEDOUT, -ECANCELED or poll()'s negative errno. */
+int poll_deadline(int fd, short events, int64_t deadline, int cancelfd);
+
+/** Read exactly nBytes from fd, waiting in poll() whenever it isn't ready.
+ * Works on blocking and non-blocking fds.
+ * @param deadline is an absolute monotonic_ms() time to give up at, or 0
+ * to wait forever.
+ * @param cancelfd, if >= 0, aborts the read as soon as it is readable
+ * (e.g. the read end of a pipe that another thread writes to).
+ * @return 0 on success, or a negative errno: -ETIMEDOUT, -ECANCELED, -EPIPE
+ * if the peer closed first, or whatever read() failed with. */
+int xread_deadline(int fd, void *buf, size_t nBytes, int64_t deadline, int cancelfd);
+
+/** Write counterpart of xread_deadline.  Never raises SIGPIPE. */
+int xwrite_deadline(int fd, const void *buf, size_t nBytes, int64_t deadline, int cancelfd);
+
 int sendPublicKey(int socket, mpz_t publicKey);
 
 int receivePublicKey(int socket, mpz_t publicKey);
\ No newline at end of file